@@ -12,7 +12,7 @@
 
 #include "internal.h"
 
-static void
+void
 pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int type)
 {
   struct pci_cap *cap = pci_malloc(d->access, sizeof(*cap));
@@ -146,3 +146,18 @@ pci_find_cap_nr(struct pci_dev *d, unsigned int id, unsigned int type,
     *cap_number = index;
   return found;
 }
+
+struct pci_cap *
+pci_find_cap_by_pos(struct pci_dev *d, unsigned int pos)
+{
+  unsigned int type = (pos < 0x100) ? PCI_CAP_NORMAL : PCI_CAP_EXTENDED;
+  struct pci_cap *c, *found = NULL;
+
+  pci_fill_info_v315(d, ((type == PCI_CAP_NORMAL) ? PCI_FILL_CAPS : PCI_FILL_EXT_CAPS));
+
+  /* Capabilities have no explicit length, so pick the nearest one starting before pos */
+  for (c=d->first_cap; c; c=c->next)
+    if (c->type == type && c->addr <= pos && (!found || c->addr > found->addr))
+      found = c;
+  return found;
+}
@@ -0,0 +1,85 @@
+/*
+ *	The PCI Library -- Comparison of Configuration Space Images
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ *  Most of the config space usually does not differ, so we skip over
+ *  identical 32-byte blocks using 64-bit compares and only look at
+ *  individual dwords within blocks which differ. This is portable and
+ *  with current compilers, the block loop is vectorized anyway.
+ */
+
+#define DIFF_BLOCK 32
+
+static inline u64
+diff_load64(const byte *p)
+{
+  u64 x;
+  memcpy(&x, p, 8);
+  return x;
+}
+
+static inline int
+diff_block_same(const byte *a, const byte *b)
+{
+  u64 x = (diff_load64(a) ^ diff_load64(b)) |
+	  (diff_load64(a+8) ^ diff_load64(b+8)) |
+	  (diff_load64(a+16) ^ diff_load64(b+16)) |
+	  (diff_load64(a+24) ^ diff_load64(b+24));
+  return !x;
+}
+
+int
+pci_config_diff(u8 *a, u8 *b, int len, struct pci_diff_range *ranges, int max_ranges)
+{
+  int pos = 0, n = 0, start = -1;
+
+  while (pos < len)
+    {
+      int dl;
+
+      if (start < 0 && !(pos % DIFF_BLOCK) && pos + DIFF_BLOCK <= len && diff_block_same(a + pos, b + pos))
+	{
+	  pos += DIFF_BLOCK;
+	  continue;
+	}
+
+      /* Compare a single dword (or whatever is left of the image) */
+      dl = (len - pos < 4) ? len - pos : 4;
+      if (memcmp(a + pos, b + pos, dl))
+	{
+	  if (start < 0)
+	    start = pos;
+	}
+      else if (start >= 0)
+	{
+	  if (n < max_ranges)
+	    {
+	      ranges[n].pos = start;
+	      ranges[n].len = pos - start;
+	    }
+	  n++;
+	  start = -1;
+	}
+      pos += dl;
+    }
+
+  if (start >= 0)
+    {
+      if (n < max_ranges)
+	{
+	  ranges[n].pos = start;
+	  ranges[n].len = len - start;
+	}
+      n++;
+    }
+  return n;
+}
@@ -1,5 +1,5 @@
 /*
- *	The PCI Library -- Reading of Bus Dumps
+ *	The PCI Library -- Reading of Bus Dumps and Snapshots
  *
  *	Copyright (c) 1997--2026 Martin Mares <mj@ucw.cz>
  *
@@ -9,21 +9,66 @@
  */
 
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include "internal.h"
 
+#ifdef PCI_COMPRESSED_IDS
+#include <zlib.h>
+#if ZLIB_VERNUM >= 0x1271
+#define DUMP_USE_ZINDEX			/* Needs inflateGetDictionary() */
+#endif
+#endif
+
+#if !defined(PCI_OS_WINDOWS) && !defined(PCI_OS_DJGPP)
+#define DUMP_USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 struct dump_data {
-  int len, allocated;
-  byte data[1];
+  int len, allocated;			/* allocated == 0 if data point to a mapped snapshot */
+  byte *data;				/* Config space */
+  byte *props, *props_end;		/* Device properties from a snapshot */
+  const char *text, *text_end;		/* Data lines of a text dump, which have not been parsed yet */
+  size_t zstart, zend;			/* The same in a compressed text dump, zend == 0 once parsed */
+  byte *base;				/* Config space in the base snapshot of a time series */
+  int index;				/* Index of the device in the snapshot */
+};
+
+/* Access point to a compressed text dump, from which decompression can be restarted */
+struct dump_zpoint {
+  size_t out;				/* Position in the decompressed data */
+  size_t in;				/* Position in the compressed data */
+  int bits;				/* Bits of the preceding byte which belong to the next block,
+					   -1 if a gzip member starts here */
+  unsigned int window_len;		/* Preceding decompressed data (none at member start) */
+  byte *window;
+};
+
+/* Contents of the dump file, either mapped to memory or read to a buffer */
+struct dump_file {
+  char *buf;
+  size_t size;
+  int mapped;
+  struct pci_dev **devs;		/* Devices indexed by their position in a snapshot or compressed dump */
+  int num_devs, max_devs;
+  /* Time series stored in a snapshot */
+  byte **samples;			/* Sample records */
+  int num_samples, max_samples;
+  struct dump_zpoint **zpoints;		/* Access points to a compressed text dump */
+  int num_zpoints, max_zpoints;
 };
 
 static void
 dump_config(struct pci_access *a)
 {
   pci_define_param(a, "dump.name", "", "Name of the bus dump file to read from");
+  pci_define_param(a, "dump.sample", "", "Sample of a time series to show (default: the base snapshot)");
 }
 
 static int
@@ -33,118 +78,996 @@ dump_detect(struct pci_access *a)
   return name && name[0];
 }
 
+static const char *
+dump_read_stream(struct pci_access *a, FILE *f, struct dump_file *df)
+{
+  size_t allocated = 65536;
+
+  df->buf = pci_malloc(a, allocated);
+  df->size = 0;
+  df->mapped = 0;
+  for (;;)
+    {
+      size_t n = fread(df->buf + df->size, 1, allocated - df->size, f);
+      df->size += n;
+      if (df->size < allocated)
+	break;
+      allocated *= 2;
+      df->buf = pci_realloc(a, df->buf, allocated);
+    }
+  if (ferror(f))
+    {
+      pci_mfree(df->buf);
+      return strerror(errno);
+    }
+  return NULL;
+}
+
+static const char *
+dump_open(struct pci_access *a, char *name, struct dump_file *df)
+{
+  const char *err;
+  FILE *f;
+
+  if (!strcmp(name, "-"))
+    return dump_read_stream(a, stdin, df);
+
+#ifdef DUMP_USE_MMAP
+  {
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+      return strerror(errno);
+    if (fstat(fd, &st) >= 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+      {
+	/* Private writable mapping, pci_write_*() update the cache before calling dump_write() */
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED)
+	  {
+	    close(fd);
+	    df->buf = map;
+	    df->size = st.st_size;
+	    df->mapped = 1;
+	    return NULL;
+	  }
+      }
+    close(fd);
+  }
+#endif
+
+  f = fopen(name, "r");
+  if (!f)
+    return strerror(errno);
+  err = dump_read_stream(a, f, df);
+  fclose(f);
+  return err;
+}
+
 static void
-dump_alloc_data(struct pci_dev *dev, int len)
+dump_close(struct dump_file *df)
 {
-  struct dump_data *dd = pci_malloc(dev->access, sizeof(struct dump_data) + len - 1);
-  dd->allocated = len;
-  dd->len = 0;
-  memset(dd->data, 0xff, len);
+  int i;
+
+  for (i=0; i<df->num_zpoints; i++)
+    {
+      pci_mfree(df->zpoints[i]->window);
+      pci_mfree(df->zpoints[i]);
+    }
+  pci_mfree(df->zpoints);
+  df->zpoints = NULL;
+  df->num_zpoints = df->max_zpoints = 0;
+
+#ifdef DUMP_USE_MMAP
+  if (df->mapped)
+    {
+      munmap(df->buf, df->size);
+      return;
+    }
+#endif
+  pci_mfree(df->buf);
+}
+
+#ifdef PCI_COMPRESSED_IDS
+
+/* Replace contents of a gzip-compressed dump by the decompressed data */
+static const char *
+dump_gunzip(struct pci_access *a, struct dump_file *df)
+{
+  size_t allocated = 4*df->size + 65536, in_pos = 0, out_pos = 0;
+  const char *err = NULL;
+  char *out;
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK)
+    return "Cannot initialize zlib";
+  out = pci_realloc(a, NULL, allocated);
+
+  for (;;)
+    {
+      /* zlib counts bytes in uInt, so feed huge buffers in chunks */
+      if (!z.avail_in && in_pos < df->size)
+	{
+	  z.next_in = (Bytef *) df->buf + in_pos;
+	  z.avail_in = (df->size - in_pos < (1U << 30)) ? df->size - in_pos : (1U << 30);
+	  in_pos += z.avail_in;
+	}
+      if (out_pos == allocated)
+	{
+	  allocated *= 2;
+	  out = pci_realloc(a, out, allocated);
+	}
+      z.next_out = (Bytef *) out + out_pos;
+      z.avail_out = (allocated - out_pos < (1U << 30)) ? allocated - out_pos : (1U << 30);
+      ret = inflate(&z, Z_NO_FLUSH);
+      out_pos = (char *) z.next_out - out;
+      if (ret == Z_STREAM_END)
+	{
+	  /* Concatenated gzip members are allowed */
+	  if (!z.avail_in && in_pos == df->size)
+	    break;
+	  inflateReset(&z);
+	}
+      else if (ret == Z_BUF_ERROR && !z.avail_in && in_pos == df->size)
+	{
+	  err = "Truncated compressed data";
+	  break;
+	}
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+	{
+	  err = "Corrupted compressed data";
+	  break;
+	}
+    }
+  inflateEnd(&z);
+
+  if (err)
+    {
+      pci_mfree(out);
+      return err;
+    }
+  dump_close(df);
+  df->buf = out;
+  df->size = out_pos;
+  df->mapped = 0;
+  return NULL;
+}
+
+#endif
+
+static struct dump_data *
+dump_new_data(struct pci_dev *dev)
+{
+  struct dump_data *dd = pci_malloc(dev->access, sizeof(struct dump_data));
+  memset(dd, 0, sizeof(*dd));
   dev->backend_data = dd;
+  return dd;
 }
 
-static int
-dump_validate(char *s, char *fmt)
+static void
+dump_alloc_data(struct pci_access *a, struct dump_data *dd, int len)
 {
-  while (*fmt)
+  byte *data = pci_malloc(a, len);
+
+  memset(data, 0xff, len);
+  if (dd->data)
     {
-      if (*fmt == '#' ? !isxdigit(*s) : *fmt != *s)
-	return 0;
-      fmt++, s++;
+      memcpy(data, dd->data, dd->allocated);
+      pci_mfree(dd->data);
     }
+  dd->data = data;
+  dd->allocated = len;
+}
+
+/*
+ *  The dump file is mapped to memory if possible. At init time, we only scan
+ *  it for device header lines and remember where the data lines of each device
+ *  are; they are parsed when the device is accessed for the first time.
+ *  This keeps selective queries against huge dumps fast and memory proportional
+ *  to the number of devices actually touched.
+ *
+ *  Hex digits are decoded by a table lookup, which gives value+1 for valid
+ *  digits and 0 for anything else.
+ */
+
+static const byte dump_hex[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+#define HEX(c) (dump_hex[(byte)(c)] - 1)
+#define IS_HEX(c) (dump_hex[(byte)(c)] != 0)
+
+/* Parse a hexadecimal number, return the number of digits */
+static int
+dump_hex_number(const char *s, const char *end, unsigned int *val)
+{
+  const char *start = s;
+  unsigned int v = 0;
+
+  while (s < end && IS_HEX(*s) && s - start < 8)
+    v = (v << 4) | HEX(*s++);
+  *val = v;
+  return s - start;
+}
+
+/*
+ *  Recognize a device header line: [<domain>:]<bus>:<dev>.<func> followed
+ *  by a space, where the domain has 4 to 6 hex digits, bus and device 2 hex
+ *  digits each and the function is a single decimal digit.
+ */
+static int
+dump_parse_slot(const char *s, const char *end, unsigned int *mn, unsigned int *bn, unsigned int *dn, unsigned int *fn)
+{
+  int n = dump_hex_number(s, end, mn);
+
+  if (n >= 4 && n <= 6 && s + n < end && s[n] == ':')
+    s += n+1;
+  else if (n == 2)
+    *mn = 0;
+  else
+    return 0;
+  if (end - s < 8 ||
+      !IS_HEX(s[0]) || !IS_HEX(s[1]) || s[2] != ':' ||
+      !IS_HEX(s[3]) || !IS_HEX(s[4]) || s[5] != '.' ||
+      s[6] < '0' || s[6] > '9' || s[7] != ' ')
+    return 0;
+  *bn = (HEX(s[0]) << 4) | HEX(s[1]);
+  *dn = (HEX(s[3]) << 4) | HEX(s[4]);
+  *fn = s[6] - '0';
   return 1;
 }
 
+/* Find the end of a line and of its contents (without the trailing CR) */
+static const char *
+dump_next_line(const char *line, const char *end, const char **eol)
+{
+  const char *e = memchr(line, '\n', end - line);
+  const char *next = e ? e + 1 : end;
+
+  if (!e)
+    e = end;
+  if (e > line && e[-1] == '\r')
+    e--;
+  *eol = e;
+  return next;
+}
+
 static const char *
-dump_parse(struct pci_access *a, FILE *f)
-{
-  char buf[256];
-  struct pci_dev *dev = NULL;
-  int len, mn, bn, dn, fn, i, j;
-
-  while (fgets(buf, sizeof(buf)-1, f))
-    {
-      char *z = strchr(buf, '\n');
-      if (!z)
-	return "Line too long or unterminated";
-      *z-- = 0;
-      if (z >= buf && *z == '\r')
-	*z-- = 0;
-      len = z - buf + 1;
-      mn = 0;
-      if (dump_validate(buf, "##:##.# ") && sscanf(buf, "%x:%x.%d", &bn, &dn, &fn) == 3 ||
-	  dump_validate(buf, "####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4 ||
-	  dump_validate(buf, "#####:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4 ||
-	  dump_validate(buf, "######:##:##.# ") && sscanf(buf, "%x:%x:%x.%d", &mn, &bn, &dn, &fn) == 4)
-	{
-	  dev = pci_get_dev(a, mn, bn, dn, fn);
-	  dump_alloc_data(dev, 256);
+dump_parse_data(struct pci_access *a, struct dump_data *dd, unsigned int i, const char *z, const char *end)
+{
+  while (end - z >= 2 && IS_HEX(z[0]) && IS_HEX(z[1]) && (end - z == 2 || z[2] == ' '))
+    {
+      if (i >= 4096)
+	return "At most 4096 bytes of config space are supported";
+      if (i >= (unsigned int) dd->allocated)	/* Need to re-allocate the buffer */
+	dump_alloc_data(a, dd, 4096);
+      dd->data[i++] = (HEX(z[0]) << 4) | HEX(z[1]);
+      if (i > (unsigned int) dd->len)
+	dd->len = i;
+      z += 2;
+      if (z < end)
+	z++;
+    }
+  if (z < end)
+    return "Malformed line";
+  return NULL;
+}
+
+/* Parse data lines of a device */
+static void
+dump_parse_lines(struct pci_dev *d, struct dump_data *dd, const char *text, const char *end)
+{
+  const char *line, *eol, *next;
+
+  dump_alloc_data(d->access, dd, 256);
+  for (line = text; line < end; line = next)
+    {
+      unsigned int i;
+      int n;
+
+      next = dump_next_line(line, end, &eol);
+      if ((n = dump_hex_number(line, eol, &i)) >= 2 &&
+	  eol - line >= n+2 && line[n] == ':' && line[n+1] == ' ')
+	{
+	  const char *err = dump_parse_data(d->access, dd, i, line + n + 2, eol);
+	  if (err)
+	    d->access->error("dump: %s (device %04x:%02x:%02x.%d)", err, d->domain, d->bus, d->dev, d->func);
+	}
+    }
+}
+
+/* Build the list of devices, remembering where their data lines start and end */
+static void
+dump_parse(struct pci_access *a, const char *buf, size_t size)
+{
+  const char *line, *eol, *next, *end = buf + size;
+  struct dump_data *dd = NULL;
+
+  for (line = buf; line < end; line = next)
+    {
+      unsigned int mn, bn, dn, fn;
+
+      next = dump_next_line(line, end, &eol);
+      if (dump_parse_slot(line, eol, &mn, &bn, &dn, &fn))
+	{
+	  struct pci_dev *dev = pci_get_dev(a, mn, bn, dn, fn);
+	  if (dd)
+	    dd->text_end = line;
+	  dd = dump_new_data(dev);
+	  dd->text = next;
 	  pci_link_dev(a, dev);
 	}
-      else if (!len)
-	dev = NULL;
-      else if (dev &&
-	       (dump_validate(buf, "##: ") || dump_validate(buf, "###: ") || dump_validate(buf, "####: ") ||
-		dump_validate(buf, "#####: ") || dump_validate(buf, "######: ") ||
-		dump_validate(buf, "#######: ") || dump_validate(buf, "########: ")) &&
-	       sscanf(buf, "%x: ", &i) == 1)
-	{
-	  struct dump_data *dd = dev->backend_data;
-	  z = strchr(buf, ' ') + 1;
-	  while (isxdigit(z[0]) && isxdigit(z[1]) && (!z[2] || z[2] == ' ') &&
-		 sscanf(z, "%x", &j) == 1 && j < 256)
+      else if (eol == line && dd)
+	{
+	  dd->text_end = line;
+	  dd = NULL;
+	}
+    }
+  if (dd)
+    dd->text_end = end;
+}
+
+/*
+ *  Binary snapshots. All numbers are little-endian and all records and
+ *  properties are padded to multiples of 4 bytes, so config space data
+ *  can be used directly from the mapped file.
+ *
+ *	Header:		8-byte magic, u32 version, u32 size of the header
+ *	Device:		u32 size of the record, u32 domain, u8 bus, dev, func, 0 (type),
+ *			u16 config space length, u16 0, config space, properties
+ *	Property:	u32 key (PCI_FILL_xxx), u32 length, data
+ *	Sample:		u32 size of the record, u32 time (seconds), u8 0, 0, 0, 1 (type),
+ *			u32 time (microseconds), changes
+ *	Change:		u32 device index << 10 | dword index, u32 XOR mask
+ *
+ *  Properties carry either a NUL-terminated string or an array of u64
+ *  values (s32 for the IRQ and NUMA node) in the order of struct pci_dev.
+ *
+ *  Device records form the base snapshot. Optional sample records follow,
+ *  each of them describing changed dwords of config space relative to the
+ *  previous sample. Devices are indexed in the order of their records,
+ *  changes in a sample are sorted by their key.
+ */
+
+#define SNAPSHOT_MAGIC "PCISNAP\x1a"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HDR_SIZE 16
+#define SNAPSHOT_DEV_SIZE 16
+#define SNAPSHOT_ALIGN(x) (((x) + 3) & ~3U)
+#define SNAPSHOT_REC_DEVICE 0
+#define SNAPSHOT_REC_SAMPLE 1
+#define SNAPSHOT_MAX_DEVS (1 << 22)
+#define SERIES_KEY(index, pos) (((u32)(index) << 10) | ((pos) >> 2))
+
+#define SNAPSHOT_STRINGS (PCI_FILL_PHYS_SLOT | PCI_FILL_MODULE_ALIAS | PCI_FILL_LABEL | PCI_FILL_DT_NODE | \
+			  PCI_FILL_IOMMU_GROUP | PCI_FILL_DRIVER)
+#define SNAPSHOT_RESOURCES (PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES | PCI_FILL_IO_FLAGS | PCI_FILL_BRIDGE_BASES)
+#define SNAPSHOT_PROPS (SNAPSHOT_STRINGS | SNAPSHOT_RESOURCES | PCI_FILL_IRQ | PCI_FILL_NUMA_NODE)
+
+static inline u32
+snapshot_get32(byte *p)
+{
+  return le32_to_cpu(*(u32 *) p);
+}
+
+static inline u64
+snapshot_get64(byte *p)
+{
+  return snapshot_get32(p) | ((u64) snapshot_get32(p+4) << 32);
+}
+
+/* Expected length of a property, 0 for strings, -1 if unknown */
+static int
+snapshot_prop_len(u32 key)
+{
+  if (key & ~SNAPSHOT_PROPS || !key || key & (key-1))
+    return -1;
+  switch (key)
+    {
+    case PCI_FILL_IRQ:
+    case PCI_FILL_NUMA_NODE:
+      return 4;
+    case PCI_FILL_BASES:
+      return 6*8;
+    case PCI_FILL_ROM_BASE:
+      return 8;
+    case PCI_FILL_SIZES:
+    case PCI_FILL_IO_FLAGS:
+      return 7*8;
+    case PCI_FILL_BRIDGE_BASES:
+      return 12*8;
+    default:
+      return 0;
+    }
+}
+
+static const char *
+series_check_sample(struct dump_file *df, byte *rec)
+{
+  u32 rec_len = snapshot_get32(rec);
+  u32 last = 0;
+  byte *e;
+
+  if ((rec_len - SNAPSHOT_DEV_SIZE) % 8 || rec[8] || rec[9] || rec[10])
+    return "Malformed sample record";
+  for (e = rec + SNAPSHOT_DEV_SIZE; e < rec + rec_len; e += 8)
+    {
+      u32 key = snapshot_get32(e);
+      u32 index = key >> 10;
+      if (e > rec + SNAPSHOT_DEV_SIZE && key <= last ||
+	  index >= (u32) df->num_devs ||
+	  ((key & 1023) + 1) * 4 > (u32) ((struct dump_data *) df->devs[index]->backend_data)->len)
+	return "Malformed sample record";
+      last = key;
+    }
+  return NULL;
+}
+
+static const char *
+snapshot_parse(struct pci_access *a, byte *buf, size_t size)
+{
+  struct dump_file *df = a->backend_data;
+  byte *p = buf, *end = buf + size;
+  const char *err;
+  char *sample;
+
+  if (size < SNAPSHOT_HDR_SIZE || snapshot_get32(buf + 12) < SNAPSHOT_HDR_SIZE)
+    return "Malformed snapshot header";
+  if (snapshot_get32(buf + 8) != SNAPSHOT_VERSION)
+    return "Unsupported snapshot version";
+  if (snapshot_get32(buf + 12) > size)
+    return "Truncated snapshot";
+  p += SNAPSHOT_ALIGN(snapshot_get32(buf + 12));
+
+  while (p < end)
+    {
+      u32 rec_len, cfg_len;
+      struct pci_dev *dev;
+      struct dump_data *dd;
+
+      if (end - p < SNAPSHOT_DEV_SIZE)
+	return "Truncated snapshot";
+      rec_len = snapshot_get32(p);
+      if (rec_len & 3 || rec_len < SNAPSHOT_DEV_SIZE || rec_len > (size_t)(end - p))
+	return "Malformed snapshot record";
+
+      switch (p[11])
+	{
+	case SNAPSHOT_REC_DEVICE:
+	  cfg_len = p[12] | (p[13] << 8);
+	  if (cfg_len > 4096 || SNAPSHOT_DEV_SIZE + SNAPSHOT_ALIGN(cfg_len) > rec_len ||
+	      df->num_samples || df->num_devs >= SNAPSHOT_MAX_DEVS)
+	    return "Malformed snapshot record";
+	  dev = pci_get_dev(a, snapshot_get32(p+4), p[8], p[9], p[10]);
+	  dd = dump_new_data(dev);
+	  dd->len = cfg_len;
+	  dd->data = dd->base = p + SNAPSHOT_DEV_SIZE;
+	  dd->props = dd->data + SNAPSHOT_ALIGN(cfg_len);
+	  dd->props_end = p + rec_len;
+	  dd->index = df->num_devs;
+	  pci_setup_cache(dev, dd->data, cfg_len);
+	  pci_link_dev(a, dev);
+	  if (df->num_devs >= df->max_devs)
+	    {
+	      df->max_devs = df->max_devs ? 2*df->max_devs : 256;
+	      df->devs = pci_realloc(a, df->devs, df->max_devs * sizeof(*df->devs));
+	    }
+	  df->devs[df->num_devs++] = dev;
+	  break;
+	case SNAPSHOT_REC_SAMPLE:
+	  if (err = series_check_sample(df, p))
+	    return err;
+	  if (df->num_samples >= df->max_samples)
 	    {
-	      if (i >= 4096)
-		return "At most 4096 bytes of config space are supported";
-	      if (i >= dd->allocated)	/* Need to re-allocate the buffer */
-		{
-		  dump_alloc_data(dev, 4096);
-		  memcpy(((struct dump_data *) dev->backend_data)->data, dd->data, 256);
-		  pci_mfree(dd);
-		  dd = dev->backend_data;
-		}
-	      dd->data[i++] = j;
-	      if (i > dd->len)
-		dd->len = i;
-	      z += 2;
-	      if (*z)
-		z++;
+	      df->max_samples = df->max_samples ? 2*df->max_samples : 256;
+	      df->samples = pci_realloc(a, df->samples, df->max_samples * sizeof(*df->samples));
 	    }
-	  if (*z)
-	    return "Malformed line";
+	  df->samples[df->num_samples++] = p;
+	  break;
+	default:
+	  return "Malformed snapshot record";
 	}
+      p += rec_len;
+    }
+
+  if ((sample = pci_get_param(a, "dump.sample")) && sample[0])
+    {
+      char *end;
+      long n = strtol(sample, &end, 10);
+      if (*end || !pci_series_select(a, n))
+	return "Invalid sample number";
     }
 
   return NULL;
 }
 
+/* Iterate over valid properties of a snapshot record */
+static byte *
+snapshot_next_prop(struct dump_data *dd, byte *p, u32 *key, byte **val)
+{
+  while (dd->props_end - p >= 8)
+    {
+      u32 len = snapshot_get32(p+4);
+      int want_len;
+
+      *key = snapshot_get32(p);
+      *val = p + 8;
+      if (len > (size_t)(dd->props_end - *val))
+	break;
+      p = *val + SNAPSHOT_ALIGN(len);
+      want_len = snapshot_prop_len(*key);
+      if (want_len > 0 ? len == (u32) want_len : !want_len && len && (*val)[len-1] == 0)
+	return p;
+    }
+  return NULL;
+}
+
+static void
+snapshot_fill_info(struct pci_dev *d, unsigned int flags)
+{
+  struct dump_data *dd = d->backend_data;
+  unsigned int stored = 0;
+  int want_resources, i;
+  byte *p, *v;
+  u32 key;
+
+  /*
+   *  Like the sysfs back-end, fill in all stored resources at once,
+   *  even if only some of them were asked for.
+   */
+  for (p = dd->props; p = snapshot_next_prop(dd, p, &key, &v); )
+    stored |= key;
+  stored &= SNAPSHOT_RESOURCES;
+  want_resources = stored && want_fill(d, flags, stored);
+
+  for (p = dd->props; p = snapshot_next_prop(dd, p, &key, &v); )
+    {
+      if ((key & SNAPSHOT_RESOURCES) ? !want_resources : !want_fill(d, flags, key))
+	continue;
+
+      switch (key)
+	{
+	case PCI_FILL_IRQ:
+	  d->irq = (int) snapshot_get32(v);
+	  break;
+	case PCI_FILL_NUMA_NODE:
+	  d->numa_node = (int) snapshot_get32(v);
+	  break;
+	case PCI_FILL_BASES:
+	  for (i=0; i<6; i++)
+	    d->base_addr[i] = snapshot_get64(v + 8*i);
+	  break;
+	case PCI_FILL_ROM_BASE:
+	  d->rom_base_addr = snapshot_get64(v);
+	  break;
+	case PCI_FILL_SIZES:
+	  for (i=0; i<6; i++)
+	    d->size[i] = snapshot_get64(v + 8*i);
+	  d->rom_size = snapshot_get64(v + 48);
+	  break;
+	case PCI_FILL_IO_FLAGS:
+	  for (i=0; i<6; i++)
+	    d->flags[i] = snapshot_get64(v + 8*i);
+	  d->rom_flags = snapshot_get64(v + 48);
+	  break;
+	case PCI_FILL_BRIDGE_BASES:
+	  for (i=0; i<4; i++)
+	    {
+	      d->bridge_base_addr[i] = snapshot_get64(v + 8*i);
+	      d->bridge_size[i] = snapshot_get64(v + 32 + 8*i);
+	      d->bridge_flags[i] = snapshot_get64(v + 64 + 8*i);
+	    }
+	  break;
+	default:
+	  {
+	    char *val = pci_set_property(d, key, (char *) v);
+	    if (key == PCI_FILL_PHYS_SLOT)
+	      d->phy_slot = val;
+	    else if (key == PCI_FILL_MODULE_ALIAS)
+	      d->module_alias = val;
+	    else if (key == PCI_FILL_LABEL)
+	      d->label = val;
+	  }
+	}
+    }
+}
+
+#ifdef DUMP_USE_ZINDEX
+
+/*
+ *  Compressed text dumps are not decompressed to memory. At init time, we
+ *  decompress the stream once, building the list of devices together with
+ *  positions of their data lines in the decompressed data, and an access point
+ *  every DUMP_ZSPAN bytes, from which decompression can be restarted (as in
+ *  zran.c from the zlib distribution). When a device is accessed for the first
+ *  time, the span containing it is decompressed again and all devices inside
+ *  the span are parsed.
+ */
+
+#define DUMP_ZSPAN (4 << 20)
+#define DUMP_ZBUF 65536
+
+/* zlib counts bytes in uInt, so feed huge files in chunks */
+static void
+dump_zfeed(struct dump_file *df, z_stream *z)
+{
+  size_t pos = (char *) z->next_in - df->buf;
+
+  if (!z->avail_in && pos < df->size)
+    z->avail_in = (df->size - pos < (1U << 30)) ? df->size - pos : (1U << 30);
+}
+
+static int
+dump_zeof(struct dump_file *df, z_stream *z)
+{
+  return !z->avail_in && (char *) z->next_in == df->buf + df->size;
+}
+
+/* Does the compressed file contain a binary snapshot? */
+static int
+dump_gz_snapshot(struct dump_file *df)
+{
+  byte magic[8];
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK)
+    return 0;
+  z.next_in = (Bytef *) df->buf;
+  z.next_out = magic;
+  z.avail_out = sizeof(magic);
+  do
+    {
+      dump_zfeed(df, &z);
+      ret = inflate(&z, Z_NO_FLUSH);
+    }
+  while (ret == Z_OK && z.avail_out);
+  inflateEnd(&z);
+  return !z.avail_out && !memcmp(magic, SNAPSHOT_MAGIC, 8);
+}
+
+static void
+dump_zadd_point(struct pci_access *a, struct dump_file *df, z_stream *z, size_t out, int bits)
+{
+  struct dump_zpoint *pt = pci_malloc(a, sizeof(*pt));
+  byte window[32768];
+  uInt len = 0;
+
+  pt->out = out;
+  pt->in = (char *) z->next_in - df->buf;
+  pt->bits = bits;
+  if (bits >= 0)
+    inflateGetDictionary(z, window, &len);
+  pt->window_len = len;
+  pt->window = len ? pci_malloc(a, len) : NULL;
+  if (len)
+    memcpy(pt->window, window, len);
+
+  if (df->num_zpoints >= df->max_zpoints)
+    {
+      df->max_zpoints = df->max_zpoints ? 2*df->max_zpoints : 64;
+      df->zpoints = pci_realloc(a, df->zpoints, df->max_zpoints * sizeof(*df->zpoints));
+    }
+  df->zpoints[df->num_zpoints++] = pt;
+}
+
+static void
+dump_zadd_dev(struct pci_access *a, struct dump_file *df, struct pci_dev *dev)
+{
+  if (df->num_devs >= df->max_devs)
+    {
+      df->max_devs = df->max_devs ? 2*df->max_devs : 256;
+      df->devs = pci_realloc(a, df->devs, df->max_devs * sizeof(*df->devs));
+    }
+  df->devs[df->num_devs++] = dev;
+}
+
+/* Build the list of devices from lines in buf, which starts at position pos of the decompressed data */
+static struct dump_data *
+dump_zparse(struct pci_access *a, struct dump_file *df, struct dump_data *dd,
+	    const char *buf, const char *end, size_t pos)
+{
+  const char *line, *eol, *next;
+
+  for (line = buf; line < end; line = next)
+    {
+      unsigned int mn, bn, dn, fn;
+
+      next = dump_next_line(line, end, &eol);
+      if (dump_parse_slot(line, eol, &mn, &bn, &dn, &fn))
+	{
+	  struct pci_dev *dev = pci_get_dev(a, mn, bn, dn, fn);
+	  if (dd)
+	    dd->zend = pos + (line - buf);
+	  dd = dump_new_data(dev);
+	  dd->zstart = dd->zend = pos + (next - buf);
+	  pci_link_dev(a, dev);
+	  dump_zadd_dev(a, df, dev);
+	}
+      else if (eol == line && dd)
+	{
+	  dd->zend = pos + (line - buf);
+	  dd = NULL;
+	}
+    }
+  return dd;
+}
+
+static const char *
+dump_zindex(struct pci_access *a, struct dump_file *df)
+{
+  size_t allocated = DUMP_ZBUF, len = 0, pos = 0, last_point = 0;
+  char *buf = pci_malloc(a, allocated);
+  struct dump_data *dd = NULL;
+  const char *err = NULL;
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK)
+    return "Cannot initialize zlib";
+  z.next_in = (Bytef *) df->buf;
+  dump_zadd_point(a, df, &z, 0, -1);
+
+  for (;;)
+    {
+      char *eol;
+      size_t n;
+
+      dump_zfeed(df, &z);
+      if (len == allocated)
+	{
+	  allocated *= 2;		/* A very long line */
+	  buf = pci_realloc(a, buf, allocated);
+	}
+      z.next_out = (Bytef *) buf + len;
+      z.avail_out = allocated - len;
+      ret = inflate(&z, Z_BLOCK);
+      len = (char *) z.next_out - buf;
+
+      /* Process complete lines and keep the rest for the next round */
+      for (eol = buf + len; eol > buf && eol[-1] != '\n'; eol--)
+	;
+      if (n = eol - buf)
+	{
+	  dd = dump_zparse(a, df, dd, buf, eol, pos);
+	  memmove(buf, eol, len - n);
+	  len -= n;
+	  pos += n;
+	}
+
+      if (ret == Z_STREAM_END)
+	{
+	  /* Concatenated gzip members are allowed */
+	  if (dump_zeof(df, &z))
+	    break;
+	  inflateReset(&z);
+	  dump_zadd_point(a, df, &z, pos + len, -1);
+	  last_point = pos + len;
+	}
+      else if (ret == Z_BUF_ERROR && dump_zeof(df, &z))
+	{
+	  err = "Truncated compressed data";
+	  break;
+	}
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+	{
+	  err = "Corrupted compressed data";
+	  break;
+	}
+      else if ((z.data_type & 128) && !(z.data_type & 64) && pos + len - last_point >= DUMP_ZSPAN)
+	{
+	  /* At a block boundary */
+	  dump_zadd_point(a, df, &z, pos + len, z.data_type & 7);
+	  last_point = pos + len;
+	}
+    }
+  inflateEnd(&z);
+
+  if (!err)
+    {
+      /* The last line need not be terminated */
+      dd = dump_zparse(a, df, dd, buf, buf + len, pos);
+      if (dd)
+	dd->zend = pos + len;
+    }
+  pci_mfree(buf);
+  return err;
+}
+
+/* Decompress len bytes starting at the access point */
+static const char *
+dump_zextract(struct dump_file *df, struct dump_zpoint *pt, char *out, size_t len)
+{
+  const char *err = NULL;
+  int raw = (pt->bits >= 0);
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, raw ? -15 : 15 + 16) != Z_OK)
+    return "Cannot initialize zlib";
+  z.next_in = (Bytef *) df->buf + pt->in;
+  if (pt->bits > 0)
+    inflatePrime(&z, pt->bits, (byte) df->buf[pt->in - 1] >> (8 - pt->bits));
+  if (pt->window_len)
+    inflateSetDictionary(&z, pt->window, pt->window_len);
+
+  z.next_out = (Bytef *) out;
+  while (len)
+    {
+      dump_zfeed(df, &z);
+      z.avail_out = (len < (1U << 30)) ? len : (1U << 30);
+      ret = inflate(&z, Z_NO_FLUSH);
+      len -= (char *) z.next_out - out;
+      out = (char *) z.next_out;
+      if (ret == Z_STREAM_END && len)
+	{
+	  if (raw)
+	    {
+	      /* Skip the gzip trailer, the next member has a header */
+	      size_t pos = (char *) z.next_in - df->buf + 8;
+	      z.next_in = (Bytef *) df->buf + (pos < df->size ? pos : df->size);
+	      z.avail_in = 0;
+	      inflateReset2(&z, 15 + 16);
+	      raw = 0;
+	    }
+	  else
+	    inflateReset(&z);
+	}
+      else if (ret != Z_OK && ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && !dump_zeof(df, &z)))
+	{
+	  err = "Corrupted compressed data";
+	  break;
+	}
+    }
+  inflateEnd(&z);
+  return err;
+}
+
+/* Parse the device together with all other devices in the same span */
+static void
+dump_zfetch(struct pci_dev *d, struct dump_data *dd)
+{
+  struct pci_access *a = d->access;
+  struct dump_file *df = a->backend_data;
+  struct dump_zpoint *pt;
+  size_t start, end;
+  const char *err;
+  char *buf;
+  int lo, hi, i;
+
+  /* The last access point before the device */
+  lo = 0;
+  hi = df->num_zpoints;
+  while (hi - lo > 1)
+    {
+      int mid = (lo + hi) / 2;
+      if (df->zpoints[mid]->out <= dd->zstart)
+	lo = mid;
+      else
+	hi = mid;
+    }
+  pt = df->zpoints[lo];
+  start = pt->out;
+  end = dd->zend;
+  if (lo + 1 < df->num_zpoints && df->zpoints[lo+1]->out > end)
+    end = df->zpoints[lo+1]->out;
+
+  buf = pci_malloc(a, end - start);
+  if (err = dump_zextract(df, pt, buf, end - start))
+    a->error("dump: %s", err);
+
+  /* The first device in the span */
+  lo = 0;
+  hi = df->num_devs;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (((struct dump_data *) df->devs[mid]->backend_data)->zstart < start)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  for (i = lo; i < df->num_devs; i++)
+    {
+      struct pci_dev *e = df->devs[i];
+      struct dump_data *ed = e->backend_data;
+      if (ed->zstart > end)
+	break;
+      if (ed->zend && ed->zend <= end)
+	{
+	  dump_parse_lines(e, ed, buf + (ed->zstart - start), buf + (ed->zend - start));
+	  ed->zend = 0;
+	}
+    }
+  pci_mfree(buf);
+}
+
+#endif
+
+/* Parse data lines of a device on its first access */
+static struct dump_data *
+dump_get_data(struct pci_dev *d)
+{
+  struct dump_data *dd = d->backend_data;
+
+  if (dd->text)
+    {
+      dump_parse_lines(d, dd, dd->text, dd->text_end);
+      dd->text = dd->text_end = NULL;
+    }
+#ifdef DUMP_USE_ZINDEX
+  else if (dd->zend)
+    dump_zfetch(d, dd);
+#endif
+  return dd;
+}
+
 static void
 dump_init(struct pci_access *a)
 {
   char *name = pci_get_param(a, "dump.name");
+  struct dump_file *df;
   const char *err;
 
   if (!name)
     a->error("dump: File name not given.");
 
-  if (!strcmp(name, "-"))
-    err = dump_parse(a, stdin);
-  else
+  /* Both kinds of dumps are used in place, so keep the file until cleanup */
+  df = pci_malloc(a, sizeof(*df));
+  memset(df, 0, sizeof(*df));
+  if (err = dump_open(a, name, df))
+    a->error("dump: Cannot open %s: %s", name, err);
+  a->backend_data = df;
+
+  if (df->size >= 2 && (byte) df->buf[0] == 0x1f && (byte) df->buf[1] == 0x8b)
     {
-      FILE *f = fopen(name, "r");
-      if (!f)
-	a->error("dump: Cannot open %s: %s", name, strerror(errno));
-      err = dump_parse(a, f);
-      fclose(f);
+#ifdef PCI_COMPRESSED_IDS
+#ifdef DUMP_USE_ZINDEX
+      if (!dump_gz_snapshot(df))
+	{
+	  if (err = dump_zindex(a, df))
+	    a->error("dump: %s: %s", name, err);
+	  return;
+	}
+#endif
+      /* Snapshots are used in place, so they have to be decompressed to memory */
+      if (err = dump_gunzip(a, df))
+	a->error("dump: %s: %s", name, err);
+#else
+      a->error("dump: %s is compressed, but compressed dumps are not supported by this build", name);
+#endif
     }
 
-  if (err)
-    a->error("dump: %s", err);
+  if (df->size >= 8 && !memcmp(df->buf, SNAPSHOT_MAGIC, 8))
+    {
+      if (err = snapshot_parse(a, (byte *) df->buf, df->size))
+	a->error("dump: %s", err);
+    }
+  else
+    dump_parse(a, df->buf, df->size);
 }
 
 static void
-dump_cleanup(struct pci_access *a UNUSED)
+dump_cleanup(struct pci_access *a)
 {
+  struct dump_file *df = a->backend_data;
+
+  if (df)
+    {
+      dump_close(df);
+      pci_mfree(df->devs);
+      pci_mfree(df->samples);
+      pci_mfree(df);
+      a->backend_data = NULL;
+    }
 }
 
 static void
@@ -156,21 +1079,186 @@ static int
 dump_read(struct pci_dev *d, int pos, byte *buf, int len)
 {
   struct dump_data *dd;
-  if (!(dd = d->backend_data))
+  if (!d->backend_data)
     {
       struct pci_dev *e = d->access->devices;
       while (e && (e->domain != d->domain || e->bus != d->bus || e->dev != d->dev || e->func != d->func))
 	e = e->next;
       if (!e)
 	return 0;
-      dd = e->backend_data;
+      dd = dump_get_data(e);
     }
+  else
+    dd = dump_get_data(d);
   if (pos + len > dd->len)
     return 0;
   memcpy(buf, dd->data + pos, len);
   return 1;
 }
 
+/*
+ *  Reading of time series
+ */
+
+/* Find the first change in a sample with key >= the given one */
+static byte *
+series_lookup(byte *rec, u32 key)
+{
+  byte *e = rec + SNAPSHOT_DEV_SIZE;
+  int lo = 0, hi = (snapshot_get32(rec) - SNAPSHOT_DEV_SIZE) / 8;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (snapshot_get32(e + 8*mid) < key)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return e + 8*lo;
+}
+
+static inline byte *
+series_end(byte *rec)
+{
+  return rec + snapshot_get32(rec);
+}
+
+/* Value of a config space dword after the first n samples */
+static u32
+series_value(struct dump_file *df, struct dump_data *dd, int pos, int n)
+{
+  u32 key = SERIES_KEY(dd->index, pos);
+  u32 val = snapshot_get32(dd->base + pos);
+  int k;
+
+  for (k=0; k<n; k++)
+    {
+      byte *e = series_lookup(df->samples[k], key);
+      if (e < series_end(df->samples[k]) && snapshot_get32(e) == key)
+	val ^= snapshot_get32(e+4);
+    }
+  return val;
+}
+
+static struct dump_file *
+series_get(struct pci_access *a)
+{
+  return (a->methods == &pm_dump) ? a->backend_data : NULL;
+}
+
+int
+pci_series_samples(struct pci_access *a)
+{
+  struct dump_file *df = series_get(a);
+  return df ? df->num_samples : 0;
+}
+
+int
+pci_series_select(struct pci_access *a, int sample)
+{
+  struct dump_file *df = series_get(a);
+  int i, k;
+
+  if (!df || sample < 0 || sample > df->num_samples)
+    return 0;
+
+  for (i=0; i<df->num_devs; i++)
+    {
+      struct pci_dev *d = df->devs[i];
+      struct dump_data *dd = d->backend_data;
+      byte *old = dd->data;
+
+      if (!sample)
+	{
+	  if (dd->allocated)
+	    pci_mfree(dd->data);
+	  dd->data = dd->base;
+	  dd->allocated = 0;
+	}
+      else
+	{
+	  if (!dd->allocated)
+	    {
+	      dd->allocated = dd->len ? dd->len : 4;
+	      dd->data = pci_malloc(a, dd->allocated);
+	    }
+	  memcpy(dd->data, dd->base, dd->len);
+	}
+      if (d->cache == old)
+	pci_setup_cache(d, dd->data, dd->len);
+    }
+
+  for (k=0; k<sample; k++)
+    {
+      byte *rec = df->samples[k], *e;
+      for (e = rec + SNAPSHOT_DEV_SIZE; e < series_end(rec); e += 8)
+	{
+	  u32 key = snapshot_get32(e);
+	  struct dump_data *dd = df->devs[key >> 10]->backend_data;
+	  u32 *w = (u32 *) (dd->data + 4*(key & 1023));
+	  *w = cpu_to_le32(le32_to_cpu(*w) ^ snapshot_get32(e+4));
+	}
+    }
+  return 1;
+}
+
+int
+pci_series_next_change(struct pci_dev *d, int pos, struct pci_series_change *ch)
+{
+  struct dump_file *df = series_get(d->access);
+  struct dump_data *dd = d->backend_data;
+  int k, start;
+
+  if (!df || !dd || !dd->base || pos >= dd->len)
+    return 0;
+  if (pos >= 0)
+    pos &= ~3;
+
+  /* Continue after the last reported change */
+  k = ch->sample ? ch->sample - 1 : 0;
+  start = ch->sample ? ch->pos + 4 : 0;
+  for (; k < df->num_samples; k++, start = 0)
+    {
+      byte *rec = df->samples[k], *e;
+      u32 key;
+
+      if (pos >= 0)
+	{
+	  if (start > pos)
+	    continue;
+	  start = pos;
+	}
+      if (start >= dd->len)
+	continue;
+      e = series_lookup(rec, SERIES_KEY(dd->index, start));
+      if (e >= series_end(rec))
+	continue;
+      key = snapshot_get32(e);
+      if ((key >> 10) != (u32) dd->index || pos >= 0 && key != SERIES_KEY(dd->index, pos))
+	continue;
+
+      ch->sample = k + 1;
+      ch->time_sec = snapshot_get32(rec + 4);
+      ch->time_usec = snapshot_get32(rec + 12);
+      ch->pos = 4 * (key & 1023);
+      ch->old_value = series_value(df, dd, ch->pos, k);
+      ch->new_value = ch->old_value ^ snapshot_get32(e + 4);
+      return 1;
+    }
+  return 0;
+}
+
+static void
+dump_fill_info(struct pci_dev *d, unsigned int flags)
+{
+  struct dump_data *dd = d->backend_data;
+
+  if (dd && dd->props)
+    snapshot_fill_info(d, flags);
+  pci_generic_fill_info(d, flags);
+}
+
 static int
 dump_write(struct pci_dev *d UNUSED, int pos UNUSED, byte *buf UNUSED, int len UNUSED)
 {
@@ -181,13 +1269,298 @@ dump_write(struct pci_dev *d UNUSED, int pos UNUSED, byte *buf UNUSED, int len U
 static void
 dump_cleanup_dev(struct pci_dev *d)
 {
-  if (d->backend_data)
+  struct dump_data *dd = d->backend_data;
+
+  if (dd)
     {
-      pci_mfree(d->backend_data);
+      if (d->cache == dd->data)
+	pci_setup_cache(d, NULL, 0);
+      if (dd->allocated)
+	pci_mfree(dd->data);
+      pci_mfree(dd);
       d->backend_data = NULL;
     }
 }
 
+/*
+ *  Writing of snapshots
+ */
+
+struct snapshot_dev {
+  struct pci_dev *dev;
+  byte *config;				/* Config space as of the last sample */
+  int len;
+};
+
+struct pci_snapshot {
+  struct pci_access *access;
+  FILE *file;
+  char *name;
+  byte *buf;
+  unsigned int buf_size, pos;
+  struct snapshot_dev *devs;		/* Devices in the base snapshot */
+  int num_devs, max_devs, last_dev;
+  int in_sample;			/* Writing a sample rather than the base */
+  u32 time_sec, time_usec;
+  u32 *changes;				/* Pairs of (key, XOR mask) for the current sample */
+  unsigned int num_changes, max_changes;
+};
+
+static void
+snapshot_put(struct pci_snapshot *s, const void *data, unsigned int len)
+{
+  unsigned int padded = SNAPSHOT_ALIGN(len);
+
+  if (s->pos + padded > s->buf_size)
+    {
+      while (s->pos + padded > s->buf_size)
+	s->buf_size *= 2;
+      s->buf = pci_realloc(s->access, s->buf, s->buf_size);
+    }
+  memcpy(s->buf + s->pos, data, len);
+  memset(s->buf + s->pos + len, 0, padded - len);
+  s->pos += padded;
+}
+
+static void
+snapshot_put32(struct pci_snapshot *s, u32 x)
+{
+  x = cpu_to_le32(x);
+  snapshot_put(s, &x, 4);
+}
+
+static void
+snapshot_put64(struct pci_snapshot *s, u64 x)
+{
+  snapshot_put32(s, x);
+  snapshot_put32(s, x >> 32);
+}
+
+static void
+snapshot_put_prop(struct pci_snapshot *s, u32 key, unsigned int len)
+{
+  snapshot_put32(s, key);
+  snapshot_put32(s, len);
+}
+
+struct pci_snapshot *
+pci_snapshot_create(struct pci_access *a, char *name)
+{
+  struct pci_snapshot *s = pci_malloc(a, sizeof(*s));
+  byte hdr[SNAPSHOT_HDR_SIZE];
+
+  s->access = a;
+  s->name = name;
+  if (!strcmp(name, "-"))
+    s->file = stdout;
+  else if (!(s->file = fopen(name, "wb")))
+    a->error("Cannot create %s: %s", name, strerror(errno));
+  s->buf_size = 8192;
+  s->buf = pci_malloc(a, s->buf_size);
+  s->pos = 0;
+  s->devs = NULL;
+  s->num_devs = s->max_devs = s->last_dev = 0;
+  s->in_sample = 0;
+  s->changes = NULL;
+  s->num_changes = s->max_changes = 0;
+
+  memcpy(hdr, SNAPSHOT_MAGIC, 8);
+  *(u32 *)(hdr + 8) = cpu_to_le32(SNAPSHOT_VERSION);
+  *(u32 *)(hdr + 12) = cpu_to_le32(SNAPSHOT_HDR_SIZE);
+  fwrite(hdr, 1, SNAPSHOT_HDR_SIZE, s->file);
+  return s;
+}
+
+static int
+snapshot_cmp_changes(const void *A, const void *B)
+{
+  const u32 *a = A, *b = B;
+  return (a[0] < b[0]) ? -1 : (a[0] > b[0]);
+}
+
+static void
+snapshot_flush_sample(struct pci_snapshot *s)
+{
+  unsigned int i;
+
+  if (!s->in_sample)
+    return;
+  qsort(s->changes, s->num_changes, 2*sizeof(u32), snapshot_cmp_changes);
+  s->pos = 0;
+  snapshot_put32(s, SNAPSHOT_DEV_SIZE + 8*s->num_changes);
+  snapshot_put32(s, s->time_sec);
+  snapshot_put32(s, SNAPSHOT_REC_SAMPLE << 24);
+  snapshot_put32(s, s->time_usec);
+  for (i=0; i<2*s->num_changes; i++)
+    snapshot_put32(s, s->changes[i]);
+  fwrite(s->buf, 1, s->pos, s->file);
+  s->num_changes = 0;
+}
+
+void
+pci_snapshot_new_sample(struct pci_snapshot *s, u32 time_sec, u32 time_usec)
+{
+  snapshot_flush_sample(s);
+  s->in_sample = 1;
+  s->time_sec = time_sec;
+  s->time_usec = time_usec;
+}
+
+static void
+snapshot_add_sample(struct pci_snapshot *s, struct pci_dev *d, byte *config, int len)
+{
+  struct snapshot_dev *sd;
+  int i;
+
+  /* Devices are usually sampled in the same order as in the base snapshot */
+  if (s->last_dev + 1 < s->num_devs && s->devs[s->last_dev + 1].dev == d)
+    i = s->last_dev + 1;
+  else
+    for (i=0; i<s->num_devs && s->devs[i].dev != d; i++)
+      ;
+  if (i >= s->num_devs)
+    s->access->error("Snapshot: Device %04x:%02x:%02x.%d is not in the base snapshot", d->domain, d->bus, d->dev, d->func);
+  s->last_dev = i;
+  sd = &s->devs[i];
+
+  if (len > sd->len)
+    len = sd->len;
+  for (len &= ~3; len > 0; len -= 4)
+    {
+      u32 x = le32_to_cpu(*(u32 *)(sd->config + len - 4)) ^ le32_to_cpu(*(u32 *)(config + len - 4));
+      if (!x)
+	continue;
+      if (s->num_changes >= s->max_changes)
+	{
+	  s->max_changes = s->max_changes ? 2*s->max_changes : 1024;
+	  s->changes = pci_realloc(s->access, s->changes, 2*sizeof(u32) * s->max_changes);
+	}
+      s->changes[2*s->num_changes] = SERIES_KEY(i, len - 4);
+      s->changes[2*s->num_changes+1] = x;
+      s->num_changes++;
+      memcpy(sd->config + len - 4, config + len - 4, 4);
+    }
+}
+
+void
+pci_snapshot_add(struct pci_snapshot *s, struct pci_dev *d, u8 *config, int len)
+{
+  struct snapshot_dev *sd;
+  unsigned int known, key;
+  int i;
+
+  if (len < 0 || len > 4096)
+    s->access->error("Snapshot: Invalid config space length %d", len);
+  if (s->in_sample)
+    {
+      snapshot_add_sample(s, d, config, len);
+      return;
+    }
+
+  /* Remember the base config space to compute changes of samples against */
+  if (s->num_devs >= SNAPSHOT_MAX_DEVS)
+    s->access->error("Snapshot: Too many devices");
+  if (s->num_devs >= s->max_devs)
+    {
+      s->max_devs = s->max_devs ? 2*s->max_devs : 256;
+      s->devs = pci_realloc(s->access, s->devs, s->max_devs * sizeof(*s->devs));
+    }
+  sd = &s->devs[s->num_devs++];
+  sd->dev = d;
+  sd->len = len;
+  sd->config = pci_malloc(s->access, len ? len : 4);
+  memcpy(sd->config, config, len);
+
+  known = pci_fill_info(d, SNAPSHOT_PROPS) & SNAPSHOT_PROPS;
+
+  s->pos = 0;
+  snapshot_put32(s, 0);			/* Record size, filled in below */
+  snapshot_put32(s, d->domain);
+  snapshot_put32(s, d->bus | (d->dev << 8) | (d->func << 16));
+  snapshot_put32(s, len);
+  snapshot_put(s, config, len);
+
+  for (key = 1; key; key <<= 1)
+    {
+      if (!(known & key))
+	continue;
+      switch (key)
+	{
+	case PCI_FILL_IRQ:
+	  snapshot_put_prop(s, key, 4);
+	  snapshot_put32(s, d->irq);
+	  break;
+	case PCI_FILL_NUMA_NODE:
+	  snapshot_put_prop(s, key, 4);
+	  snapshot_put32(s, d->numa_node);
+	  break;
+	case PCI_FILL_BASES:
+	  snapshot_put_prop(s, key, 6*8);
+	  for (i=0; i<6; i++)
+	    snapshot_put64(s, d->base_addr[i]);
+	  break;
+	case PCI_FILL_ROM_BASE:
+	  snapshot_put_prop(s, key, 8);
+	  snapshot_put64(s, d->rom_base_addr);
+	  break;
+	case PCI_FILL_SIZES:
+	  snapshot_put_prop(s, key, 7*8);
+	  for (i=0; i<6; i++)
+	    snapshot_put64(s, d->size[i]);
+	  snapshot_put64(s, d->rom_size);
+	  break;
+	case PCI_FILL_IO_FLAGS:
+	  snapshot_put_prop(s, key, 7*8);
+	  for (i=0; i<6; i++)
+	    snapshot_put64(s, d->flags[i]);
+	  snapshot_put64(s, d->rom_flags);
+	  break;
+	case PCI_FILL_BRIDGE_BASES:
+	  snapshot_put_prop(s, key, 12*8);
+	  for (i=0; i<4; i++)
+	    snapshot_put64(s, d->bridge_base_addr[i]);
+	  for (i=0; i<4; i++)
+	    snapshot_put64(s, d->bridge_size[i]);
+	  for (i=0; i<4; i++)
+	    snapshot_put64(s, d->bridge_flags[i]);
+	  break;
+	default:
+	  {
+	    char *val = pci_get_string_property(d, key);
+	    if (val)
+	      {
+		snapshot_put_prop(s, key, strlen(val) + 1);
+		snapshot_put(s, val, strlen(val) + 1);
+	      }
+	  }
+	}
+    }
+
+  *(u32 *) s->buf = cpu_to_le32(s->pos);
+  fwrite(s->buf, 1, s->pos, s->file);
+}
+
+void
+pci_snapshot_close(struct pci_snapshot *s)
+{
+  struct pci_access *a = s->access;
+  int err, i;
+
+  snapshot_flush_sample(s);
+  err = fflush(s->file) || ferror(s->file);
+
+  if (s->file != stdout && fclose(s->file))
+    err = 1;
+  if (err)
+    a->error("Error writing %s: %s", s->name, strerror(errno));
+  for (i=0; i<s->num_devs; i++)
+    pci_mfree(s->devs[i].config);
+  pci_mfree(s->devs);
+  pci_mfree(s->changes);
+  pci_mfree(s->buf);
+  pci_mfree(s);
+}
+
 struct pci_methods pm_dump = {
   .name = "dump",
   .help = "Reading of register dumps (set the `dump.name' parameter)",
@@ -196,7 +1569,7 @@ struct pci_methods pm_dump = {
   .init = dump_init,
   .cleanup = dump_cleanup,
   .scan = dump_scan,
-  .fill_info = pci_generic_fill_info,
+  .fill_info = dump_fill_info,
   .read = dump_read,
   .write = dump_write,
   .cleanup_dev = dump_cleanup_dev,
@@ -0,0 +1,1196 @@
+/*
+ *	The PCI Library -- Emulation of Writable Devices
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/*
+ *  The emul method takes devices provided by another method (usually
+ *  a dump) and lets them accept writes. The config space of each device
+ *  is copied to memory when it is written to for the first time. Every
+ *  byte of the copy has a mask of bits writable by software and a mask
+ *  of bits cleared by writing 1; all other bits (read-only and reserved)
+ *  keep their values. Capabilities whose registers interact with software
+ *  in a more complicated way are driven by models, which are called after
+ *  each write to their registers and update the copy accordingly.
+ */
+
+#define EMUL_HASH_SIZE 4096
+
+struct emul_dev;
+struct emul_cap;
+struct emul_lmr_param;
+
+struct emul_model {
+  char *name;
+  int cap_type, cap_id;
+  int state_size;
+  void (*init)(struct pci_dev *d, struct emul_dev *ed, struct emul_cap *c);
+  void (*write)(struct emul_dev *ed, struct emul_cap *c, int pos, int len);
+};
+
+struct emul_cap {
+  struct emul_cap *next;
+  struct emul_model *model;
+  int addr, len;			/* Registers handled by the model */
+  void *state;
+};
+
+struct emul_dev {
+  struct emul_dev *next;		/* In hash chain */
+  u32 domain;
+  byte bus, dev, func;
+  int len;				/* Size of config space */
+  byte *config, *wmask, *w1cmask;
+  struct emul_cap *caps;
+};
+
+struct emul_override {
+  struct emul_override *next;
+  struct pci_filter filter;
+  int any_slot;
+  int pos, width;
+  int kind;
+  u32 mask;
+};
+
+enum emul_kind { EMUL_RO, EMUL_RW, EMUL_RW1C, EMUL_RSVDP };
+
+struct emul {
+  struct pci_wrapper w;			/* Must be first */
+  struct emul_dev **hash;
+  unsigned int models;			/* Enabled models */
+  struct emul_override *overrides;
+  struct emul_lmr_param *lmr_params, **lmr_last;
+};
+
+static void emul_init(struct pci_access *a);
+
+static inline struct emul *
+emul_of(struct pci_methods *m)
+{
+  return (struct emul *) pci_find_wrapper(m, emul_init);
+}
+
+static inline u32
+emul_get(struct emul_dev *ed, int pos, int width)
+{
+  u32 x = 0;
+
+  while (width--)
+    x = (x << 8) | ed->config[pos + width];
+  return x;
+}
+
+static inline void
+emul_set(struct emul_dev *ed, int pos, int width, u32 x)
+{
+  for (; width--; pos++, x >>= 8)
+    ed->config[pos] = x;
+}
+
+static inline int
+emul_touched(int pos, int len, int reg, int width)
+{
+  return pos < reg + width && reg < pos + len;
+}
+
+/*** Models of capabilities ***/
+
+/*
+ *  Lane Margining at the Receiver: commands written to the Lane Control
+ *  registers are answered in the Lane Status registers. Downstream ports
+ *  answer for their own receiver (1) and for receivers of retimers
+ *  detected on the link (2 to 5), upstream ports for receiver 6.
+ *
+ *  Each lane has an eye of a given number of steps in each direction.
+ *  Stepping inside the eye succeeds without errors, every step beyond it
+ *  adds the given number of errors and the step fails once the error count
+ *  exceeds the limit set by software. Steps beyond the number of steps
+ *  reported by the receiver are NAKed. By default, the eye spans 5/8 of
+ *  the steps and the first step beyond it fails. The `emul.lmr' parameter
+ *  changes the capabilities reported and the behavior of lanes.
+ */
+
+#define EMUL_LMR_LANES 32
+#define EMUL_LMR_TIM_STEPS 16
+#define EMUL_LMR_VOLT_STEPS 32
+
+enum emul_lmr_key {
+  /* Eye in directions selected by step commands; must be first */
+  EMUL_LMR_UP, EMUL_LMR_DOWN, EMUL_LMR_LEFT, EMUL_LMR_RIGHT,
+  EMUL_LMR_TIMING, EMUL_LMR_VOLTAGE,
+  EMUL_LMR_ERRORS, EMUL_LMR_NAK,
+  /* Parameters of the whole port */
+  EMUL_LMR_CAPS, EMUL_LMR_TSTEPS, EMUL_LMR_VSTEPS, EMUL_LMR_TOFFSET, EMUL_LMR_VOFFSET, EMUL_LMR_MAXLANES,
+};
+
+static const struct {
+  char *name;
+  int max;
+} emul_lmr_keys[] = {
+  { "up", 127 }, { "down", 127 }, { "left", 63 }, { "right", 63 },
+  { "timing", 63 }, { "voltage", 127 },
+  { "errors", 63 }, { "nak", 1 },
+  { "caps", 31 }, { "tsteps", 63 }, { "vsteps", 127 }, { "toffset", 127 }, { "voffset", 127 }, { "maxlanes", 31 },
+};
+
+#define EMUL_LMR_KEYS (int)(sizeof(emul_lmr_keys) / sizeof(emul_lmr_keys[0]))
+#define EMUL_LMR_PER_LANE(key) ((key) <= EMUL_LMR_NAK)
+
+struct emul_lmr_param {
+  struct emul_lmr_param *next;
+  struct pci_filter filter;
+  int any_slot;
+  int key, value;
+  int first_lane, last_lane;
+};
+
+struct emul_lmr {
+  int lanes;
+  unsigned int receivers;		/* Bit mask of receiver numbers we answer for */
+  byte caps, tim_steps, volt_steps, tim_offset, volt_offset, max_lanes;
+  byte error_limit[EMUL_LMR_LANES];
+  int eye[EMUL_LMR_LANES][4];		/* Passing steps in direction up, down, left, right; -1 if default */
+  byte errors[EMUL_LMR_LANES];		/* Errors added by each step beyond the eye */
+  byte nak[EMUL_LMR_LANES];		/* NAK all step commands */
+};
+
+static void
+emul_lmr_set(struct emul_lmr *l, int lane, int key, int value)
+{
+  switch (key)
+    {
+    case EMUL_LMR_TIMING:
+      l->eye[lane][EMUL_LMR_LEFT] = l->eye[lane][EMUL_LMR_RIGHT] = value;
+      break;
+    case EMUL_LMR_VOLTAGE:
+      l->eye[lane][EMUL_LMR_UP] = l->eye[lane][EMUL_LMR_DOWN] = value;
+      break;
+    case EMUL_LMR_ERRORS:
+      l->errors[lane] = value;
+      break;
+    case EMUL_LMR_NAK:
+      l->nak[lane] = value;
+      break;
+    case EMUL_LMR_CAPS:
+      l->caps = value;
+      break;
+    case EMUL_LMR_TSTEPS:
+      l->tim_steps = value;
+      break;
+    case EMUL_LMR_VSTEPS:
+      l->volt_steps = value;
+      break;
+    case EMUL_LMR_TOFFSET:
+      l->tim_offset = value;
+      break;
+    case EMUL_LMR_VOFFSET:
+      l->volt_offset = value;
+      break;
+    case EMUL_LMR_MAXLANES:
+      l->max_lanes = value;
+      break;
+    default:
+      l->eye[lane][key] = value;
+    }
+}
+
+static void
+emul_lmr_init(struct pci_dev *d, struct emul_dev *ed, struct emul_cap *c)
+{
+  struct emul *e = emul_of(d->methods);
+  struct emul_lmr *l = c->state;
+  struct emul_lmr_param *p;
+  int exp = 0, type, i, j;
+
+  /* The Margining Lane registers exist for all lanes of the widest link */
+  l->lanes = 1;
+  l->receivers = 1 << 6;
+  if (ed->len >= 64 && (emul_get(ed, PCI_STATUS, 2) & PCI_STATUS_CAP_LIST))
+    {
+      int pos = ed->config[PCI_CAPABILITY_LIST] & ~3;
+      int ttl = 48;
+      while (pos >= 0x40 && ttl--)
+	{
+	  if (ed->config[pos] == PCI_CAP_ID_EXP)
+	    {
+	      exp = pos;
+	      break;
+	    }
+	  pos = ed->config[pos + 1] & ~3;
+	}
+    }
+  if (exp)
+    {
+      u16 lnksta2 = emul_get(ed, exp + PCI_EXP_LNKSTA2, 2);
+      l->lanes = (emul_get(ed, exp + PCI_EXP_LNKCAP, 4) & PCI_EXP_LNKCAP_WIDTH) >> 4;
+      type = (emul_get(ed, exp + PCI_EXP_FLAGS, 2) & PCI_EXP_FLAGS_TYPE) >> 4;
+      if (type == PCI_EXP_TYPE_ROOT_PORT || type == PCI_EXP_TYPE_DOWNSTREAM)
+	{
+	  l->receivers = 1 << 1;
+	  if (lnksta2 & PCI_EXP_LINKSTA2_RETIMER)
+	    l->receivers |= 3 << 2;
+	  if (lnksta2 & PCI_EXP_LINKSTA2_2RETIMERS)
+	    l->receivers |= 3 << 4;
+	}
+    }
+  if (l->lanes < 1)
+    l->lanes = 1;
+  if (l->lanes > EMUL_LMR_LANES)
+    l->lanes = EMUL_LMR_LANES;
+  c->len = PCI_LMR_LANE_CTRL(l->lanes);
+  if (c->addr + c->len > ed->len)
+    c->len = ed->len - c->addr;
+
+  for (i = 0; i < l->lanes && c->addr + PCI_LMR_LANE_CTRL(i) + 2 <= ed->len; i++)
+    {
+      ed->wmask[c->addr + PCI_LMR_LANE_CTRL(i)] = 0xff;
+      ed->wmask[c->addr + PCI_LMR_LANE_CTRL(i) + 1] = 0xff;
+    }
+  emul_set(ed, c->addr + PCI_LMR_PORT_STS, 2, PCI_LMR_PORT_STS_READY | PCI_LMR_PORT_STS_SOFT_READY);
+
+  /* Voltage margining with independent directions */
+  l->caps = 0x07;
+  l->tim_steps = EMUL_LMR_TIM_STEPS;
+  l->volt_steps = EMUL_LMR_VOLT_STEPS;
+  l->tim_offset = l->volt_offset = 50;
+  l->max_lanes = l->lanes - 1;
+  for (i = 0; i < l->lanes; i++)
+    {
+      l->error_limit[i] = 4;
+      l->errors[i] = 63;
+      for (j = 0; j < 4; j++)
+	l->eye[i][j] = -1;
+    }
+
+  for (p = e->lmr_params; p; p = p->next)
+    if (p->any_slot || pci_filter_match(&p->filter, d))
+      {
+	if (!EMUL_LMR_PER_LANE(p->key))
+	  emul_lmr_set(l, 0, p->key, p->value);
+	else
+	  for (i = p->first_lane; i <= p->last_lane && i < l->lanes; i++)
+	    emul_lmr_set(l, i, p->key, p->value);
+      }
+
+  for (i = 0; i < l->lanes; i++)
+    for (j = 0; j < 4; j++)
+      if (l->eye[i][j] < 0)
+	l->eye[i][j] = (j < EMUL_LMR_LEFT ? l->volt_steps : l->tim_steps) * 5 / 8;
+}
+
+static int
+emul_lmr_step(struct emul_lmr *l, int lane, int dir, int steps, int max_steps)
+{
+  int errors;
+
+  if (steps > max_steps || l->nak[lane])
+    return 3 << 6;			/* NAK */
+  if (steps <= l->eye[lane][dir])
+    return 2 << 6;			/* Margining in progress, no errors */
+  errors = (steps - l->eye[lane][dir]) * l->errors[lane];
+  if (errors > 63)
+    errors = 63;
+  if (errors <= l->error_limit[lane])
+    return (2 << 6) | errors;		/* Margining in progress, errors within the limit */
+  return errors;			/* Too many errors */
+}
+
+static void
+emul_lmr_write(struct emul_dev *ed, struct emul_cap *c, int pos, int len)
+{
+  struct emul_lmr *l = c->state;
+  int lane;
+
+  for (lane = 0; lane < l->lanes; lane++)
+    {
+      int ctrl = c->addr + PCI_LMR_LANE_CTRL(lane);
+      u16 cmd;
+      int recvn, type, payload, resp, dir;
+
+      if (!emul_touched(pos, len, ctrl, 2) || ctrl + 4 > ed->len)
+	continue;
+      cmd = emul_get(ed, ctrl, 2);
+      recvn = cmd & 7;
+      type = (cmd >> 3) & 7;
+      payload = cmd >> 8;
+
+      if (type == 7 && !recvn)
+	resp = payload;			/* No Command */
+      else if (!(l->receivers & (1 << recvn)))
+	continue;			/* No such receiver */
+      else
+	switch (type)
+	  {
+	  case 1:			/* Access Receiver Margin Control: Report */
+	    switch (payload)
+	      {
+	      case 0x88:
+		resp = l->caps;
+		break;
+	      case 0x89:
+		resp = l->volt_steps;
+		break;
+	      case 0x8a:
+		resp = l->tim_steps;
+		break;
+	      case 0x8b:
+		resp = l->tim_offset;
+		break;
+	      case 0x8c:
+		resp = l->volt_offset;
+		break;
+	      case 0x8d:		/* Sampling rates */
+	      case 0x8e:
+		resp = 63;
+		break;
+	      case 0x8f:		/* Sample count */
+		resp = 0;
+		break;
+	      case 0x90:
+		resp = l->max_lanes;
+		break;
+	      default:
+		continue;
+	      }
+	    break;
+	  case 2:			/* Set commands */
+	    if ((payload & 0xc0) == 0xc0)
+	      l->error_limit[lane] = payload & 0x3f;
+	    resp = payload;
+	    break;
+	  case 3:			/* Step Margin to timing offset */
+	    dir = ((l->caps & 4) && (payload & 0x40)) ? EMUL_LMR_LEFT : EMUL_LMR_RIGHT;
+	    resp = emul_lmr_step(l, lane, dir, payload & 0x3f, l->tim_steps);
+	    break;
+	  case 4:			/* Step Margin to voltage offset */
+	    dir = ((l->caps & 2) && (payload & 0x80)) ? EMUL_LMR_DOWN : EMUL_LMR_UP;
+	    if (l->caps & 1)
+	      resp = emul_lmr_step(l, lane, dir, payload & 0x7f, l->volt_steps);
+	    else
+	      resp = 3 << 6;		/* NAK, voltage margining not supported */
+	    break;
+	  default:
+	    continue;
+	  }
+      emul_set(ed, ctrl + 2, 2, (resp << 8) | (cmd & 0xff));
+    }
+}
+
+/*
+ *  Data Object Exchange: requests written to the Write Data Mailbox are
+ *  executed when Go is set, the response is then read dword by dword from
+ *  the Read Data Mailbox. Only the Discovery protocol is implemented.
+ */
+
+#define EMUL_DOE_MAX_DWORDS 256
+
+struct emul_doe {
+  u32 req[EMUL_DOE_MAX_DWORDS];
+  u32 resp[EMUL_DOE_MAX_DWORDS];
+  int req_len, resp_len, resp_pos;
+};
+
+static const struct {
+  u16 vendor;
+  byte type;
+} emul_doe_protocols[] = {
+  { 0x0001, 0x00 },			/* PCI-SIG: Discovery */
+};
+
+#define EMUL_DOE_NUM_PROTOCOLS (int)(sizeof(emul_doe_protocols) / sizeof(emul_doe_protocols[0]))
+
+static void
+emul_doe_reset(struct emul_dev *ed, struct emul_cap *c)
+{
+  struct emul_doe *o = c->state;
+
+  o->req_len = o->resp_len = o->resp_pos = 0;
+  emul_set(ed, c->addr + PCI_DOE_STS, 4, emul_get(ed, c->addr + PCI_DOE_STS, 4) & PCI_DOE_STS_INT);
+  emul_set(ed, c->addr + PCI_DOE_READ, 4, 0);
+}
+
+static void
+emul_doe_init(struct pci_dev *d UNUSED, struct emul_dev *ed, struct emul_cap *c)
+{
+  c->len = PCI_DOE_READ + 4;
+  if (c->addr + c->len > ed->len)
+    {
+      c->len = 0;
+      return;
+    }
+  emul_set(ed, c->addr + PCI_DOE_CTL, 4, emul_get(ed, c->addr + PCI_DOE_CTL, 4) & PCI_DOE_CTL_INT);
+  emul_doe_reset(ed, c);
+  memset(ed->wmask + c->addr + PCI_DOE_CTL, 0xff, 4);
+  memset(ed->wmask + c->addr + PCI_DOE_WRITE, 0xff, 8);
+  ed->w1cmask[c->addr + PCI_DOE_STS] = PCI_DOE_STS_INT;
+}
+
+static int
+emul_doe_execute(struct emul_doe *o)
+{
+  unsigned int len, index, next;
+  int i;
+
+  if (o->req_len < 2)
+    return 0;
+  len = o->req[1] & 0x3ffff;
+  if ((len ? len : 0x40000) != (unsigned int) o->req_len)
+    return 0;
+
+  for (i = 0; i < EMUL_DOE_NUM_PROTOCOLS; i++)
+    if ((o->req[0] & 0xffff) == emul_doe_protocols[i].vendor &&
+	((o->req[0] >> 16) & 0xff) == emul_doe_protocols[i].type)
+      break;
+  if (i)				/* Nothing but Discovery is supported */
+    return 0;
+
+  if (o->req_len < 3)
+    return 0;
+  index = o->req[2] & 0xff;
+  if (index >= EMUL_DOE_NUM_PROTOCOLS)
+    return 0;
+  next = (index + 1 < EMUL_DOE_NUM_PROTOCOLS) ? index + 1 : 0;
+  o->resp[0] = o->req[0];
+  o->resp[1] = 3;
+  o->resp[2] = emul_doe_protocols[index].vendor | (emul_doe_protocols[index].type << 16) | (next << 24);
+  o->resp_len = 3;
+  return 1;
+}
+
+static void
+emul_doe_write(struct emul_dev *ed, struct emul_cap *c, int pos, int len)
+{
+  struct emul_doe *o = c->state;
+  int ctl = c->addr + PCI_DOE_CTL;
+  int sts = c->addr + PCI_DOE_STS;
+  u32 s = emul_get(ed, sts, 4);
+
+  if (emul_touched(pos, len, c->addr + PCI_DOE_WRITE, 4))
+    {
+      if (o->req_len < EMUL_DOE_MAX_DWORDS)
+	o->req[o->req_len++] = emul_get(ed, c->addr + PCI_DOE_WRITE, 4);
+      else
+	s |= PCI_DOE_STS_ERROR;
+    }
+
+  if (emul_touched(pos, len, c->addr + PCI_DOE_READ, 4) && (s & PCI_DOE_STS_OBJECT_READY))
+    {
+      if (++o->resp_pos < o->resp_len)
+	emul_set(ed, c->addr + PCI_DOE_READ, 4, o->resp[o->resp_pos]);
+      else
+	{
+	  s &= ~PCI_DOE_STS_OBJECT_READY;
+	  emul_set(ed, c->addr + PCI_DOE_READ, 4, 0);
+	}
+    }
+  emul_set(ed, sts, 4, s);
+
+  if (emul_touched(pos, len, ctl, 4))
+    {
+      u32 x = emul_get(ed, ctl, 4);
+      if (x & PCI_DOE_CTL_ABORT)
+	emul_doe_reset(ed, c);
+      else if (x & PCI_DOE_CTL_GO)
+	{
+	  if (!(s & PCI_DOE_STS_ERROR) && emul_doe_execute(o))
+	    {
+	      o->resp_pos = 0;
+	      emul_set(ed, c->addr + PCI_DOE_READ, 4, o->resp[0]);
+	      s |= PCI_DOE_STS_OBJECT_READY;
+	    }
+	  else
+	    s |= PCI_DOE_STS_ERROR;
+	  o->req_len = 0;
+	  emul_set(ed, sts, 4, s);
+	}
+      /* Abort and Go always read as zero */
+      emul_set(ed, ctl, 4, x & ~(PCI_DOE_CTL_ABORT | PCI_DOE_CTL_GO));
+    }
+}
+
+/*
+ *  Vital Product Data: writing an address with the F flag clear fetches
+ *  a dword to the data register, writing it with F set stores the data
+ *  register. Either way, the F flag is flipped to signal completion.
+ *  The VPD is taken from the underlying method if it can read it,
+ *  otherwise a minimal one is made up.
+ */
+
+#define EMUL_VPD_SIZE 32768
+
+struct emul_vpd {
+  byte data[EMUL_VPD_SIZE];
+};
+
+static void
+emul_vpd_init(struct pci_dev *d, struct emul_dev *ed, struct emul_cap *c)
+{
+  static const char ident[] = "Emulated device";
+  struct pci_methods *inner = emul_of(d->methods)->w.inner;
+  struct emul_vpd *v = c->state;
+  int len = 0;
+
+  c->len = PCI_VPD_DATA + 4;
+  if (c->addr + c->len > ed->len)
+    {
+      c->len = 0;
+      return;
+    }
+  memset(ed->wmask + c->addr + PCI_VPD_ADDR, 0xff, 6);
+
+  memset(v->data, 0xff, EMUL_VPD_SIZE);
+  if (inner->read_vpd)
+    while (len < EMUL_VPD_SIZE && inner->read_vpd(d, len, v->data + len, 256))
+      len += 256;
+  if (!len)
+    {
+      v->data[0] = 0x82;		/* Identifier string */
+      v->data[1] = sizeof(ident) - 1;
+      v->data[2] = 0;
+      memcpy(v->data + 3, ident, sizeof(ident) - 1);
+      v->data[3 + sizeof(ident) - 1] = 0x78;	/* End */
+    }
+}
+
+static void
+emul_vpd_write(struct emul_dev *ed, struct emul_cap *c, int pos, int len)
+{
+  struct emul_vpd *v = c->state;
+  int addr_reg = c->addr + PCI_VPD_ADDR;
+  int data_reg = c->addr + PCI_VPD_DATA;
+  u16 addr;
+
+  if (!emul_touched(pos, len, addr_reg, 2))
+    return;
+  addr = emul_get(ed, addr_reg, 2);
+  if (addr & PCI_VPD_ADDR_F)
+    memcpy(v->data + (addr & PCI_VPD_ADDR_MASK & ~3), ed->config + data_reg, 4);
+  else
+    memcpy(ed->config + data_reg, v->data + (addr & PCI_VPD_ADDR_MASK & ~3), 4);
+  emul_set(ed, addr_reg, 2, addr ^ PCI_VPD_ADDR_F);
+}
+
+static struct emul_model emul_model_lmr = {
+  .name = "lmr",
+  .cap_type = PCI_CAP_EXTENDED,
+  .cap_id = PCI_EXT_CAP_ID_LMR,
+  .state_size = sizeof(struct emul_lmr),
+  .init = emul_lmr_init,
+  .write = emul_lmr_write,
+};
+
+static struct emul_model emul_model_doe = {
+  .name = "doe",
+  .cap_type = PCI_CAP_EXTENDED,
+  .cap_id = PCI_EXT_CAP_ID_DOE,
+  .state_size = sizeof(struct emul_doe),
+  .init = emul_doe_init,
+  .write = emul_doe_write,
+};
+
+static struct emul_model emul_model_vpd = {
+  .name = "vpd",
+  .cap_type = PCI_CAP_NORMAL,
+  .cap_id = PCI_CAP_ID_VPD,
+  .state_size = sizeof(struct emul_vpd),
+  .init = emul_vpd_init,
+  .write = emul_vpd_write,
+};
+
+static struct emul_model *emul_models[] = {
+  &emul_model_lmr,
+  &emul_model_doe,
+  &emul_model_vpd,
+  NULL
+};
+
+/*** Register masks ***/
+
+#define ANY_HDR 0xff
+
+static const struct emul_reg {
+  byte cap_type;
+  byte hdr;				/* Header type or ANY_HDR */
+  u16 cap_id;
+  u16 pos;
+  byte width;
+  u32 rw, w1c;
+} emul_regs[] = {
+  /* Standard header */
+  { 0, ANY_HDR, 0, PCI_COMMAND,			2, 0x07ff, 0 },
+  { 0, ANY_HDR, 0, PCI_STATUS,			2, 0, 0xf900 },
+  { 0, ANY_HDR, 0, PCI_CACHE_LINE_SIZE,		1, 0xff, 0 },
+  { 0, ANY_HDR, 0, PCI_LATENCY_TIMER,		1, 0xff, 0 },
+  { 0, ANY_HDR, 0, PCI_INTERRUPT_LINE,		1, 0xff, 0 },
+  /* Bridges */
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_PRIMARY_BUS,	1, 0xff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_SECONDARY_BUS,	1, 0xff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_SUBORDINATE_BUS,	1, 0xff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_SEC_LATENCY_TIMER, 1, 0xff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_IO_BASE,		1, 0xf0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_IO_LIMIT,		1, 0xf0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_SEC_STATUS,	2, 0, 0xf900 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_MEMORY_BASE,	2, 0xfff0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_MEMORY_LIMIT,	2, 0xfff0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_PREF_MEMORY_BASE,	2, 0xfff0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_PREF_MEMORY_LIMIT, 2, 0xfff0, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_PREF_BASE_UPPER32, 4, 0xffffffff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_PREF_LIMIT_UPPER32, 4, 0xffffffff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_IO_BASE_UPPER16,	2, 0xffff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_IO_LIMIT_UPPER16,	2, 0xffff, 0 },
+  { 0, PCI_HEADER_TYPE_BRIDGE, 0, PCI_BRIDGE_CONTROL,	2, 0x0fff, 0 },
+  /* Power Management */
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_PM, PCI_PM_CTRL, 2, PCI_PM_CTRL_STATE_MASK | PCI_PM_CTRL_PME_ENABLE, PCI_PM_CTRL_PME_STATUS },
+  /* MSI and MSI-X */
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_MSI, PCI_MSI_FLAGS, 2, PCI_MSI_FLAGS_ENABLE | PCI_MSI_FLAGS_QSIZE, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_MSI, PCI_MSI_ADDRESS_LO, 4, 0xfffffffc, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_MSIX, PCI_MSI_FLAGS, 2, PCI_MSIX_ENABLE | PCI_MSIX_MASK, 0 },
+  /* PCI Express */
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_DEVCTL,	2, 0x7fff, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_DEVSTA,	2, 0, 0x000f },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_LNKCTL,	2, 0x0fff, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_LNKSTA,	2, 0, 0xc000 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_SLTCTL,	2, 0x1fff, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_SLTSTA,	2, 0, 0x011f },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_RTCTL,	2, 0x001f, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_RTSTA,	4, 0, PCI_EXP_RTSTA_PME_STATUS },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_DEVCTL2,	2, 0xffff, 0 },
+  { PCI_CAP_NORMAL, ANY_HDR, PCI_CAP_ID_EXP, PCI_EXP_LNKCTL2,	2, 0xffff, 0 },
+  /* Advanced Error Reporting */
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_STATUS,	4, 0, 0xffffffff },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_MASK,	4, 0xffffffff, 0 },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_SEVER,	4, 0xffffffff, 0 },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_COR_STATUS,	4, 0, 0xffffffff },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_COR_MASK,	4, 0xffffffff, 0 },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_CAP,		4, 0x00000540, 0 },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_ROOT_COMMAND, 4, 0x00000007, 0 },
+  { PCI_CAP_EXTENDED, ANY_HDR, PCI_EXT_CAP_ID_AER, PCI_ERR_ROOT_STATUS,	4, 0, 0x0000007f },
+  { 0, 0, 0, 0, 0, 0, 0 }
+};
+
+static int
+emul_find_cap(struct emul_dev *ed, int type, int id)
+{
+  int pos, ttl;
+
+  if (type == PCI_CAP_NORMAL)
+    {
+      if (ed->len < 64 || !(emul_get(ed, PCI_STATUS, 2) & PCI_STATUS_CAP_LIST) ||
+	  (ed->config[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_CARDBUS)
+	return 0;
+      pos = ed->config[PCI_CAPABILITY_LIST] & ~3;
+      for (ttl = 48; pos >= 0x40 && pos + 2 <= ed->len && ttl--; pos = ed->config[pos + 1] & ~3)
+	if (ed->config[pos] == id)
+	  return pos;
+    }
+  else if (type == PCI_CAP_EXTENDED)
+    {
+      for (pos = 0x100, ttl = 1024; pos >= 0x100 && pos + 4 <= ed->len && ttl--; )
+	{
+	  u32 h = emul_get(ed, pos, 4);
+	  if (!h || h == 0xffffffff)
+	    break;
+	  if ((h & 0xffff) == (u32) id)
+	    return pos;
+	  pos = (h >> 20) & ~3;
+	}
+    }
+  return 0;
+}
+
+static void
+emul_set_mask(struct emul_dev *ed, int pos, int width, int kind, u32 mask)
+{
+  int i;
+
+  if (pos < 0 || pos + width > ed->len)
+    return;
+  for (i = 0; i < width; i++, mask >>= 8)
+    {
+      byte *w = &ed->wmask[pos + i], *c = &ed->w1cmask[pos + i];
+      switch (kind)
+	{
+	case EMUL_RW:
+	  *w |= mask;
+	  *c &= ~mask;
+	  break;
+	case EMUL_RW1C:
+	  *w &= ~mask;
+	  *c |= mask;
+	  break;
+	default:
+	  *w &= ~mask;
+	  *c &= ~mask;
+	}
+    }
+}
+
+static struct emul_dev *
+emul_create(struct emul *e, struct pci_dev *d)
+{
+  struct pci_access *a = d->access;
+  static const int sizes[] = { 4096, 256, 64 };
+  byte *buf = pci_malloc(a, 3 * 4096);
+  const struct emul_reg *r;
+  struct emul_override *o;
+  struct emul_dev *ed;
+  int i, len = 0, hdr;
+
+  for (i = 0; i < 3 && !len; i++)
+    if (e->w.inner->read(d, 0, buf, sizes[i]))
+      len = sizes[i];
+  if (!len)
+    {
+      pci_mfree(buf);
+      return NULL;
+    }
+
+  ed = pci_malloc(a, sizeof(*ed));
+  memset(ed, 0, sizeof(*ed));
+  ed->domain = d->domain;
+  ed->bus = d->bus;
+  ed->dev = d->dev;
+  ed->func = d->func;
+  ed->len = len;
+  ed->config = buf;
+  ed->wmask = buf + len;
+  ed->w1cmask = buf + 2 * len;
+  memset(ed->wmask, 0, 2 * len);
+
+  hdr = ed->config[PCI_HEADER_TYPE] & 0x7f;
+  for (r = emul_regs; r->width; r++)
+    {
+      int base = 0;
+      if (r->hdr != ANY_HDR && r->hdr != hdr)
+	continue;
+      if (r->cap_type && !(base = emul_find_cap(ed, r->cap_type, r->cap_id)))
+	continue;
+      emul_set_mask(ed, base + r->pos, r->width, EMUL_RW, r->rw);
+      emul_set_mask(ed, base + r->pos, r->width, EMUL_RW1C, r->w1c);
+    }
+
+  for (i = 0; emul_models[i]; i++)
+    {
+      struct emul_model *m = emul_models[i];
+      struct emul_cap *c;
+      int addr;
+
+      if (!(e->models & (1 << i)) || !(addr = emul_find_cap(ed, m->cap_type, m->cap_id)))
+	continue;
+      c = pci_malloc(a, sizeof(*c) + m->state_size);
+      memset(c, 0, sizeof(*c) + m->state_size);
+      c->model = m;
+      c->addr = addr;
+      c->state = c + 1;
+      m->init(d, ed, c);
+      c->next = ed->caps;
+      ed->caps = c;
+    }
+
+  for (o = e->overrides; o; o = o->next)
+    if (o->any_slot || pci_filter_match(&o->filter, d))
+      emul_set_mask(ed, o->pos, o->width, o->kind, o->mask);
+
+  return ed;
+}
+
+static inline unsigned int
+emul_hash(struct pci_dev *d)
+{
+  return (d->domain * 0x9e3779b1 + (d->bus << 8) + (d->dev << 3) + d->func) % EMUL_HASH_SIZE;
+}
+
+/* Find emulated state of a device, create it if asked to */
+static struct emul_dev *
+emul_lookup(struct emul *e, struct pci_dev *d, int create)
+{
+  struct emul_dev **h = &e->hash[emul_hash(d)];
+  struct emul_dev *ed;
+
+  for (ed = *h; ed; ed = ed->next)
+    if (ed->domain == (u32) d->domain && ed->bus == d->bus && ed->dev == d->dev && ed->func == d->func)
+      return ed;
+  if (!create || !(ed = emul_create(e, d)))
+    return NULL;
+  ed->next = *h;
+  *h = ed;
+  return ed;
+}
+
+/*** Parameters ***/
+
+static char *
+emul_parse_override(struct pci_access *a, struct emul *e, char *spec)
+{
+  static const char * const kinds[] = { "ro", "rw", "rw1c", "rsvdp" };
+  struct emul_override *o = pci_malloc(a, sizeof(*o));
+  char *c, *kind, *mask, *end;
+  unsigned int i;
+
+  memset(o, 0, sizeof(*o));
+  o->next = e->overrides;
+  e->overrides = o;
+
+  if (c = strchr(spec, '/'))
+    {
+      *c++ = 0;
+      pci_filter_init(a, &o->filter);
+      if (pci_filter_parse_slot(&o->filter, spec))
+	return "invalid slot";
+      spec = c;
+    }
+  else
+    o->any_slot = 1;
+
+  if (!(kind = strchr(spec, '=')))
+    return "missing register kind";
+  *kind++ = 0;
+  if (!(c = strchr(spec, '.')))
+    return "missing register width";
+  *c++ = 0;
+  o->pos = strtol(spec, &end, 16);
+  if (!*spec || *end || o->pos < 0 || o->pos >= 4096)
+    return "invalid position";
+  if (!strcmp(c, "b") || !strcmp(c, "B"))
+    o->width = 1;
+  else if (!strcmp(c, "w") || !strcmp(c, "W"))
+    o->width = 2;
+  else if (!strcmp(c, "l") || !strcmp(c, "L"))
+    o->width = 4;
+  else
+    return "invalid register width";
+  if (o->pos & (o->width - 1))
+    return "unaligned register";
+
+  o->mask = 0xffffffff;
+  if (mask = strchr(kind, ':'))
+    {
+      *mask++ = 0;
+      o->mask = strtoul(mask, &end, 16);
+      if (!*mask || *end)
+	return "invalid mask";
+    }
+  for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+    if (!strcasecmp(kind, kinds[i]))
+      break;
+  if (i >= sizeof(kinds) / sizeof(kinds[0]))
+    return "unknown register kind";
+  o->kind = i;
+  return NULL;
+}
+
+static char *
+emul_parse_lmr(struct pci_access *a, struct emul *e, char *spec)
+{
+  struct emul_lmr_param *p = pci_malloc(a, sizeof(*p));
+  char *c, *lanes, *end;
+  int key;
+
+  memset(p, 0, sizeof(*p));
+  p->last_lane = EMUL_LMR_LANES - 1;
+  *e->lmr_last = p;
+  e->lmr_last = &p->next;
+
+  if (c = strchr(spec, '/'))
+    {
+      *c++ = 0;
+      pci_filter_init(a, &p->filter);
+      if (pci_filter_parse_slot(&p->filter, spec))
+	return "invalid slot";
+      spec = c;
+    }
+  else
+    p->any_slot = 1;
+
+  if (!(c = strchr(spec, '=')))
+    return "missing value";
+  *c++ = 0;
+  p->value = strtol(c, &end, 0);
+  if (!*c || *end)
+    return "invalid value";
+
+  if (lanes = strchr(spec, '@'))
+    {
+      *lanes++ = 0;
+      p->first_lane = p->last_lane = strtol(lanes, &end, 10);
+      if (*end == '-')
+	p->last_lane = strtol(end + 1, &end, 10);
+      if (!*lanes || *end || p->first_lane < 0 || p->last_lane < p->first_lane || p->last_lane >= EMUL_LMR_LANES)
+	return "invalid lanes";
+    }
+
+  for (key = 0; key < EMUL_LMR_KEYS && strcasecmp(spec, emul_lmr_keys[key].name); key++)
+    ;
+  if (key >= EMUL_LMR_KEYS)
+    return "unknown key";
+  if (lanes && !EMUL_LMR_PER_LANE(key))
+    return "not a property of lanes";
+  if (p->value < 0 || p->value > emul_lmr_keys[key].max)
+    return "value out of range";
+  p->key = key;
+  return NULL;
+}
+
+static void
+emul_parse_params(struct pci_access *a, struct emul *e)
+{
+  char *models = pci_get_param(a, "emul.models");
+  char *regs = pci_get_param(a, "emul.regs");
+  char *lmr = pci_get_param(a, "emul.lmr");
+  char *buf, *c, *err;
+  int i;
+
+  if (models && models[0] && strcasecmp(models, "none"))
+    {
+      buf = pci_strdup(a, models);
+      for (c = strtok(buf, ","); c; c = strtok(NULL, ","))
+	{
+	  for (i = 0; emul_models[i] && strcasecmp(emul_models[i]->name, c); i++)
+	    ;
+	  if (!emul_models[i])
+	    a->error("emul: Unknown model \"%s\".", c);
+	  e->models |= 1 << i;
+	}
+      pci_mfree(buf);
+    }
+
+  if (regs && regs[0])
+    {
+      buf = pci_strdup(a, regs);
+      for (c = strtok(buf, ","); c; c = strtok(NULL, ","))
+	{
+	  char *spec = pci_strdup(a, c);
+	  if (err = emul_parse_override(a, e, c))
+	    a->error("emul: Invalid register specification \"%s\": %s.", spec, err);
+	  pci_mfree(spec);
+	}
+      pci_mfree(buf);
+    }
+
+  if (lmr && lmr[0])
+    {
+      buf = pci_strdup(a, lmr);
+      for (c = strtok(buf, ","); c; c = strtok(NULL, ","))
+	{
+	  char *spec = pci_strdup(a, c);
+	  if (err = emul_parse_lmr(a, e, c))
+	    a->error("emul: Invalid margining specification \"%s\": %s.", spec, err);
+	  pci_mfree(spec);
+	}
+      pci_mfree(buf);
+    }
+}
+
+/*** Access method ***/
+
+static void
+emul_config(struct pci_access *a)
+{
+  pci_define_param(a, "emul.method", "dump", "Access method providing the devices to emulate");
+  pci_define_param(a, "emul.models", "lmr,doe,vpd", "Capabilities with emulated behavior (lmr, doe, vpd or none)");
+  pci_define_param(a, "emul.regs", "", "Extra register masks: [<slot>/]<pos>.<b|w|l>=<ro|rw|rw1c|rsvdp>[:<mask>],...");
+  pci_define_param(a, "emul.lmr", "", "Emulated Lane Margining: [<slot>/]<key>[@<lane>[-<lane>]]=<value>,...");
+}
+
+static int
+emul_detect(struct pci_access *a UNUSED)
+{
+  /* Emulation must be always requested explicitly */
+  return 0;
+}
+
+static void
+emul_init(struct pci_access *a)
+{
+  char *method = pci_get_param(a, "emul.method");
+  struct emul *e;
+  struct pci_dev *d;
+  int m = PCI_ACCESS_AUTO;
+
+  if (method && method[0] && strcmp(method, "auto"))
+    {
+      m = pci_lookup_method(method);
+      if (m < 0 || m == PCI_ACCESS_EMUL)
+	a->error("emul: Cannot emulate devices of access method \"%s\".", method);
+    }
+
+  e = pci_malloc(a, sizeof(*e));
+  memset(e, 0, sizeof(*e));
+  e->hash = pci_malloc(a, EMUL_HASH_SIZE * sizeof(struct emul_dev *));
+  memset(e->hash, 0, EMUL_HASH_SIZE * sizeof(struct emul_dev *));
+  e->lmr_last = &e->lmr_params;
+  emul_parse_params(a, e);
+
+  /* The same trick as in the trace method: we interpose our copy of the method table */
+  a->method = m;
+  a->methods = NULL;
+  if (!pci_init_internal(a, PCI_ACCESS_EMUL))
+    a->error("emul: Cannot find any working access method.");
+  e->w.inner = a->methods;
+  e->w.methods = pm_emul;
+  a->methods = &e->w.methods;
+  a->method = PCI_ACCESS_EMUL;
+
+  /* Cached config space would bypass the emulation */
+  for (d = a->devices; d; d = d->next)
+    {
+      d->methods = a->methods;
+      pci_setup_cache(d, NULL, 0);
+    }
+}
+
+static void
+emul_cleanup(struct pci_access *a)
+{
+  struct emul *e = emul_of(a->methods);
+  struct emul_override *o;
+  struct emul_lmr_param *p;
+  int i;
+
+  e->w.inner->cleanup(a);
+  for (i = 0; i < EMUL_HASH_SIZE; i++)
+    while (e->hash[i])
+      {
+	struct emul_dev *ed = e->hash[i];
+	e->hash[i] = ed->next;
+	while (ed->caps)
+	  {
+	    struct emul_cap *c = ed->caps;
+	    ed->caps = c->next;
+	    pci_mfree(c);
+	  }
+	pci_mfree(ed->config);
+	pci_mfree(ed);
+      }
+  while (o = e->overrides)
+    {
+      e->overrides = o->next;
+      pci_mfree(o);
+    }
+  while (p = e->lmr_params)
+    {
+      e->lmr_params = p->next;
+      pci_mfree(p);
+    }
+  pci_mfree(e->hash);
+  a->methods = e->w.inner;
+  pci_mfree(e);
+}
+
+static void
+emul_scan(struct pci_access *a)
+{
+  struct emul *e = emul_of(a->methods);
+  struct pci_dev *d;
+
+  e->w.inner->scan(a);
+  for (d = a->devices; d; d = d->next)
+    {
+      d->methods = a->methods;
+      pci_setup_cache(d, NULL, 0);
+    }
+}
+
+static void
+emul_fill_info(struct pci_dev *d, unsigned int flags)
+{
+  emul_of(d->methods)->w.inner->fill_info(d, flags);
+}
+
+static int
+emul_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct emul *e = emul_of(d->methods);
+  struct emul_dev *ed = emul_lookup(e, d, 0);
+
+  if (!ed)
+    return e->w.inner->read(d, pos, buf, len);
+  if (pos + len > ed->len)
+    return 0;
+  memcpy(buf, ed->config + pos, len);
+  return 1;
+}
+
+static int
+emul_write(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct emul_dev *ed = emul_lookup(emul_of(d->methods), d, 1);
+  struct emul_cap *c;
+  int i;
+
+  if (!ed || pos + len > ed->len)
+    return 0;
+
+  for (i = 0; i < len; i++)
+    {
+      int p = pos + i;
+      ed->config[p] = ((ed->config[p] & ~ed->wmask[p]) | (buf[i] & ed->wmask[p])) & ~(buf[i] & ed->w1cmask[p]);
+    }
+
+  for (c = ed->caps; c; c = c->next)
+    if (emul_touched(pos, len, c->addr, c->len))
+      c->model->write(ed, c, pos, len);
+  return 1;
+}
+
+static int
+emul_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct emul *e = emul_of(d->methods);
+  struct emul_dev *ed = emul_lookup(e, d, 1);
+  struct emul_cap *c = NULL;
+
+  if (ed)
+    for (c = ed->caps; c && c->model != &emul_model_vpd; c = c->next)
+      ;
+  if (!c || !c->len)
+    return e->w.inner->read_vpd ? e->w.inner->read_vpd(d, pos, buf, len) : 0;
+  if (pos < 0 || pos + len > EMUL_VPD_SIZE)
+    return 0;
+  memcpy(buf, ((struct emul_vpd *) c->state)->data + pos, len);
+  return 1;
+}
+
+static void
+emul_init_dev(struct pci_dev *d)
+{
+  struct emul *e = emul_of(d->methods);
+
+  if (e->w.inner->init_dev)
+    e->w.inner->init_dev(d);
+}
+
+static void
+emul_cleanup_dev(struct pci_dev *d)
+{
+  struct emul *e = emul_of(d->methods);
+
+  if (e->w.inner->cleanup_dev)
+    e->w.inner->cleanup_dev(d);
+}
+
+struct pci_methods pm_emul = {
+  .name = "emul",
+  .help = "Emulated devices accepting writes, taken from another method (set `emul.method', usually a dump)",
+  .config = emul_config,
+  .detect = emul_detect,
+  .init = emul_init,
+  .cleanup = emul_cleanup,
+  .scan = emul_scan,
+  .fill_info = emul_fill_info,
+  .read = emul_read,
+  .write = emul_write,
+  .read_vpd = emul_read_vpd,
+  .init_dev = emul_init_dev,
+  .cleanup_dev = emul_cleanup_dev,
+};
@@ -1516,6 +1516,8 @@
 #define  PCI_DOE_STS_INT		0x2	/* DOE Interrupt Status */
 #define  PCI_DOE_STS_ERROR		0x4	/* DOE Error */
 #define  PCI_DOE_STS_OBJECT_READY	0x80000000 /* Data Object Ready */
+#define PCI_DOE_WRITE		0x10	/* DOE Write Data Mailbox Register */
+#define PCI_DOE_READ		0x14	/* DOE Read Data Mailbox Register */
 
 /* Lane Margining at the Receiver Extended Capability */
 #define PCI_LMR_CAPS			0x4 /* Margining Port Capabilities Register */
@@ -1523,6 +1525,8 @@
 #define PCI_LMR_PORT_STS		0x6 /* Margining Port Status Register */
 #define PCI_LMR_PORT_STS_READY		0x1 /* Margining Ready */
 #define PCI_LMR_PORT_STS_SOFT_READY	0x2 /* Margining Software Ready */
+#define PCI_LMR_LANE_CTRL(lane)		(0x8 + 4*(lane)) /* Margining Lane Control Register */
+#define PCI_LMR_LANE_STS(lane)		(0xa + 4*(lane)) /* Margining Lane Status Register */
 
 /* Device 3 Extended Capability */
 #define PCI_DEV3_DEVCAP3		0x04	/* Device Capabilities 3 */
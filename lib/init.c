@@ -168,6 +168,18 @@ static struct pci_methods *pci_methods[PCI_ACCESS_MAX] = {
 #else
   NULL,
 #endif
+#ifdef PCI_HAVE_PM_TRACE
+  &pm_trace,
+  &pm_replay,
+#else
+  NULL,
+  NULL,
+#endif
+#ifdef PCI_HAVE_PM_EMUL
+  &pm_emul,
+#else
+  NULL,
+#endif
 };
 
 // If PCI_ACCESS_AUTO is selected, we probe the access methods in this order
@@ -248,6 +260,16 @@ pci_malloc(struct pci_access *a, int size)
   return x;
 }
 
+void *
+pci_realloc(struct pci_access *a, void *x, size_t size)
+{
+  x = realloc(x, size);
+
+  if (!x)
+    (a && a->error ? a->error : pci_generic_error)("Out of memory (reallocation of %lu bytes failed)", (unsigned long) size);
+  return x;
+}
+
 void
 pci_mfree(void *x)
 {
@@ -72,6 +72,25 @@ struct pci_methods {
   void (*cleanup_dev)(struct pci_dev *);
 };
 
+/*
+ *  Methods interposed on top of another method (trace, emul) keep their
+ *  state in a structure starting with struct pci_wrapper. Devices point
+ *  to the topmost method, so each of them finds its own state by walking
+ *  down the stack.
+ */
+struct pci_wrapper {
+  struct pci_methods methods;		/* Must be first, devices point to it */
+  struct pci_methods *inner;		/* Wrapped method */
+};
+
+static inline struct pci_wrapper *
+pci_find_wrapper(struct pci_methods *m, void (*init)(struct pci_access *))
+{
+  while (m->init != init)
+    m = ((struct pci_wrapper *) m)->inner;
+  return (struct pci_wrapper *) m;
+}
+
 /* generic.c */
 void pci_generic_scan_bus(struct pci_access *, byte *busmap, int domain, int bus);
 void pci_generic_scan_domain(struct pci_access *, int domain);
@@ -85,6 +104,7 @@ int pci_emulated_read(struct pci_dev *d, int pos, byte *buf, int len);
 
 /* init.c */
 void *pci_malloc(struct pci_access *, int);
+void *pci_realloc(struct pci_access *, void *, size_t);
 void pci_mfree(void *);
 char *pci_strdup(struct pci_access *a, const char *s);
 struct pci_access *pci_clone_access(struct pci_access *a);
@@ -138,6 +158,7 @@ int pci_set_param_internal(struct pci_access *acc, char *param, char *val, int c
 void pci_free_params(struct pci_access *acc);
 
 /* caps.c */
+void pci_add_cap(struct pci_dev *d, unsigned int addr, unsigned int id, unsigned int type);
 void pci_scan_caps(struct pci_dev *, unsigned int want_fields);
 void pci_free_caps(struct pci_dev *);
 
@@ -146,6 +167,6 @@ extern struct pci_methods pm_intel_conf1, pm_intel_conf2, pm_linux_proc,
 	pm_dump, pm_linux_sysfs, pm_darwin, pm_sylixos_device, pm_hurd,
 	pm_mmio_conf1, pm_mmio_conf1_ext, pm_ecam,
 	pm_win32_cfgmgr32, pm_win32_kldbg, pm_win32_sysdbg, pm_aos_expansion,
-	pm_rt_thread_smart_dm;
+	pm_rt_thread_smart_dm, pm_trace, pm_replay, pm_emul;
 
 #endif
@@ -22,7 +22,7 @@ extern "C" {
 #include "header.h"
 #include "types.h"
 
-#define PCI_LIB_VERSION 0x030f00
+#define PCI_LIB_VERSION 0x031000
 
 #ifndef PCI_ABI
 #define PCI_ABI
@@ -57,6 +57,9 @@ enum pci_access_type {
   PCI_ACCESS_ECAM,			/* PCIe ECAM via /dev/mem */
   PCI_ACCESS_AOS_EXPANSION,		/* AmigaOS Expansion library */
   PCI_ACCESS_RT_THREAD_SMART_DM,	/* RT-Thread Smart pci */
+  PCI_ACCESS_TRACE,			/* Recording of accesses made through another method */
+  PCI_ACCESS_REPLAY,			/* Replaying of recorded accesses */
+  PCI_ACCESS_EMUL,			/* Emulated devices accepting writes */
   PCI_ACCESS_MAX
 };
 
@@ -99,7 +102,13 @@ struct pci_access {
   void *backend_data;			/* Private data of the back end */
 };
 
-/* Initialize PCI access */
+/*
+ *	Initialize PCI access
+ *
+ *	The library is not thread-safe: a pci_access and everything obtained
+ *	through it must be used by a single thread at a time. Threads which
+ *	need to access devices concurrently should use a pci_access each.
+ */
 struct pci_access *pci_alloc(void) PCI_ABI;
 void pci_init(struct pci_access *) PCI_ABI;
 void pci_cleanup(struct pci_access *) PCI_ABI;
@@ -265,6 +274,7 @@ struct pci_cap {
 #define PCI_CAP_EXTENDED	2	/* PCIe extended capabilities */
 
 struct pci_cap *pci_find_cap(struct pci_dev *, unsigned int id, unsigned int type) PCI_ABI;
+struct pci_cap *pci_find_cap_by_pos(struct pci_dev *, unsigned int pos) PCI_ABI;	/* Capability containing pos, NULL for the header */
 struct pci_cap *pci_find_cap_nr(struct pci_dev *, unsigned int id, unsigned int type,
                                 unsigned int *cap_number) PCI_ABI;
 
@@ -327,6 +337,51 @@ enum pci_lookup_mode {
   PCI_LOOKUP_NO_HWDB = 0x800000,	/* Do not ask udev's hwdb */
 };
 
+/*
+ *	Binary snapshots of config space and device properties,
+ *	which can be read back by the "dump" access method.
+ *
+ *	Errors are reported by calling acc->error().
+ */
+
+struct pci_snapshot;
+
+struct pci_snapshot *pci_snapshot_create(struct pci_access *acc, char *name) PCI_ABI;	/* "-" for stdout */
+void pci_snapshot_add(struct pci_snapshot *s, struct pci_dev *d, u8 *config, int len) PCI_ABI;
+void pci_snapshot_close(struct pci_snapshot *s) PCI_ABI;
+
+/*
+ *	Time series: a base snapshot followed by samples, which record
+ *	only dwords of config space that have changed since the previous
+ *	sample. To write one, call pci_snapshot_new_sample() after adding
+ *	the base snapshot and then pci_snapshot_add() again for its devices.
+ */
+
+void pci_snapshot_new_sample(struct pci_snapshot *s, u32 time_sec, u32 time_usec) PCI_ABI;
+
+struct pci_series_change {
+  int sample;				/* Sample number (1 for the first sample after the base) */
+  u32 time_sec, time_usec;		/* Time of the sample */
+  int pos;				/* Position of the changed dword in config space */
+  u32 old_value, new_value;
+};
+
+int pci_series_samples(struct pci_access *acc) PCI_ABI;		/* Number of samples, 0 if not reading a time series */
+int pci_series_select(struct pci_access *acc, int sample) PCI_ABI;	/* Show config space as of given sample (0=base); 0 on error */
+/* Iterate over changes of a config space dword at pos (or of all dwords if pos < 0), start with *ch zeroed */
+int pci_series_next_change(struct pci_dev *d, int pos, struct pci_series_change *ch) PCI_ABI;
+
+/*
+ *	Comparison of config space images: finds ranges of differing dwords
+ *	and returns their number. At most max_ranges of them are stored.
+ */
+
+struct pci_diff_range {
+  int pos, len;
+};
+
+int pci_config_diff(u8 *a, u8 *b, int len, struct pci_diff_range *ranges, int max_ranges) PCI_ABI;
+
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,1163 @@
+/*
+ *	The PCI Library -- Recording and Replaying of Config Space Accesses
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "internal.h"
+
+/*
+ *  The trace is a text file with one record per line:
+ *
+ *	# comment
+ *	M <method>				method being traced
+ *	D <slot> <known> <fields>		device found by the scan
+ *	S <time> <count>			end of the scan
+ *	R <time> <slot> <pos> <len> <data>	read of config space
+ *	W <time> <slot> <pos> <len> <data> <ok>	write to config space
+ *	V <time> <slot> <pos> <len> <data>	read of VPD
+ *	F <time> <slot> <flags> <new> <fields>	pci_fill_info() call
+ *
+ *  Times are in microseconds since the start of the trace, positions,
+ *  flags and data are in hex, data is "-" if the access failed. Accesses
+ *  issued by the library itself while scanning the bus or filling device
+ *  information are recorded in lower case. Fields are a list of key=value
+ *  pairs describing the values of the PCI_FILL_xxx fields given by <known>
+ *  or <new>, see trace_put_fields().
+ */
+
+#define TRACE_HEADER "# libpci trace"
+
+static void
+trace_put_slot(FILE *f, struct pci_dev *d)
+{
+  fprintf(f, "%04x:%02x:%02x.%d", d->domain, d->bus, d->dev, d->func);
+}
+
+static void
+trace_put_hex(FILE *f, byte *buf, int len)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  while (len--)
+    {
+      putc(hex[*buf >> 4], f);
+      putc(hex[*buf++ & 15], f);
+    }
+}
+
+static void
+trace_put_addrs(FILE *f, const char *key, pciaddr_t *x, int n)
+{
+  int i;
+
+  fprintf(f, " %s=", key);
+  for (i = 0; i < n; i++)
+    fprintf(f, "%s%" PCI_U64_FMT_X, (i ? "," : ""), (u64) x[i]);
+}
+
+static void
+trace_put_string(FILE *f, const char *key, const char *s)
+{
+  if (!s)
+    return;
+  fprintf(f, " %s=", key);
+  for (; *s; s++)
+    if ((byte) *s <= ' ' || *s == '%' || (byte) *s >= 0x7f)
+      fprintf(f, "%%%02x", (byte) *s);
+    else
+      putc(*s, f);
+}
+
+/* Write values of the given fields, capabilities starting with the given one */
+static void
+trace_put_fields(FILE *f, struct pci_dev *d, unsigned int fields, struct pci_cap *cap)
+{
+  if (fields & PCI_FILL_IDENT)
+    fprintf(f, " ident=%04x:%04x", d->vendor_id, d->device_id);
+  if (fields & PCI_FILL_CLASS)
+    fprintf(f, " class=%04x", d->device_class);
+  if (fields & PCI_FILL_CLASS_EXT)
+    fprintf(f, " classext=%02x:%02x", d->prog_if, d->rev_id);
+  if (fields & PCI_FILL_SUBSYS)
+    fprintf(f, " subsys=%04x:%04x", d->subsys_vendor_id, d->subsys_id);
+  if (fields & PCI_FILL_IRQ)
+    fprintf(f, " irq=%d", d->irq);
+  if (fields & PCI_FILL_BASES)
+    trace_put_addrs(f, "bases", d->base_addr, 6);
+  if (fields & PCI_FILL_ROM_BASE)
+    trace_put_addrs(f, "rom", &d->rom_base_addr, 1);
+  if (fields & PCI_FILL_SIZES)
+    {
+      trace_put_addrs(f, "sizes", d->size, 6);
+      trace_put_addrs(f, "romsize", &d->rom_size, 1);
+    }
+  if (fields & PCI_FILL_IO_FLAGS)
+    {
+      trace_put_addrs(f, "ioflags", d->flags, 6);
+      trace_put_addrs(f, "romflags", &d->rom_flags, 1);
+    }
+  if (fields & PCI_FILL_BRIDGE_BASES)
+    {
+      trace_put_addrs(f, "bbases", d->bridge_base_addr, 4);
+      trace_put_addrs(f, "bsizes", d->bridge_size, 4);
+      trace_put_addrs(f, "bflags", d->bridge_flags, 4);
+    }
+  if (fields & PCI_FILL_NUMA_NODE)
+    fprintf(f, " numa=%d", d->numa_node);
+  if ((fields & PCI_FILL_PARENT) && d->parent)
+    {
+      fputs(" parent=", f);
+      trace_put_slot(f, d->parent);
+    }
+  if (fields & PCI_FILL_PHYS_SLOT)
+    trace_put_string(f, "slot", d->phy_slot);
+  if (fields & PCI_FILL_MODULE_ALIAS)
+    trace_put_string(f, "alias", d->module_alias);
+  if (fields & PCI_FILL_LABEL)
+    trace_put_string(f, "label", d->label);
+  if (fields & PCI_FILL_DT_NODE)
+    trace_put_string(f, "dtnode", pci_get_string_property(d, PCI_FILL_DT_NODE));
+  if (fields & PCI_FILL_IOMMU_GROUP)
+    trace_put_string(f, "iommu", pci_get_string_property(d, PCI_FILL_IOMMU_GROUP));
+  if (fields & PCI_FILL_DRIVER)
+    trace_put_string(f, "driver", pci_get_string_property(d, PCI_FILL_DRIVER));
+  if (fields & PCI_FILL_RCD_LNK)
+    fprintf(f, " rcd=%x,%x,%x", d->rcd_link_cap, d->rcd_link_status, d->rcd_link_ctrl);
+  if ((fields & PCI_FILL_MSI_ROUTING) && d->msi_routing)
+    {
+      struct pci_msi_routing *mr;
+      fputs(" msi=", f);
+      for (mr = d->msi_routing; mr; mr = mr->next)
+	fprintf(f, "%s%d", (mr == d->msi_routing ? "" : ","), mr->irq);
+    }
+  if ((fields & (PCI_FILL_CAPS | PCI_FILL_EXT_CAPS)) && cap)
+    {
+      fputs(" caps=", f);
+      for (; cap; cap = cap->next)
+	fprintf(f, "%x/%x/%x%s", cap->id, cap->type, cap->addr, (cap->next ? "," : ""));
+    }
+  if (d->no_config_access)
+    fputs(" noconfig=1", f);
+}
+
+/*** Recording ***/
+
+struct trace {
+  struct pci_wrapper w;			/* Must be first */
+  FILE *f;
+  struct timeval start;
+  int depth;				/* Inside the traced method */
+  unsigned long reads, internal_reads, writes, vpd_reads, fills;
+};
+
+static void trace_init(struct pci_access *a);
+
+/* We can be wrapped by another method, e.g., emul */
+static inline struct trace *
+trace_of(struct pci_methods *m)
+{
+  return (struct trace *) pci_find_wrapper(m, trace_init);
+}
+
+static void
+trace_config(struct pci_access *a)
+{
+  pci_define_param(a, "trace.file", "", "Name of the trace file to write");
+  pci_define_param(a, "trace.method", "auto", "Access method to trace");
+}
+
+static int
+trace_detect(struct pci_access *a UNUSED)
+{
+  /* Tracing must be always requested explicitly */
+  return 0;
+}
+
+static void
+trace_record(struct trace *t, int type, struct pci_dev *d)
+{
+  struct timeval now;
+  u64 us;
+
+  gettimeofday(&now, NULL);
+  us = (u64) (now.tv_sec - t->start.tv_sec) * 1000000 + now.tv_usec - t->start.tv_usec;
+  fprintf(t->f, "%c %" PCI_U64_FMT_U, (t->depth ? type - 'A' + 'a' : type), us);
+  if (d)
+    {
+      putc(' ', t->f);
+      trace_put_slot(t->f, d);
+    }
+}
+
+static void
+trace_init(struct pci_access *a)
+{
+  char *name = pci_get_param(a, "trace.file");
+  char *method = pci_get_param(a, "trace.method");
+  struct trace *t;
+  struct pci_dev *d;
+  int m = PCI_ACCESS_AUTO;
+
+  if (!name || !name[0])
+    a->error("trace: File name not given.");
+  if (method && method[0] && strcmp(method, "auto"))
+    {
+      m = pci_lookup_method(method);
+      if (m < 0 || m == PCI_ACCESS_TRACE || m == PCI_ACCESS_REPLAY)
+	a->error("trace: Cannot trace access method \"%s\".", method);
+    }
+
+  t = pci_malloc(a, sizeof(*t));
+  memset(t, 0, sizeof(*t));
+  if (!(t->f = fopen(name, "w")))
+    a->error("trace: Cannot create %s: %s", name, strerror(errno));
+  gettimeofday(&t->start, NULL);
+
+  /*
+   *  The traced method runs on the same pci_access, we only interpose
+   *  our own copy of the method table, which also holds our state.
+   */
+  a->method = m;
+  a->methods = NULL;
+  if (!pci_init_internal(a, PCI_ACCESS_TRACE))
+    a->error("trace: Cannot find any working access method.");
+  t->w.inner = a->methods;
+  t->w.methods = pm_trace;
+  if (!t->w.inner->read_vpd)
+    t->w.methods.read_vpd = NULL;
+  a->methods = &t->w.methods;
+  a->method = PCI_ACCESS_TRACE;
+
+  /* Some methods create their devices already during initialization */
+  for (d = a->devices; d; d = d->next)
+    d->methods = a->methods;
+
+  fprintf(t->f, TRACE_HEADER "\nM %s\n", t->w.inner->name);
+}
+
+static void
+trace_cleanup(struct pci_access *a)
+{
+  struct trace *t = trace_of(a->methods);
+
+  t->w.inner->cleanup(a);
+  fprintf(t->f, "# %lu reads (%lu by the library), %lu writes, %lu VPD reads, %lu fill_info calls\n",
+	  t->reads + t->internal_reads, t->internal_reads, t->writes, t->vpd_reads, t->fills);
+  if (ferror(t->f) || fclose(t->f))
+    a->warning("trace: Error writing %s", pci_get_param(a, "trace.file"));
+  a->methods = t->w.inner;
+  pci_mfree(t);
+}
+
+static void
+trace_scan(struct pci_access *a)
+{
+  struct trace *t = trace_of(a->methods);
+  struct pci_dev *d;
+  int n = 0;
+
+  t->depth++;
+  t->w.inner->scan(a);
+  t->depth--;
+
+  for (d = a->devices; d; d = d->next)
+    {
+      /* Config space cached by the back-end would hide accesses from the trace */
+      d->methods = a->methods;
+      pci_setup_cache(d, NULL, 0);
+      fputs("D ", t->f);
+      trace_put_slot(t->f, d);
+      fprintf(t->f, " %x", d->known_fields);
+      trace_put_fields(t->f, d, d->known_fields, d->first_cap);
+      putc('\n', t->f);
+      n++;
+    }
+  trace_record(t, 'S', NULL);
+  fprintf(t->f, " %d\n", n);
+}
+
+static void
+trace_fill_info(struct pci_dev *d, unsigned int flags)
+{
+  struct trace *t = trace_of(d->methods);
+  unsigned int known = d->known_fields;
+  struct pci_cap *last = d->last_cap;
+  unsigned int new;
+
+  t->depth++;
+  t->w.inner->fill_info(d, flags);
+  t->depth--;
+
+  t->fills++;
+  new = d->known_fields & ~known;
+  trace_record(t, 'F', d);
+  fprintf(t->f, " %x %x", flags, new);
+  trace_put_fields(t->f, d, new, (last ? last->next : d->first_cap));
+  putc('\n', t->f);
+}
+
+static void
+trace_access(struct trace *t, int type, struct pci_dev *d, int pos, byte *buf, int len, int ok)
+{
+  trace_record(t, type, d);
+  fprintf(t->f, " %x %x ", pos, len);
+  if (ok || type == 'W')
+    trace_put_hex(t->f, buf, len);
+  else
+    putc('-', t->f);
+  if (type == 'W')
+    fprintf(t->f, " %d", ok);
+  putc('\n', t->f);
+}
+
+static int
+trace_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct trace *t = trace_of(d->methods);
+  int ok = t->w.inner->read(d, pos, buf, len);
+
+  if (t->depth)
+    t->internal_reads++;
+  else
+    t->reads++;
+  trace_access(t, 'R', d, pos, buf, len, ok);
+  return ok;
+}
+
+static int
+trace_write(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct trace *t = trace_of(d->methods);
+  int ok = t->w.inner->write(d, pos, buf, len);
+
+  t->writes++;
+  trace_access(t, 'W', d, pos, buf, len, ok);
+  return ok;
+}
+
+static int
+trace_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  struct trace *t = trace_of(d->methods);
+  int ok = t->w.inner->read_vpd(d, pos, buf, len);
+
+  t->vpd_reads++;
+  trace_access(t, 'V', d, pos, buf, len, ok);
+  return ok;
+}
+
+static void
+trace_init_dev(struct pci_dev *d)
+{
+  struct trace *t = trace_of(d->methods);
+
+  if (t->w.inner->init_dev)
+    t->w.inner->init_dev(d);
+}
+
+static void
+trace_cleanup_dev(struct pci_dev *d)
+{
+  struct trace *t = trace_of(d->methods);
+
+  if (t->w.inner->cleanup_dev)
+    t->w.inner->cleanup_dev(d);
+}
+
+struct pci_methods pm_trace = {
+  .name = "trace",
+  .help = "Recording of accesses made through another method (set `trace.file' and `trace.method')",
+  .config = trace_config,
+  .detect = trace_detect,
+  .init = trace_init,
+  .cleanup = trace_cleanup,
+  .scan = trace_scan,
+  .fill_info = trace_fill_info,
+  .read = trace_read,
+  .write = trace_write,
+  .read_vpd = trace_read_vpd,
+  .init_dev = trace_init_dev,
+  .cleanup_dev = trace_cleanup_dev,
+};
+
+/*** Replaying ***/
+
+/*
+ *  Reads are served in the order they were recorded, separately for each
+ *  combination of position and length. When the recorded values run out,
+ *  the last one is repeated. Reads which were never recorded with the same
+ *  position and length are served from the first recorded read covering them.
+ *  Accesses made by the library itself are not replayed, because scanning
+ *  and filling of information are served from the D and F records.
+ *  Writes succeed without any effect.
+ */
+
+struct replay_access {
+  int type;				/* 'R' or 'V' */
+  int pos, len;
+  int ok;
+  unsigned int seq;
+  unsigned int used;			/* In the first access of each group: number of accesses served */
+  byte *data;
+};
+
+struct replay_dev {
+  struct replay_dev *next, *hash_next;
+  struct pci_dev shadow;		/* Values of all fields ever recorded */
+  unsigned int scan_fields;		/* Fields known after the scan */
+  unsigned int groups[32];		/* Sets of fields filled together by the back-end */
+  int num_groups;
+  int scanned;				/* Device was found by the scan */
+  struct replay_access *acc;
+  int num_acc, max_acc;
+};
+
+#define REPLAY_HASH_SIZE 1024
+
+struct replay {
+  struct replay_dev *first, **last;
+  struct replay_dev *hash[REPLAY_HASH_SIZE];
+  unsigned int seq;
+  char *line;
+  int line_size;
+};
+
+static void
+replay_config(struct pci_access *a)
+{
+  pci_define_param(a, "replay.file", "", "Name of the trace file to replay");
+}
+
+static int
+replay_detect(struct pci_access *a)
+{
+  char *name = pci_get_param(a, "replay.file");
+  return name && name[0];
+}
+
+static unsigned int
+replay_hash(int domain, int bus, int dev, int func)
+{
+  return ((domain * 256 + bus) * 32 + dev) * 8 + func;
+}
+
+static struct replay_dev *
+replay_find_slot(struct replay *r, int domain, int bus, int dev, int func)
+{
+  struct replay_dev *rd;
+
+  for (rd = r->hash[replay_hash(domain, bus, dev, func) % REPLAY_HASH_SIZE]; rd; rd = rd->hash_next)
+    if (rd->shadow.domain == domain && rd->shadow.bus == bus && rd->shadow.dev == dev && rd->shadow.func == func)
+      return rd;
+  return NULL;
+}
+
+static struct replay_dev *
+replay_get_slot(struct pci_access *a, int domain, int bus, int dev, int func)
+{
+  struct replay *r = a->backend_data;
+  struct replay_dev *rd = replay_find_slot(r, domain, bus, dev, func);
+  unsigned int h;
+
+  if (rd)
+    return rd;
+  rd = pci_malloc(a, sizeof(*rd));
+  memset(rd, 0, sizeof(*rd));
+  rd->shadow.access = a;
+  rd->shadow.domain = domain;
+  rd->shadow.bus = bus;
+  rd->shadow.dev = dev;
+  rd->shadow.func = func;
+  rd->shadow.numa_node = -1;
+  h = replay_hash(domain, bus, dev, func) % REPLAY_HASH_SIZE;
+  rd->hash_next = r->hash[h];
+  r->hash[h] = rd;
+  *r->last = rd;
+  r->last = &rd->next;
+  return rd;
+}
+
+static struct replay_dev *
+replay_find(struct pci_dev *d)
+{
+  if (!d->backend_data)
+    d->backend_data = replay_find_slot(d->access->backend_data, d->domain, d->bus, d->dev, d->func);
+  return d->backend_data;
+}
+
+/* Split off the next space-separated word */
+static char *
+replay_word(char **p)
+{
+  char *w = *p, *e;
+
+  while (*w == ' ')
+    w++;
+  if (!*w)
+    return NULL;
+  e = strchr(w, ' ');
+  if (e)
+    {
+      *e = 0;
+      *p = e + 1;
+    }
+  else
+    *p = w + strlen(w);
+  return w;
+}
+
+static int
+replay_parse_slot(char *s, int *domain, int *bus, int *dev, int *func)
+{
+  unsigned int dom, b, dv, f;
+  char c;
+
+  if (!s || sscanf(s, "%x:%x:%x.%x%c", &dom, &b, &dv, &f, &c) != 4)
+    return 0;
+  *domain = dom;
+  *bus = b;
+  *dev = dv;
+  *func = f;
+  return 1;
+}
+
+static struct replay_dev *
+replay_parse_dev(struct pci_access *a, char *s)
+{
+  int domain, bus, dev, func;
+
+  if (!replay_parse_slot(s, &domain, &bus, &dev, &func))
+    return NULL;
+  return replay_get_slot(a, domain, bus, dev, func);
+}
+
+static int
+replay_parse_addrs(char *s, pciaddr_t *x, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      char *end;
+      x[i] = strtoull(s, &end, 16);
+      if (end == s || *end != (i < n-1 ? ',' : 0))
+	return 0;
+      s = end + 1;
+    }
+  return 1;
+}
+
+static char *
+replay_unescape(char *s)
+{
+  char *r = s, *w = s;
+
+  while (*r)
+    if (*r == '%' && r[1] && r[2])
+      {
+	char hex[3] = { r[1], r[2], 0 };
+	*w++ = strtoul(hex, NULL, 16);
+	r += 3;
+      }
+    else
+      *w++ = *r++;
+  *w = 0;
+  return s;
+}
+
+static void
+replay_set_string(struct pci_dev *d, u32 key, char *val, char **field)
+{
+  char *s = pci_set_property(d, key, replay_unescape(val));
+  if (field)
+    *field = s;
+}
+
+/* Apply key=value pairs to the shadow device */
+static int
+replay_parse_fields(struct pci_access *a, struct replay_dev *rd, char *p, unsigned int fields)
+{
+  struct pci_dev *d = &rd->shadow;
+  char *w, *val;
+  unsigned int x, y, z;
+
+  if (fields & PCI_FILL_CAPS)
+    pci_free_caps(d);
+  while (w = replay_word(&p))
+    {
+      if (!(val = strchr(w, '=')))
+	return 0;
+      *val++ = 0;
+      if (!strcmp(w, "ident") && sscanf(val, "%x:%x", &x, &y) == 2)
+	d->vendor_id = x, d->device_id = y;
+      else if (!strcmp(w, "class") && sscanf(val, "%x", &x) == 1)
+	d->device_class = x;
+      else if (!strcmp(w, "classext") && sscanf(val, "%x:%x", &x, &y) == 2)
+	d->prog_if = x, d->rev_id = y;
+      else if (!strcmp(w, "subsys") && sscanf(val, "%x:%x", &x, &y) == 2)
+	d->subsys_vendor_id = x, d->subsys_id = y;
+      else if (!strcmp(w, "irq"))
+	d->irq = atoi(val);
+      else if (!strcmp(w, "bases") && replay_parse_addrs(val, d->base_addr, 6) ||
+	       !strcmp(w, "rom") && replay_parse_addrs(val, &d->rom_base_addr, 1) ||
+	       !strcmp(w, "sizes") && replay_parse_addrs(val, d->size, 6) ||
+	       !strcmp(w, "romsize") && replay_parse_addrs(val, &d->rom_size, 1) ||
+	       !strcmp(w, "ioflags") && replay_parse_addrs(val, d->flags, 6) ||
+	       !strcmp(w, "romflags") && replay_parse_addrs(val, &d->rom_flags, 1) ||
+	       !strcmp(w, "bbases") && replay_parse_addrs(val, d->bridge_base_addr, 4) ||
+	       !strcmp(w, "bsizes") && replay_parse_addrs(val, d->bridge_size, 4) ||
+	       !strcmp(w, "bflags") && replay_parse_addrs(val, d->bridge_flags, 4))
+	;
+      else if (!strcmp(w, "numa"))
+	d->numa_node = atoi(val);
+      else if (!strcmp(w, "parent"))
+	{
+	  struct replay_dev *parent = replay_parse_dev(a, val);
+	  if (!parent)
+	    return 0;
+	  d->parent = &parent->shadow;
+	}
+      else if (!strcmp(w, "slot"))
+	replay_set_string(d, PCI_FILL_PHYS_SLOT, val, &d->phy_slot);
+      else if (!strcmp(w, "alias"))
+	replay_set_string(d, PCI_FILL_MODULE_ALIAS, val, &d->module_alias);
+      else if (!strcmp(w, "label"))
+	replay_set_string(d, PCI_FILL_LABEL, val, &d->label);
+      else if (!strcmp(w, "dtnode"))
+	replay_set_string(d, PCI_FILL_DT_NODE, val, NULL);
+      else if (!strcmp(w, "iommu"))
+	replay_set_string(d, PCI_FILL_IOMMU_GROUP, val, NULL);
+      else if (!strcmp(w, "driver"))
+	replay_set_string(d, PCI_FILL_DRIVER, val, NULL);
+      else if (!strcmp(w, "rcd") && sscanf(val, "%x,%x,%x", &x, &y, &z) == 3)
+	d->rcd_link_cap = x, d->rcd_link_status = y, d->rcd_link_ctrl = z;
+      else if (!strcmp(w, "msi"))
+	{
+	  struct pci_msi_routing **last = &d->msi_routing;
+	  char *c;
+	  while (*last)
+	    {
+	      struct pci_msi_routing *mr = *last;
+	      *last = mr->next;
+	      pci_mfree(mr);
+	    }
+	  for (c = strtok(val, ","); c; c = strtok(NULL, ","))
+	    {
+	      struct pci_msi_routing *mr = pci_malloc(a, sizeof(*mr));
+	      mr->irq = atoi(c);
+	      mr->next = NULL;
+	      *last = mr;
+	      last = &mr->next;
+	    }
+	}
+      else if (!strcmp(w, "caps"))
+	{
+	  char *c;
+	  for (c = strtok(val, ","); c; c = strtok(NULL, ","))
+	    {
+	      if (sscanf(c, "%x/%x/%x", &x, &y, &z) != 3)
+		return 0;
+	      pci_add_cap(d, z, x, y);
+	    }
+	}
+      else if (!strcmp(w, "noconfig"))
+	d->no_config_access = atoi(val);
+      else
+	return 0;
+    }
+  d->known_fields |= fields;
+  return 1;
+}
+
+static void
+replay_add_group(struct replay_dev *rd, unsigned int fields)
+{
+  int i;
+
+  if (!fields)
+    return;
+  for (i = 0; i < rd->num_groups; i++)
+    if (rd->groups[i] == fields)
+      return;
+  if (rd->num_groups < (int) (sizeof(rd->groups) / sizeof(rd->groups[0])))
+    rd->groups[rd->num_groups++] = fields;
+  else
+    rd->groups[rd->num_groups-1] |= fields;
+}
+
+static int
+replay_parse_access(struct pci_access *a, struct replay_dev *rd, int type, char *p)
+{
+  struct replay *r = a->backend_data;
+  struct replay_access *ra;
+  char *w, *data, *end;
+  int i;
+
+  if (rd->num_acc >= rd->max_acc)
+    {
+      struct replay_access *acc;
+      rd->max_acc = rd->max_acc ? 2 * rd->max_acc : 16;
+      acc = pci_malloc(a, rd->max_acc * sizeof(*acc));
+      if (rd->num_acc)
+	memcpy(acc, rd->acc, rd->num_acc * sizeof(*acc));
+      pci_mfree(rd->acc);
+      rd->acc = acc;
+    }
+  ra = &rd->acc[rd->num_acc];
+  ra->type = type;
+  ra->seq = r->seq++;
+  ra->used = 0;
+  if (!(w = replay_word(&p)))
+    return 0;
+  ra->pos = strtoul(w, &end, 16);
+  if (*end || !(w = replay_word(&p)))
+    return 0;
+  ra->len = strtoul(w, &end, 16);
+  if (*end || ra->pos < 0 || ra->len <= 0 || ra->len > 0x10000 || !(data = replay_word(&p)))
+    return 0;
+  ra->ok = strcmp(data, "-");
+  ra->data = NULL;
+  if (ra->ok)
+    {
+      if ((int) strlen(data) != 2 * ra->len)
+	return 0;
+      ra->data = pci_malloc(a, ra->len);
+      for (i = 0; i < ra->len; i++)
+	{
+	  char hex[3] = { data[2*i], data[2*i+1], 0 };
+	  ra->data[i] = strtoul(hex, &end, 16);
+	  if (*end)
+	    return 0;
+	}
+    }
+  rd->num_acc++;
+  return 1;
+}
+
+static int
+replay_cmp_access(const void *A, const void *B)
+{
+  const struct replay_access *a = A, *b = B;
+
+  if (a->type != b->type)
+    return (a->type < b->type) ? -1 : 1;
+  if (a->pos != b->pos)
+    return (a->pos < b->pos) ? -1 : 1;
+  if (a->len != b->len)
+    return (a->len < b->len) ? -1 : 1;
+  return (a->seq < b->seq) ? -1 : (a->seq > b->seq) ? 1 : 0;
+}
+
+/* Read a line of arbitrary length, strip the trailing newline */
+static int
+replay_getline(struct pci_access *a, struct replay *r, FILE *f)
+{
+  int len = 0;
+  char *l;
+
+  if (!r->line)
+    {
+      r->line_size = 1024;
+      r->line = pci_malloc(a, r->line_size);
+    }
+  for (;;)
+    {
+      if (!fgets(r->line + len, r->line_size - len, f))
+	return len > 0;
+      len += strlen(r->line + len);
+      if (len && r->line[len-1] == '\n')
+	{
+	  r->line[--len] = 0;
+	  return 1;
+	}
+      if (len < r->line_size - 1)
+	return 1;
+      l = pci_malloc(a, 2 * r->line_size);
+      memcpy(l, r->line, len + 1);
+      pci_mfree(r->line);
+      r->line = l;
+      r->line_size *= 2;
+    }
+}
+
+static void
+replay_init(struct pci_access *a)
+{
+  char *name = pci_get_param(a, "replay.file");
+  struct replay *r;
+  struct replay_dev *rd;
+  FILE *f;
+  int lino = 0;
+
+  if (!name || !name[0])
+    a->error("replay: File name not given.");
+  if (!(f = fopen(name, "r")))
+    a->error("replay: Cannot open %s: %s", name, strerror(errno));
+
+  r = pci_malloc(a, sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  r->last = &r->first;
+  a->backend_data = r;
+
+  while (replay_getline(a, r, f))
+    {
+      char *p = r->line + 1, *w;
+      unsigned int fields;
+      int ok = 0;
+
+      lino++;
+      if (lino == 1 && strncmp(r->line, TRACE_HEADER, strlen(TRACE_HEADER)))
+	a->error("replay: %s is not a libpci trace", name);
+      switch (r->line[0])
+	{
+	case '#':
+	case 'M':
+	case 'S':
+	case 'W':
+	case 'r': case 'w': case 'v': case 'f': case 's':
+	  /* Nothing to replay */
+	  ok = 1;
+	  break;
+	case 'D':
+	  if ((rd = replay_parse_dev(a, replay_word(&p))) && (w = replay_word(&p)))
+	    {
+	      fields = strtoul(w, NULL, 16);
+	      rd->scanned = 1;
+	      rd->scan_fields = fields;
+	      ok = replay_parse_fields(a, rd, p, fields);
+	    }
+	  break;
+	case 'F':
+	  if (replay_word(&p) && (rd = replay_parse_dev(a, replay_word(&p))) &&
+	      replay_word(&p) && (w = replay_word(&p)))
+	    {
+	      fields = strtoul(w, NULL, 16);
+	      ok = replay_parse_fields(a, rd, p, fields);
+	      replay_add_group(rd, fields);
+	    }
+	  break;
+	case 'R':
+	case 'V':
+	  if (replay_word(&p) && (rd = replay_parse_dev(a, replay_word(&p))))
+	    ok = replay_parse_access(a, rd, r->line[0], p);
+	  break;
+	}
+      if (!ok)
+	a->error("replay: %s:%d: Malformed record", name, lino);
+    }
+  if (ferror(f))
+    a->error("replay: Error reading %s", name);
+  fclose(f);
+
+  for (rd = r->first; rd; rd = rd->next)
+    if (rd->num_acc)
+      qsort(rd->acc, rd->num_acc, sizeof(*rd->acc), replay_cmp_access);
+}
+
+static void
+replay_cleanup(struct pci_access *a)
+{
+  struct replay *r = a->backend_data;
+  struct replay_dev *rd, *next;
+  struct pci_property *p;
+  int i;
+
+  if (!r)
+    return;
+  for (rd = r->first; rd; rd = next)
+    {
+      next = rd->next;
+      for (i = 0; i < rd->num_acc; i++)
+	pci_mfree(rd->acc[i].data);
+      pci_mfree(rd->acc);
+      pci_free_caps(&rd->shadow);
+      while (p = rd->shadow.properties)
+	{
+	  rd->shadow.properties = p->next;
+	  pci_mfree(p);
+	}
+      while (rd->shadow.msi_routing)
+	{
+	  struct pci_msi_routing *mr = rd->shadow.msi_routing;
+	  rd->shadow.msi_routing = mr->next;
+	  pci_mfree(mr);
+	}
+      pci_mfree(rd);
+    }
+  pci_mfree(r->line);
+  pci_mfree(r);
+  a->backend_data = NULL;
+}
+
+static void
+replay_copy_string(struct pci_dev *d, struct pci_dev *s, u32 key, char **field)
+{
+  char *val = pci_get_string_property(s, key);
+
+  if (val)
+    {
+      val = pci_set_property(d, key, val);
+      if (field)
+	*field = val;
+    }
+}
+
+/* Copy the given fields from the shadow device */
+static void
+replay_copy_fields(struct pci_dev *d, struct pci_dev *s, unsigned int fields)
+{
+  struct pci_cap *cap;
+
+  if (fields & PCI_FILL_IDENT)
+    {
+      d->vendor_id = s->vendor_id;
+      d->device_id = s->device_id;
+    }
+  if (fields & PCI_FILL_CLASS)
+    d->device_class = s->device_class;
+  if (fields & PCI_FILL_CLASS_EXT)
+    {
+      d->prog_if = s->prog_if;
+      d->rev_id = s->rev_id;
+    }
+  if (fields & PCI_FILL_SUBSYS)
+    {
+      d->subsys_vendor_id = s->subsys_vendor_id;
+      d->subsys_id = s->subsys_id;
+    }
+  if (fields & PCI_FILL_IRQ)
+    d->irq = s->irq;
+  if (fields & PCI_FILL_BASES)
+    memcpy(d->base_addr, s->base_addr, sizeof(d->base_addr));
+  if (fields & PCI_FILL_ROM_BASE)
+    d->rom_base_addr = s->rom_base_addr;
+  if (fields & PCI_FILL_SIZES)
+    {
+      memcpy(d->size, s->size, sizeof(d->size));
+      d->rom_size = s->rom_size;
+    }
+  if (fields & PCI_FILL_IO_FLAGS)
+    {
+      memcpy(d->flags, s->flags, sizeof(d->flags));
+      d->rom_flags = s->rom_flags;
+    }
+  if (fields & PCI_FILL_BRIDGE_BASES)
+    {
+      memcpy(d->bridge_base_addr, s->bridge_base_addr, sizeof(d->bridge_base_addr));
+      memcpy(d->bridge_size, s->bridge_size, sizeof(d->bridge_size));
+      memcpy(d->bridge_flags, s->bridge_flags, sizeof(d->bridge_flags));
+    }
+  if (fields & PCI_FILL_NUMA_NODE)
+    d->numa_node = s->numa_node;
+  if ((fields & PCI_FILL_PARENT) && s->parent)
+    {
+      struct pci_dev *p;
+      for (p = d->access->devices; p; p = p->next)
+	if (p->domain == s->parent->domain && p->bus == s->parent->bus &&
+	    p->dev == s->parent->dev && p->func == s->parent->func)
+	  d->parent = p;
+    }
+  if (fields & PCI_FILL_PHYS_SLOT)
+    replay_copy_string(d, s, PCI_FILL_PHYS_SLOT, &d->phy_slot);
+  if (fields & PCI_FILL_MODULE_ALIAS)
+    replay_copy_string(d, s, PCI_FILL_MODULE_ALIAS, &d->module_alias);
+  if (fields & PCI_FILL_LABEL)
+    replay_copy_string(d, s, PCI_FILL_LABEL, &d->label);
+  if (fields & PCI_FILL_DT_NODE)
+    replay_copy_string(d, s, PCI_FILL_DT_NODE, NULL);
+  if (fields & PCI_FILL_IOMMU_GROUP)
+    replay_copy_string(d, s, PCI_FILL_IOMMU_GROUP, NULL);
+  if (fields & PCI_FILL_DRIVER)
+    replay_copy_string(d, s, PCI_FILL_DRIVER, NULL);
+  if (fields & PCI_FILL_RCD_LNK)
+    {
+      d->rcd_link_cap = s->rcd_link_cap;
+      d->rcd_link_status = s->rcd_link_status;
+      d->rcd_link_ctrl = s->rcd_link_ctrl;
+    }
+  if (fields & PCI_FILL_MSI_ROUTING)
+    {
+      struct pci_msi_routing *mr, **last = &d->msi_routing;
+      while (*last)
+	last = &(*last)->next;
+      for (mr = s->msi_routing; mr; mr = mr->next)
+	{
+	  struct pci_msi_routing *n = pci_malloc(d->access, sizeof(*n));
+	  n->irq = mr->irq;
+	  n->next = NULL;
+	  *last = n;
+	  last = &n->next;
+	}
+    }
+  for (cap = s->first_cap; cap; cap = cap->next)
+    if (cap->type == PCI_CAP_NORMAL && (fields & PCI_FILL_CAPS) ||
+	cap->type == PCI_CAP_EXTENDED && (fields & PCI_FILL_EXT_CAPS))
+      pci_add_cap(d, cap->addr, cap->id, cap->type);
+  d->no_config_access = s->no_config_access;
+  d->known_fields |= fields;
+}
+
+static void
+replay_scan(struct pci_access *a)
+{
+  struct replay *r = a->backend_data;
+  struct replay_dev *rd;
+  struct pci_dev **devs, *d;
+  int n = 0, i;
+
+  for (rd = r->first; rd; rd = rd->next)
+    n += rd->scanned;
+  devs = pci_malloc(a, (n + 1) * sizeof(*devs));
+
+  /* Devices are prepended to the list, so link them in reverse order of the trace */
+  n = 0;
+  for (rd = r->first; rd; rd = rd->next)
+    if (rd->scanned)
+      {
+	d = devs[n++] = pci_get_dev(a, rd->shadow.domain, rd->shadow.bus, rd->shadow.dev, rd->shadow.func);
+	d->backend_data = rd;
+      }
+  for (i = n-1; i >= 0; i--)
+    pci_link_dev(a, devs[i]);
+  for (i = 0; i < n; i++)
+    {
+      rd = devs[i]->backend_data;
+      replay_copy_fields(devs[i], &rd->shadow, rd->scan_fields);
+    }
+  pci_mfree(devs);
+}
+
+static void
+replay_fill_info(struct pci_dev *d, unsigned int flags)
+{
+  struct replay_dev *rd = replay_find(d);
+  unsigned int want = flags & ~d->known_fields;
+  unsigned int copy;
+  int i;
+
+  if (want & PCI_FILL_EXT_CAPS)
+    want |= PCI_FILL_CAPS & ~d->known_fields;
+  if (rd)
+    {
+      /* Fields the back-end filled together are copied together, too */
+      copy = want & rd->shadow.known_fields;
+      for (i = 0; i < rd->num_groups; i++)
+	if (rd->groups[i] & copy)
+	  copy |= rd->groups[i];
+      replay_copy_fields(d, &rd->shadow, copy & rd->shadow.known_fields & ~d->known_fields);
+      want &= ~rd->shadow.known_fields;
+    }
+
+  /* Fields which were never recorded are derived from the recorded config space */
+  if (want)
+    pci_generic_fill_info(d, want);
+}
+
+static struct replay_access *
+replay_lookup(struct replay_dev *rd, int type, int pos, int len)
+{
+  struct replay_access key = { .type = type, .pos = pos, .len = len, .seq = 0 };
+  struct replay_access *g;
+  int lo = 0, hi = rd->num_acc;
+
+  /* Find the first access of the group */
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (replay_cmp_access(&rd->acc[mid], &key) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo < rd->num_acc)
+    {
+      g = &rd->acc[lo];
+      if (g->type == type && g->pos == pos && g->len == len)
+	{
+	  unsigned int i = lo + g->used;
+	  if (i < (unsigned int) rd->num_acc && rd->acc[i].type == type && rd->acc[i].pos == pos && rd->acc[i].len == len)
+	    g->used++;
+	  else
+	    i--;
+	  return &rd->acc[i];
+	}
+    }
+  return NULL;
+}
+
+static int
+replay_access(struct pci_dev *d, int type, int pos, byte *buf, int len)
+{
+  struct replay_dev *rd = replay_find(d);
+  struct replay_access *ra;
+  int i;
+
+  if (!rd)
+    return 0;
+  if (ra = replay_lookup(rd, type, pos, len))
+    {
+      if (!ra->ok)
+	return 0;
+      memcpy(buf, ra->data, len);
+      return 1;
+    }
+
+  for (i = 0; i < rd->num_acc; i++)
+    {
+      ra = &rd->acc[i];
+      if (ra->type == type && ra->ok && ra->pos <= pos && pos + len <= ra->pos + ra->len)
+	{
+	  memcpy(buf, ra->data + pos - ra->pos, len);
+	  return 1;
+	}
+    }
+  return 0;
+}
+
+static int
+replay_read(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  return replay_access(d, 'R', pos, buf, len);
+}
+
+static int
+replay_read_vpd(struct pci_dev *d, int pos, byte *buf, int len)
+{
+  return replay_access(d, 'V', pos, buf, len);
+}
+
+static int
+replay_write(struct pci_dev *d UNUSED, int pos UNUSED, byte *buf UNUSED, int len UNUSED)
+{
+  return 1;
+}
+
+static void
+replay_cleanup_dev(struct pci_dev *d)
+{
+  d->backend_data = NULL;
+}
+
+struct pci_methods pm_replay = {
+  .name = "replay",
+  .help = "Replaying of traces recorded by the `trace' method (set the `replay.file' parameter)",
+  .config = replay_config,
+  .detect = replay_detect,
+  .init = replay_init,
+  .cleanup = replay_cleanup,
+  .scan = replay_scan,
+  .fill_info = replay_fill_info,
+  .read = replay_read,
+  .write = replay_write,
+  .read_vpd = replay_read_vpd,
+  .cleanup_dev = replay_cleanup_dev,
+};
@@ -11,12 +11,15 @@
 #ifndef _LMR_H
 #define _LMR_H
 
+#include <signal.h>
 #include <stdbool.h>
 
 #include "pciutils.h"
 
 enum margin_hw { MARGIN_HW_DEFAULT, MARGIN_ICE_LAKE_RC };
 
+#define MARGIN_CMD_TIMEOUT 100 // ms, default for margin_dev.cmd_timeout
+
 // in ps
 static const double margin_ui[] = { 62.5, 31.25, 31.25, 15.625 };
 
@@ -31,6 +34,13 @@ struct margin_dev {
 
   enum margin_hw hw;
 
+  u16 cmd_timeout; // ms to wait for Lane Status to reflect a command
+
+  /* Command handshake statistics, times in us */
+  u32 handshakes;
+  u64 handshake_time;
+  u64 handshake_max;
+
   /* Saved Device settings to restore after margining */
   u8 aspm;
   bool hasd; // Hardware Autonomous Speed Disable
@@ -103,6 +113,8 @@ struct margin_results {
   bool tim_off_reported;
   bool volt_off_reported;
 
+  bool restored; // All results were taken from the checkpoint being resumed
+
   u8 lanes_n;
   struct margin_res_lane *lanes;
 };
@@ -115,10 +127,16 @@ struct margin_com_args {
   bool run_margin;   // Or print params only
   u8 verbosity;      // 0 - basic;
                      // 1 - add info about remaining time and lanes in progress during margining
-  u64 steps_utility; // For ETA logging
+  char *status_file; // Progress status file, NULL == none
+  char *json_file;   // Streaming results in JSON Lines, NULL == none
   bool save_csv;
   char *dir_for_csv;
-  u8 dwell_time;
+  char *baseline;            // Baseline database, NULL == none
+  double baseline_threshold; // Drop of EW/EH in % reported as regression
+  u32 dwell_time;   // ms
+  u8 step_accuracy; // 0 == walk all steps, otherwise search adaptively
+  u16 cmd_timeout;  // ms
+  u8 concurrent_links; // Links of one Switch/Root Complex margined at once; 0, 1 == one by one
 };
 
 struct margin_recv_args {
@@ -134,7 +152,7 @@ struct margin_link_args {
   struct margin_com_args *common;
   u8 steps_t;        // 0 == use NumTimingSteps
   u8 steps_v;        // 0 == use NumVoltageSteps
-  u8 parallel_lanes; // [1; MaxLanes + 1]
+  u8 parallel_lanes; // [1; MaxLanes + 1], 0 == MaxLanes + 1
   u8 recvs[6];       // Receivers Numbers
   u8 recvs_n;        // 0 == margin all available receivers
   struct margin_recv_args recv_args[6];
@@ -142,6 +160,12 @@ struct margin_link_args {
   u8 lanes_n;   // 0 == margin all available lanes
 };
 
+/* Downstream and Upstream Ports of a Link */
+struct margin_pair {
+  struct pci_dev *down;
+  struct pci_dev *up;
+};
+
 struct margin_link {
   struct margin_dev down_port;
   struct margin_dev up_port;
@@ -157,7 +181,38 @@ struct margin_recv {
 
   u8 parallel_lanes;
   u8 error_limit;
-  u8 dwell_time;
+  u32 dwell_time; // ms
+  u8 step_accuracy;
+};
+
+/* Margining of one lane in one direction */
+struct margin_lane_job {
+  u8 lane; // Index to lanes_numbers and results
+  enum margin_dir dir;
+  bool timing;
+  u8 steps_total;
+  u8 stride; // Steps to ascend by until the lane fails
+
+  u8 pass;  // Last passing step
+  u16 fail; // First failing step, steps_total + 1 if none yet
+  enum margin_step_exec_sts fail_sts;
+
+  u8 probe; // Step being probed now
+  u8 steps_done;
+  bool started, finished;
+  bool prepared; // Error limit set on the lane
+};
+
+/* Progress of margining of one Receiver, see margin_progress */
+struct margin_progress {
+  struct pci_dev *dev;
+  u8 recvn;
+  u64 plan;       // Rounds (dwells of all lanes margined at once) planned
+  u64 rounds;     // Rounds done
+  u64 left;       // Rounds estimated to be left
+  u64 start;      // us
+  u64 round_time; // us
+  struct margin_progress *next; // In the list of Receivers being margined
 };
 
 struct margin_lanes_data {
@@ -167,12 +222,17 @@ struct margin_lanes_data {
   u8 *lanes_numbers;
   u8 lanes_n;
 
-  bool ind;
-  enum margin_dir dir;
+  bool ind_tim;  // Independent Left/Right Timing Margining
+  bool ind_volt; // Independent Up/Down Voltage Margining
+
+  struct margin_lane_job *jobs;
+  u8 jobs_n;
+  u8 jobs_done;
+  struct margin_lane_job **slots; // Jobs in progress, NULL == free slot
+  u8 slots_n;
 
-  u8 steps_lane_done;
-  u8 steps_lane_total;
-  u64 *steps_utility;
+  u64 steps_left; // Steps planned for the rest of the Receiver
+  struct margin_progress *progress;
 
   u8 verbosity;
 };
@@ -200,6 +260,10 @@ bool margin_verify_link(struct pci_dev *down_port, struct pci_dev *up_port);
 /* Check Margining Ready bit from Margining Port Status Register */
 bool margin_check_ready_bit(struct pci_dev *dev);
 
+/* Find all Links with LMR capability at both ends in a single pass over devices,
+   returns number of Links stored to the newly allocated array pairs */
+int margin_find_links(struct pci_access *pacc, struct margin_pair **pairs);
+
 /* Verify link and fill wrappers */
 bool margin_fill_link(struct pci_dev *down_port, struct pci_dev *up_port,
                       struct margin_link *wrappers);
@@ -212,18 +276,85 @@ void margin_restore_link(struct margin_link *link);
 
 /* margin */
 
-/* Fill margin_params without calling other functions */
-bool margin_read_params(struct pci_access *pacc, struct pci_dev *dev, u8 recvn,
-                        struct margin_params *params);
+/* Current time in us */
+u64 margin_time_us(void);
 
 enum margin_test_status margin_process_args(struct margin_link *link);
 
+/* Upper estimate of steps (dwells) needed to margin the Receiver, for ETA */
+u64 margin_recv_plan(struct margin_params *params, struct margin_link_args *args);
+
+/* The same before the capabilities of the Receiver are known, assuming the largest
+   values allowed by the specification */
+u64 margin_recv_plan_provisional(struct margin_link_args *args);
+
 /* Awaits that links are prepared through process_args.
    Returns number of margined Receivers through recvs_n */
 struct margin_results *margin_test_link(struct margin_link *link, u8 *recvs_n);
 
 void margin_free_results(struct margin_results *results, u8 results_n);
 
+/* margin_sched */
+
+#ifdef PCI_HAVE_PTHREADS
+/* Run margin_test_link() concurrently for links[i] with run[i] set, respecting
+   com_args->concurrent_links per Switch or Root Complex. Logs of the Links are
+   printed as a whole once each Link is done. */
+void margin_test_links_concurrently(struct pci_access *pacc, struct margin_link *links, u8 links_n,
+                                    bool *run, struct margin_results **results, u8 *results_n);
+#endif
+
+/* margin_progress */
+
+void margin_progress_start(char *status_file, u32 dwell_time);
+
+/* Register a Receiver to be margined with its plan from margin_recv_plan_provisional() */
+void margin_progress_plan(u64 provisional);
+
+/* Every registered Receiver is either started and ended or skipped, provisional is the plan
+   it was registered with. The plan is from margin_recv_plan(), left is the estimate from
+   jobs (lower if resuming from a checkpoint). */
+void margin_progress_recv_start(struct margin_progress *p, struct pci_dev *dev, u8 recvn,
+                                u64 provisional, u64 plan, u64 left);
+void margin_progress_recv_end(struct margin_progress *p, struct margin_dev *dev);
+void margin_progress_recv_skip(u64 provisional);
+
+/* A round of the Receiver took time us, left rounds are estimated to remain */
+void margin_progress_round(struct margin_progress *p, u64 left, u64 time);
+
+/* A lane finished in one direction, early if before the step threshold */
+void margin_progress_job(bool early);
+
+/* ETA of the whole session and (if recv_eta is not NULL) of the Receiver, in seconds */
+u64 margin_progress_eta(struct margin_progress *p, u64 *recv_eta);
+
+/* Final update of the status file, state is "done" or "interrupted" */
+void margin_progress_finish(char *state);
+
+/* margin_checkpoint */
+
+/* Set by SIGINT, SIGTERM or SIGHUP once margin_catch_signals() was called.
+   Margining stops at the next step and the Links are restored. */
+extern volatile sig_atomic_t margin_interrupted;
+
+void margin_catch_signals(void);
+
+/* Start a new checkpoint, saving the command line; when resuming, append to the
+   loaded one instead */
+void margin_checkpoint_open(char *name, int argc, char **argv);
+
+/* Load finished lanes and replace argc/argv by the saved command line */
+void margin_checkpoint_load(char *name, int *argc, char ***argv);
+
+bool margin_checkpoint_find(struct pci_dev *dev, u8 recvn, u8 lane, enum margin_dir dir, u8 *steps,
+                            enum margin_step_exec_sts *status);
+void margin_checkpoint_lane(struct pci_dev *dev, u8 recvn, u8 lane, enum margin_dir dir, u8 steps,
+                            enum margin_step_exec_sts status);
+
+/* NULL if no checkpoint is written */
+char *margin_checkpoint_name(void);
+void margin_checkpoint_close(void);
+
 /* margin_log */
 
 extern bool margin_global_logging;
@@ -231,6 +362,15 @@ extern bool margin_print_domain;
 
 void margin_log(char *format, ...);
 
+/* Log is being collected in memory instead of printing */
+bool margin_log_captured(void);
+
+#ifdef PCI_HAVE_PTHREADS
+/* Collect the log of the current thread in memory until capture_end returns it */
+void margin_log_capture_start(void);
+char *margin_log_capture_end(void);
+#endif
+
 /* b:d.f -> b:d.f */
 void margin_log_bdfs(struct pci_dev *down_port, struct pci_dev *up_port);
 void margin_gen_bdfs(struct pci_dev *down_port, struct pci_dev *up_port, char *dest, size_t maxlen);
@@ -251,6 +391,9 @@ void margin_log_margining(struct margin_lanes_data arg);
 
 void margin_log_hw_quirks(struct margin_recv *recv);
 
+/* Time spent waiting for the Receiver to acknowledge commands */
+void margin_log_handshakes(struct margin_dev *dev);
+
 /* margin_results */
 
 // Min values are taken from PCIe Base Spec Rev. 5.0 Section 8.4.2.
@@ -269,4 +412,23 @@ void margin_results_print_brief(struct margin_results *results, u8 recvs_n,
 
 void margin_results_save_csv(struct margin_results *results, u8 recvs_n, struct margin_link *link);
 
+/* Eye width (in ps) and height (in mV) of the lane, calculated as for grading */
+void margin_results_eye(struct margin_results *res, struct margin_res_lane *lane,
+                        struct margin_recv_args *grade_args, double *ew, double *eh);
+
+/* Streaming results in JSON Lines, one record per lane */
+void margin_results_json_open(char *name);
+void margin_results_json_close(void);
+
+/* Write records of a finished Receiver (or of a Receiver or Link which could not be margined,
+   recvn == 0 for the whole Link) and flush them. Safe to call from margining threads. */
+void margin_results_json(struct margin_link *link, struct margin_results *res);
+
+/* margin_baseline */
+
+/* Compare results with their baselines in the database, print regressions and
+   append the results to the database. Returns the number of regressed lanes. */
+int margin_baseline_check(char *name, double threshold, struct margin_link *links,
+                          struct margin_results **results, u8 *results_n, u8 links_n);
+
 #endif
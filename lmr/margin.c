@@ -10,7 +10,9 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include "lmr.h"
 
@@ -83,39 +85,56 @@ typedef u16 margin_cmd;
 #define SET_ERROR_LIMIT(error_limit, recvn) margin_make_cmd(0xC0 | (error_limit), 2, recvn)
 
 static int
-msleep(long msec)
+margin_usleep(long usec)
 {
 #if defined(PCI_OS_WINDOWS)
-  Sleep(msec);
+  Sleep((usec + 999) / 1000);
   return 0;
 #elif defined(PCI_OS_DJGPP)
-  if (msec * 1000 < 11264)
+  if (usec < 11264)
     usleep(11264);
   else
-    usleep(msec * 1000);
+    usleep(usec);
   return 0;
 #else
   struct timespec ts;
   int res;
 
-  if (msec < 0)
+  if (usec < 0)
     {
       errno = EINVAL;
       return -1;
     }
 
-  ts.tv_sec = msec / 1000;
-  ts.tv_nsec = (msec % 1000) * 1000000;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
 
   do
     {
       res = nanosleep(&ts, &ts);
-  } while (res && errno == EINTR);
+  } while (res && errno == EINTR && !margin_interrupted);
 
   return res;
 #endif
 }
 
+u64
+margin_time_us(void)
+{
+#if defined(PCI_OS_WINDOWS)
+  return (u64) GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+  /* Not affected by changes of the system time, unlike gettimeofday() */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (u64) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 static margin_cmd
 margin_make_cmd(u8 payload, u8 type, u8 recvn)
 {
@@ -123,22 +142,54 @@ margin_make_cmd(u8 payload, u8 type, u8 recvn)
          | SET_REG_MASK(0, LMR_CMD_RECVN, recvn);
 }
 
+/* Poll Lane Status until it reflects cmd (the whole command or only its type and
+   Receiver Number for Report commands) or dev->cmd_timeout expires. Backs off
+   from 20 us to 1 ms between reads, so that fast Receivers are not slowed down
+   while slow ones are not flooded with Configuration Requests. */
+static bool
+margin_wait_status(struct margin_dev *dev, u8 lane, margin_cmd cmd, bool whole, margin_cmd *status)
+{
+  u64 start = margin_time_us();
+  u64 deadline = start + dev->cmd_timeout * 1000;
+  long delay = 20;
+  bool done;
+
+  while (1)
+    {
+      *status = pci_read_word(dev->dev, LMR_LANE_STATUS(dev->lmr_cap_addr, lane));
+      if (whole)
+        done = *status == cmd;
+      else
+        done = GET_REG_MASK(*status, LMR_CMD_TYPE) == GET_REG_MASK(cmd, LMR_CMD_TYPE)
+               && GET_REG_MASK(*status, LMR_CMD_RECVN) == GET_REG_MASK(cmd, LMR_CMD_RECVN);
+      u64 now = margin_time_us();
+      if (done || now >= deadline)
+        {
+          dev->handshakes++;
+          dev->handshake_time += now - start;
+          if (now - start > dev->handshake_max)
+            dev->handshake_max = now - start;
+          return done;
+        }
+      margin_usleep(delay);
+      if (delay < 1000)
+        delay *= 2;
+    }
+}
+
 static bool
 margin_set_cmd(struct margin_dev *dev, u8 lane, margin_cmd cmd)
 {
+  margin_cmd status;
   pci_write_word(dev->dev, LMR_LANE_CTRL(dev->lmr_cap_addr, lane), cmd);
-  msleep(10);
-  return pci_read_word(dev->dev, LMR_LANE_STATUS(dev->lmr_cap_addr, lane)) == cmd;
+  return margin_wait_status(dev, lane, cmd, true, &status);
 }
 
 static bool
 margin_report_cmd(struct margin_dev *dev, u8 lane, margin_cmd cmd, margin_cmd *result)
 {
   pci_write_word(dev->dev, LMR_LANE_CTRL(dev->lmr_cap_addr, lane), cmd);
-  msleep(10);
-  *result = pci_read_word(dev->dev, LMR_LANE_STATUS(dev->lmr_cap_addr, lane));
-  return GET_REG_MASK(*result, LMR_CMD_TYPE) == GET_REG_MASK(cmd, LMR_CMD_TYPE)
-         && GET_REG_MASK(*result, LMR_CMD_RECVN) == GET_REG_MASK(cmd, LMR_CMD_RECVN)
+  return margin_wait_status(dev, lane, cmd, false, result)
          && margin_set_cmd(dev, lane, NO_COMMAND);
 }
 
@@ -224,94 +275,292 @@ read_params_internal(struct margin_dev *dev, u8 recvn, bool lane_reversal,
   return status;
 }
 
-/* Margin all lanes_n lanes simultaneously */
 static void
-margin_test_lanes(struct margin_lanes_data arg)
+margin_lane_prepare(struct margin_recv *recv, u8 lane)
+{
+  margin_set_cmd(recv->dev, lane, NO_COMMAND);
+  margin_set_cmd(recv->dev, lane, SET_ERROR_LIMIT(recv->error_limit, recv->recvn));
+  margin_set_cmd(recv->dev, lane, NO_COMMAND);
+}
+
+static void
+margin_lane_restore(struct margin_recv *recv, u8 lane)
+{
+  margin_set_cmd(recv->dev, lane, NO_COMMAND);
+  margin_set_cmd(recv->dev, lane, CLEAR_ERROR_LOG(recv->recvn));
+  margin_set_cmd(recv->dev, lane, NO_COMMAND);
+  margin_set_cmd(recv->dev, lane, GO_TO_NORMAL_SETTINGS(recv->recvn));
+  margin_set_cmd(recv->dev, lane, NO_COMMAND);
+}
+
+/* Directions in which the Receiver can be margined, in the order of margining */
+static u8
+margin_recv_dirs(struct margin_params *params, enum margin_dir *dirs)
 {
-  u8 steps_done = 0;
-  margin_cmd lane_status;
-  u8 marg_type;
-  margin_cmd step_cmd;
-  bool timing = (arg.dir == TIM_LEFT || arg.dir == TIM_RIGHT);
+  u8 n = 0;
 
-  if (timing)
+  dirs[n++] = TIM_LEFT;
+  if (params->ind_left_right_tim)
+    dirs[n++] = TIM_RIGHT;
+  if (params->volt_support)
     {
-      marg_type = 3;
-      step_cmd = MARG_TIM(arg.dir == TIM_LEFT, steps_done, arg.recv->recvn);
+      dirs[n++] = VOLT_UP;
+      if (params->ind_up_down_volt)
+        dirs[n++] = VOLT_DOWN;
     }
-  else
+  return n;
+}
+
+static u8
+margin_job_stride(u8 steps_total, u8 accuracy)
+{
+  u8 stride = (steps_total + 7) / 8;
+
+  if (!accuracy)
+    return 1;
+  return stride < accuracy ? accuracy : stride;
+}
+
+/* Upper estimate of the number of steps (dwells) needed by one job */
+static u8
+margin_job_steps(u8 steps_total, u8 accuracy)
+{
+  if (!accuracy)
+    return steps_total;
+
+  u8 stride = margin_job_stride(steps_total, accuracy);
+  u8 steps = (steps_total + stride - 1) / stride;
+  for (u8 width = stride; width > accuracy; width = (width + 1) / 2)
+    steps++;
+  return steps;
+}
+
+u64
+margin_recv_plan(struct margin_params *params, struct margin_link_args *args)
+{
+  u8 steps_t = args->steps_t ? args->steps_t : params->timing_steps;
+  u8 steps_v = args->steps_v ? args->steps_v : params->volt_steps;
+  u8 accuracy = args->common->step_accuracy;
+  u8 slots = args->parallel_lanes ? args->parallel_lanes : params->max_lanes + 1;
+  enum margin_dir dirs[4];
+  u8 dirs_n = margin_recv_dirs(params, dirs);
+  u64 steps = 0;
+
+  if (slots > params->max_lanes + 1)
+    slots = params->max_lanes + 1;
+  if (slots > args->lanes_n)
+    slots = args->lanes_n;
+  if (!slots)
+    return 0;
+
+  for (int i = 0; i < dirs_n; i++)
+    {
+      bool timing = dirs[i] == TIM_LEFT || dirs[i] == TIM_RIGHT;
+      steps += margin_job_steps(timing ? steps_t : steps_v, accuracy);
+    }
+  steps *= args->lanes_n;
+  return (steps + slots - 1) / slots;
+}
+
+u64
+margin_recv_plan_provisional(struct margin_link_args *args)
+{
+  struct margin_params params = { .ind_left_right_tim = true,
+                                  .ind_up_down_volt = true,
+                                  .volt_support = true,
+                                  .max_lanes = 31,
+                                  .timing_steps = 63,
+                                  .volt_steps = 127 };
+
+  return margin_recv_plan(&params, args);
+}
+
+/* Next step to be probed by the job or 0 if the job is finished */
+static u8
+margin_job_next(struct margin_lane_job *job, u8 accuracy)
+{
+  if (job->fail > job->steps_total)
+    {
+      if (job->pass >= job->steps_total)
+        return 0;
+      return job->pass + job->stride < job->steps_total ? job->pass + job->stride :
+                                                          job->steps_total;
+    }
+  if (job->fail - job->pass > (accuracy ? accuracy : 1))
+    return (job->pass + job->fail) / 2;
+  return 0;
+}
+
+/* Pending job whose lane is not being margined */
+static struct margin_lane_job *
+margin_job_pick(struct margin_lanes_data *arg)
+{
+  for (int i = 0; i < arg->jobs_n; i++)
     {
-      marg_type = 4;
-      step_cmd = MARG_VOLT(arg.dir == VOLT_DOWN, steps_done, arg.recv->recvn);
+      struct margin_lane_job *job = &arg->jobs[i];
+      bool busy = false;
+
+      if (job->started)
+        continue;
+      for (int s = 0; s < arg->slots_n; s++)
+        busy |= arg->slots[s] && arg->slots[s]->lane == job->lane;
+      if (!busy)
+        return job;
     }
+  return NULL;
+}
 
-  bool failed_lanes[32] = { 0 };
-  u8 alive_lanes = arg.lanes_n;
+static void
+margin_job_finish(struct margin_lanes_data *arg, struct margin_lane_job *job)
+{
+  struct margin_res_lane *res = &arg->results[job->lane];
+
+  if (job->prepared)
+    margin_lane_restore(arg->recv, res->lane);
+  res->steps[job->dir] = job->pass;
+  res->statuses[job->dir] = job->fail > job->steps_total ? MARGIN_THR : job->fail_sts;
+  arg->jobs_done++;
+  margin_progress_job(job->fail <= job->steps_total);
+  margin_checkpoint_lane(arg->recv->dev->dev, arg->recv->recvn, arg->lanes_numbers[job->lane],
+                         job->dir, res->steps[job->dir], res->statuses[job->dir]);
+}
 
-  for (int i = 0; i < arg.lanes_n; i++)
+/* Move each lane with a job in a slot to the offset the job probes, wait for dwell
+   time and check which lanes passed */
+static void
+margin_step_lanes(struct margin_lanes_data *arg)
+{
+  struct margin_recv *recv = arg->recv;
+
+  for (int s = 0; s < arg->slots_n; s++)
     {
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND);
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane,
-                     SET_ERROR_LIMIT(arg.recv->error_limit, arg.recv->recvn));
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND);
-      arg.results[i].steps[arg.dir] = arg.steps_lane_total;
-      arg.results[i].statuses[arg.dir] = MARGIN_THR;
+      struct margin_lane_job *job = arg->slots[s];
+      if (!job)
+        continue;
+      margin_cmd step_cmd = job->timing ? MARG_TIM(job->dir == TIM_LEFT, job->probe, recv->recvn) :
+                                          MARG_VOLT(job->dir == VOLT_DOWN, job->probe, recv->recvn);
+      int ctrl_addr = LMR_LANE_CTRL(recv->dev->lmr_cap_addr, arg->results[job->lane].lane);
+      pci_write_word(recv->dev->dev, ctrl_addr, step_cmd);
     }
+  margin_usleep(recv->dwell_time * 1000L);
 
-  while (alive_lanes > 0 && steps_done < arg.steps_lane_total)
+  for (int s = 0; s < arg->slots_n; s++)
     {
-      alive_lanes = 0;
-      steps_done++;
-      if (timing)
-        step_cmd = SET_REG_MASK(step_cmd, LMR_PLD_MARGIN_T_STEPS, steps_done);
+      struct margin_lane_job *job = arg->slots[s];
+      if (!job)
+        continue;
+      u8 lane = arg->results[job->lane].lane;
+      margin_cmd lane_status
+        = pci_read_word(recv->dev->dev, LMR_LANE_STATUS(recv->dev->lmr_cap_addr, lane));
+      u8 step_status = GET_REG_MASK(lane_status, LMR_PLD_MARGIN_STS);
+      job->steps_done++;
+      if (GET_REG_MASK(lane_status, LMR_CMD_TYPE) == (job->timing ? 3 : 4)
+          && GET_REG_MASK(lane_status, LMR_CMD_RECVN) == recv->recvn && step_status == 2
+          && GET_REG_MASK(lane_status, LMR_PLD_ERR_CNT) <= recv->error_limit
+          && margin_set_cmd(recv->dev, lane, NO_COMMAND))
+        job->pass = job->probe;
       else
-        step_cmd = SET_REG_MASK(step_cmd, LMR_PLD_MARGIN_V_STEPS, steps_done);
+        {
+          job->fail = job->probe;
+          job->fail_sts = (step_status == 3 || step_status == 1 ? MARGIN_NAK : MARGIN_LIM);
+          /* Smaller offsets may be probed again, start over from normal settings */
+          margin_lane_restore(recv, lane);
+          job->prepared = false;
+        }
+    }
+}
 
-      for (int i = 0; i < arg.lanes_n; i++)
+static void
+margin_update_eta(struct margin_lanes_data *arg)
+{
+  u64 steps = 0, done = 0, planned_done = 0;
+
+  /* Lanes usually fail long before the last step, so expect the unfinished jobs
+     to need the same share of their planned steps as the finished ones did */
+  for (int i = 0; i < arg->jobs_n; i++)
+    {
+      struct margin_lane_job *job = &arg->jobs[i];
+      if (job->finished && job->steps_done)
         {
-          if (!failed_lanes[i])
-            {
-              alive_lanes++;
-              int ctrl_addr = LMR_LANE_CTRL(arg.recv->dev->lmr_cap_addr, arg.results[i].lane);
-              pci_write_word(arg.recv->dev->dev, ctrl_addr, step_cmd);
-            }
+          done += job->steps_done;
+          planned_done += margin_job_steps(job->steps_total, arg->recv->step_accuracy);
         }
-      msleep(arg.recv->dwell_time * 1000);
+    }
+
+  for (int i = 0; i < arg->jobs_n; i++)
+    {
+      struct margin_lane_job *job = &arg->jobs[i];
+      u64 planned = margin_job_steps(job->steps_total, arg->recv->step_accuracy);
+      if (job->finished)
+        continue;
+      if (planned_done)
+        planned = (planned * done + planned_done - 1) / planned_done;
+      steps += planned > job->steps_done ? planned - job->steps_done : 1;
+    }
+  arg->steps_left = (steps + arg->slots_n - 1) / arg->slots_n;
+}
+
+/*
+ * Margin lanes in all directions. Every lane and direction pair is a job, up to
+ * slots_n jobs (on different lanes) run simultaneously. As soon as a job is
+ * finished, its slot is given to the next pending job, so no slot stays idle
+ * while the slowest lane of a group finishes.
+ *
+ * Within a job, the lane ascends from the last passing step by the stride
+ * (1 when walking all steps) until it fails. With adaptive search, the interval
+ * between the last passing and the first failing step is then bisected until it
+ * is at most step_accuracy steps wide. The last passing step is reported, so
+ * the result never overestimates the margin (provided that a lane which fails
+ * at some offset fails at all larger ones, too).
+ */
+static void
+margin_test_lanes(struct margin_lanes_data *arg)
+{
+  struct margin_recv *recv = arg->recv;
 
-      for (int i = 0; i < arg.lanes_n; i++)
+  while (arg->jobs_done < arg->jobs_n && !margin_interrupted)
+    {
+      bool any = false;
+      for (int s = 0; s < arg->slots_n; s++)
         {
-          if (!failed_lanes[i])
+          while (1)
             {
-              int status_addr = LMR_LANE_STATUS(arg.recv->dev->lmr_cap_addr, arg.results[i].lane);
-              lane_status = pci_read_word(arg.recv->dev->dev, status_addr);
-              u8 step_status = GET_REG_MASK(lane_status, LMR_PLD_MARGIN_STS);
-              if (!(GET_REG_MASK(lane_status, LMR_CMD_TYPE) == marg_type
-                    && GET_REG_MASK(lane_status, LMR_CMD_RECVN) == arg.recv->recvn
-                    && step_status == 2
-                    && GET_REG_MASK(lane_status, LMR_PLD_ERR_CNT) <= arg.recv->error_limit
-                    && margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND)))
+              struct margin_lane_job *job = arg->slots[s];
+              if (!job)
+                {
+                  if (!(job = margin_job_pick(arg)))
+                    break;
+                  job->started = true;
+                  arg->slots[s] = job;
+                }
+              job->probe = margin_job_next(job, recv->step_accuracy);
+              if (job->probe)
                 {
-                  alive_lanes--;
-                  failed_lanes[i] = true;
-                  arg.results[i].steps[arg.dir] = steps_done - 1;
-                  arg.results[i].statuses[arg.dir]
-                    = (step_status == 3 || step_status == 1 ? MARGIN_NAK : MARGIN_LIM);
+                  if (!job->prepared)
+                    margin_lane_prepare(recv, arg->results[job->lane].lane);
+                  job->prepared = true;
+                  any = true;
+                  break;
                 }
+              margin_job_finish(arg, job);
+              job->finished = true;
+              arg->slots[s] = NULL;
             }
         }
+      if (!any)
+        break;
 
-      arg.steps_lane_done = steps_done;
-      margin_log_margining(arg);
+      u64 start = margin_time_us();
+      margin_step_lanes(arg);
+      margin_update_eta(arg);
+      margin_progress_round(arg->progress, arg->steps_left, margin_time_us() - start);
+      margin_log_margining(*arg);
     }
 
-  for (int i = 0; i < arg.lanes_n; i++)
-    {
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND);
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, CLEAR_ERROR_LOG(arg.recv->recvn));
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND);
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, GO_TO_NORMAL_SETTINGS(arg.recv->recvn));
-      margin_set_cmd(arg.recv->dev, arg.results[i].lane, NO_COMMAND);
-    }
+  /* Interrupted, leave unfinished lanes at normal settings */
+  for (int s = 0; s < arg->slots_n; s++)
+    if (arg->slots[s] && arg->slots[s]->prepared)
+      margin_lane_restore(recv, arg->results[arg->slots[s]->lane].lane);
 }
 
 /* Awaits that Receiver is prepared through prep_dev function */
@@ -327,18 +576,25 @@ margin_test_receiver(struct margin_dev *dev, u8 recvn, struct margin_link_args *
                               .recvn = recvn,
                               .lane_reversal = false,
                               .params = &params,
-                              .parallel_lanes = args->parallel_lanes ? args->parallel_lanes : 1,
+                              .parallel_lanes = args->parallel_lanes,
                               .error_limit = args->common->error_limit,
-                              .dwell_time = args->common->dwell_time };
+                              .dwell_time = args->common->dwell_time,
+                              .step_accuracy = args->common->step_accuracy };
 
   results->recvn = recvn;
   results->lanes_n = lanes_n;
+  results->restored = false;
   margin_log_recvn(&recv);
 
+  dev->handshakes = 0;
+  dev->handshake_time = 0;
+  dev->handshake_max = 0;
+
   if (!margin_check_ready_bit(dev->dev))
     {
       margin_log("\nMargining Ready bit is Clear.\n");
       results->test_status = MARGIN_TEST_READY_BIT;
+      margin_progress_recv_skip(margin_recv_plan_provisional(args));
       return false;
     }
 
@@ -349,13 +605,14 @@ margin_test_receiver(struct margin_dev *dev, u8 recvn, struct margin_link_args *
         {
           margin_log("\nError during caps reading.\n");
           results->test_status = MARGIN_TEST_CAPS;
+          margin_progress_recv_skip(margin_recv_plan_provisional(args));
           return false;
         }
     }
 
   results->params = params;
 
-  if (recv.parallel_lanes > params.max_lanes + 1)
+  if (!recv.parallel_lanes || recv.parallel_lanes > params.max_lanes + 1)
     recv.parallel_lanes = params.max_lanes + 1;
   margin_apply_hw_quirks(&recv, args);
   margin_log_hw_quirks(&recv);
@@ -383,114 +640,75 @@ margin_test_receiver(struct margin_dev *dev, u8 recvn, struct margin_link_args *
     {
       if (args->common->verbosity > 0)
         margin_log("\n");
+
+      u8 steps_t = args->steps_t ? args->steps_t : params.timing_steps;
+      u8 steps_v = args->steps_v ? args->steps_v : params.volt_steps;
+      enum margin_dir dirs[4];
+      u8 dirs_n = margin_recv_dirs(&params, dirs);
+      struct margin_lane_job *jobs = xmalloc(lanes_n * dirs_n * sizeof(*jobs));
+      struct margin_lane_job *slots[32] = { 0 };
+      struct margin_progress progress;
       struct margin_lanes_data lanes_data = { .recv = &recv,
+                                              .results = results->lanes,
+                                              .lanes_numbers = lanes_to_margin,
+                                              .lanes_n = lanes_n,
+                                              .ind_tim = params.ind_left_right_tim,
+                                              .ind_volt = params.ind_up_down_volt,
+                                              .jobs = jobs,
+                                              .jobs_n = lanes_n * dirs_n,
+                                              .slots = slots,
+                                              .slots_n = recv.parallel_lanes < lanes_n ?
+                                                           recv.parallel_lanes :
+                                                           lanes_n,
                                               .verbosity = args->common->verbosity,
-                                              .steps_utility = &args->common->steps_utility };
+                                              .progress = &progress };
 
-      enum margin_dir dir[] = { TIM_LEFT, TIM_RIGHT, VOLT_UP, VOLT_DOWN };
+      for (int j = 0; j < dirs_n; j++)
+        for (int i = 0; i < lanes_n; i++)
+          {
+            struct margin_lane_job *job = &jobs[j * lanes_n + i];
+            memset(job, 0, sizeof(*job));
+            job->lane = i;
+            job->dir = dirs[j];
+            job->timing = dirs[j] == TIM_LEFT || dirs[j] == TIM_RIGHT;
+            job->steps_total = job->timing ? steps_t : steps_v;
+            job->stride = margin_job_stride(job->steps_total, recv.step_accuracy);
+            job->fail = job->steps_total + 1;
+
+            struct margin_res_lane *res = &results->lanes[i];
+            if (margin_checkpoint_find(dev->dev, recvn, lanes_to_margin[i], job->dir,
+                                       &res->steps[job->dir], &res->statuses[job->dir]))
+              {
+                job->started = job->finished = true;
+                lanes_data.jobs_done++;
+              }
+          }
 
-      u8 lanes_done = 0;
-      u8 use_lanes = 0;
-      u8 steps_t = args->steps_t ? args->steps_t : params.timing_steps;
-      u8 steps_v = args->steps_v ? args->steps_v : params.volt_steps;
+      results->restored = lanes_data.jobs_done == lanes_data.jobs_n;
+      margin_update_eta(&lanes_data);
+      margin_progress_recv_start(&progress, dev->dev, recvn, margin_recv_plan_provisional(args),
+                                 margin_recv_plan(&params, args), lanes_data.steps_left);
+      margin_test_lanes(&lanes_data);
+      margin_progress_recv_end(&progress, dev);
+      free(jobs);
 
-      while (lanes_done != lanes_n)
+      if (args->common->verbosity > 0)
         {
-          use_lanes = (lanes_done + recv.parallel_lanes > lanes_n) ? lanes_n - lanes_done :
-                                                                     recv.parallel_lanes;
-          lanes_data.lanes_numbers = lanes_to_margin + lanes_done;
-          lanes_data.lanes_n = use_lanes;
-          lanes_data.results = results->lanes + lanes_done;
-
-          for (int i = 0; i < 4; i++)
-            {
-              bool timing = dir[i] == TIM_LEFT || dir[i] == TIM_RIGHT;
-              if (!timing && !params.volt_support)
-                continue;
-              if (dir[i] == TIM_RIGHT && !params.ind_left_right_tim)
-                continue;
-              if (dir[i] == VOLT_DOWN && !params.ind_up_down_volt)
-                continue;
-
-              lanes_data.ind = timing ? params.ind_left_right_tim : params.ind_up_down_volt;
-              lanes_data.dir = dir[i];
-              lanes_data.steps_lane_total = timing ? steps_t : steps_v;
-              if (args->common->steps_utility >= lanes_data.steps_lane_total)
-                args->common->steps_utility -= lanes_data.steps_lane_total;
-              else
-                args->common->steps_utility = 0;
-              margin_test_lanes(lanes_data);
-            }
-          lanes_done += use_lanes;
+          margin_log("\n");
+          margin_log_handshakes(dev);
         }
-      if (args->common->verbosity > 0)
-        margin_log("\n");
       if (recv.lane_reversal)
         {
           for (int i = 0; i < lanes_n; i++)
             results->lanes[i].lane = lanes_to_margin[i];
         }
     }
+  else
+    margin_progress_recv_skip(margin_recv_plan_provisional(args));
 
   return true;
 }
 
-bool
-margin_read_params(struct pci_access *pacc, struct pci_dev *dev, u8 recvn,
-                   struct margin_params *params)
-{
-  struct pci_cap *cap = pci_find_cap(dev, PCI_CAP_ID_EXP, PCI_CAP_NORMAL);
-  if (!cap)
-    return false;
-
-  bool dev_down = margin_port_is_down(dev);
-
-  if (recvn == 0)
-    {
-      if (dev_down)
-        recvn = 1;
-      else
-        recvn = 6;
-    }
-
-  if (recvn > 6)
-    return false;
-  if (dev_down && recvn == 6)
-    return false;
-  if (!dev_down && recvn != 6)
-    return false;
-
-  struct pci_dev *down = NULL;
-  struct pci_dev *up = NULL;
-  struct margin_link link;
-
-  if (!margin_find_pair(pacc, dev, &down, &up))
-    return false;
-
-  if (!margin_fill_link(down, up, &link))
-    return false;
-
-  struct margin_dev *dut = (dev_down ? &link.down_port : &link.up_port);
-  if (!margin_check_ready_bit(dut->dev))
-    return false;
-
-  if (!margin_prep_link(&link))
-    return false;
-
-  bool status;
-  bool lane_reversal = false;
-  status = read_params_internal(dut, recvn, lane_reversal, params);
-  if (!status)
-    {
-      lane_reversal = true;
-      status = read_params_internal(dut, recvn, lane_reversal, params);
-    }
-
-  margin_restore_link(&link);
-
-  return status;
-}
-
 enum margin_test_status
 margin_process_args(struct margin_link *link)
 {
@@ -543,6 +761,8 @@ margin_test_link(struct margin_link *link, u8 *recvs_n)
 {
   struct margin_link_args *args = &link->args;
 
+  link->down_port.cmd_timeout = link->up_port.cmd_timeout = args->common->cmd_timeout;
+
   bool status = margin_prep_link(link);
 
   u8 receivers_n = status ? args->recvs_n : 1;
@@ -555,16 +775,23 @@ margin_test_link(struct margin_link *link, u8 *recvs_n)
   if (!status)
     {
       results[0].test_status = MARGIN_TEST_ASPM;
+      results[0].recvn = 0;
       margin_log("\nCouldn't disable ASPM on the given Link.\n");
+      margin_results_json(link, &results[0]);
+      for (int i = 0; i < args->recvs_n; i++)
+        margin_progress_recv_skip(margin_recv_plan_provisional(args));
     }
 
   if (status)
     {
       struct margin_dev *dut;
-      for (int i = 0; i < receivers_n; i++)
+      for (int i = 0; i < receivers_n && !margin_interrupted; i++)
         {
           dut = receivers[i] == 6 ? &link->up_port : &link->down_port;
           margin_test_receiver(dut, receivers[i], args, &results[i]);
+          /* Receivers restored from a checkpoint were reported by the interrupted session */
+          if (!margin_interrupted && !results[i].restored)
+            margin_results_json(link, &results[i]);
         }
 
       margin_restore_link(link);
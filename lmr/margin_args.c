@@ -17,24 +17,34 @@
 const char *usage
   = "! Utility requires preliminary preparation of the system. Refer to the pcilmr man page !\n\n"
     "Brief usage (see man for all options):\n"
-    "pcilmr [--margin] [<common options>] <link port> [<link options>] [<link port> [<link "
+    "pcilmr [<generic options>] [--margin] [<common options>] <link port> [<link options>] [<link port> [<link "
     "options>] ...]\n"
-    "pcilmr --full [<common options>]\n"
-    "pcilmr --scan\n\n"
+    "pcilmr [<generic options>] --full [<common options>]\n"
+    "pcilmr [<generic options>] --scan\n"
+    "pcilmr --resume <checkpoint>\n\n"
     "You can specify Downstream or Upstream Port of the Link.\nPort Specifier:\n"
     "<device/component>:\t[<domain>:]<bus>:<dev>.<func>\n\n"
     "Modes:\n"
     "--margin\t\tMargin selected Links\n"
     "--full\t\t\tMargin all ready for testing Links in the system (one by one)\n"
-    "--scan\t\t\tScan for Links available for margining\n\n"
+    "--scan\t\t\tScan for Links available for margining\n"
+    "--resume\t\tContinue an interrupted session saved with -k\n\n"
     "Margining options (see man for all options):\n\n"
     "Common (for all specified links) options:\n"
-    "-c\t\t\tPrint Device Lane Margining Capabilities only. Do not run margining.\n\n"
+    "-c\t\t\tPrint Device Lane Margining Capabilities only. Do not run margining.\n"
+    "-j <links>\t\tMargin up to <links> Links of one Switch or Root Complex concurrently.\n"
+    "-k <file>\t\tSave finished results to a checkpoint <file>.\n"
+    "-s <file>\t\tKeep progress and ETA of the session in a status <file>.\n"
+    "-J <file>\t\tAppend results of each Receiver to <file> in JSON Lines as soon as it is done.\n"
+    "-b <file>\t\tCompare results with baselines in <file> and record them there.\n"
+    "-d <time>\t\tSpecify dwell time in seconds for the margining step.\n\n"
     "Link specific options:\n"
     "-r <recvn>[,<recvn>...]\tSpecify Receivers to select margining targets.\n"
     "\t\t\tDefault: all available Receivers (including Retimers).\n"
     "-t <steps>\t\tSpecify maximum number of steps for Time Margining.\n"
-    "-v <steps>\t\tSpecify maximum number of steps for Voltage Margining.\n";
+    "-v <steps>\t\tSpecify maximum number of steps for Voltage Margining.\n\n"
+    "Generic options:\n"
+    GENERIC_HELP;
 
 static struct pci_dev *
 dev_for_filter(struct pci_access *pacc, char *filter)
@@ -73,29 +83,23 @@ parse_csv_arg(char *arg, u8 *vals)
   return cnt;
 }
 
-static u8
-find_ready_links(struct pci_access *pacc, struct margin_link *links, bool cnt_only)
+static struct margin_link *
+find_ready_links(struct pci_access *pacc, u8 *links_n)
 {
+  struct margin_pair *pairs;
+  int pairs_n = margin_find_links(pacc, &pairs);
+  struct margin_link *links = xmalloc((pairs_n + 1) * sizeof(*links));
   u8 cnt = 0;
-  for (struct pci_dev *p = pacc->devices; p; p = p->next)
-    {
-      if (pci_find_cap(p, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED) && margin_port_is_down(p))
-        {
-          struct pci_dev *down = NULL;
-          struct pci_dev *up = NULL;
-          margin_find_pair(pacc, p, &down, &up);
 
-          if (down && margin_verify_link(down, up)
-              && pci_find_cap(up, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED)
-              && (margin_check_ready_bit(down) || margin_check_ready_bit(up)))
-            {
-              if (!cnt_only)
-                margin_fill_link(down, up, &(links[cnt]));
-              cnt++;
-            }
-        }
-    }
-  return cnt;
+  for (int i = 0; i < pairs_n; i++)
+    if (margin_check_ready_bit(pairs[i].down) || margin_check_ready_bit(pairs[i].up))
+      {
+        margin_fill_link(pairs[i].down, pairs[i].up, &(links[cnt]));
+        cnt++;
+      }
+  free(pairs);
+  *links_n = cnt;
+  return links;
 }
 
 static void
@@ -103,7 +107,6 @@ init_link_args(struct margin_link_args *link_args, struct margin_com_args *com_a
 {
   memset(link_args, 0, sizeof(*link_args));
   link_args->common = com_args;
-  link_args->parallel_lanes = 1;
 }
 
 static void
@@ -200,6 +203,18 @@ parse_dev_args(int argc, char **argv, struct margin_link_args *args, u8 link_spe
     }
 }
 
+/* Integer option argument within [min; max] */
+static long
+parse_num_arg(char *arg, long min, long max, char *what)
+{
+  char *end;
+  long x = strtol(arg, &end, 10);
+
+  if (!*arg || *end || x < min || x > max)
+    die("Invalid %s: %s\n", what, arg);
+  return x;
+}
+
 struct margin_link *
 margin_parse_util_args(struct pci_access *pacc, int argc, char **argv, enum margin_mode mode,
                        u8 *links_n)
@@ -208,13 +223,19 @@ margin_parse_util_args(struct pci_access *pacc, int argc, char **argv, enum marg
   com_args->error_limit = 4;
   com_args->run_margin = true;
   com_args->verbosity = 1;
-  com_args->steps_utility = 0;
   com_args->dir_for_csv = NULL;
   com_args->save_csv = false;
-  com_args->dwell_time = 1;
+  com_args->baseline = NULL;
+  com_args->baseline_threshold = 10;
+  com_args->status_file = NULL;
+  com_args->json_file = NULL;
+  com_args->dwell_time = 1000;
+  com_args->cmd_timeout = MARGIN_CMD_TIMEOUT;
+  com_args->step_accuracy = 0;
+  com_args->concurrent_links = 1;
 
   int c;
-  while ((c = getopt(argc, argv, "+e:co:d:")) != -1)
+  while ((c = getopt(argc, argv, "+e:co:b:B:d:a:w:j:k:s:J:")) != -1)
     {
       switch (c)
         {
@@ -228,8 +249,44 @@ margin_parse_util_args(struct pci_access *pacc, int argc, char **argv, enum marg
             com_args->dir_for_csv = optarg;
             com_args->save_csv = true;
             break;
+          case 'b':
+            com_args->baseline = optarg;
+            break;
+          case 'B':
+            com_args->baseline_threshold = atof(optarg);
+            if (com_args->baseline_threshold <= 0 || com_args->baseline_threshold >= 100)
+              die("Invalid baseline threshold: %s\n", optarg);
+            break;
           case 'd':
-            com_args->dwell_time = atoi(optarg);
+            {
+              char *end;
+              double dwell = strtod(optarg, &end);
+              if (!*optarg || *end || dwell < 0 || dwell > 3600)
+                die("Invalid dwell time: %s\n", optarg);
+              com_args->dwell_time = dwell * 1000 + 0.5;
+            }
+            break;
+          case 'a':
+            com_args->step_accuracy = parse_num_arg(optarg, 1, 255, "step accuracy");
+            break;
+          case 'w':
+            com_args->cmd_timeout = parse_num_arg(optarg, 1, 65535, "command timeout");
+            break;
+          case 'k':
+            margin_checkpoint_open(optarg, argc, argv);
+            break;
+          case 's':
+            com_args->status_file = optarg;
+            break;
+          case 'J':
+            com_args->json_file = optarg;
+            break;
+          case 'j':
+            com_args->concurrent_links = parse_num_arg(optarg, 1, 255, "number of concurrent Links");
+#ifndef PCI_HAVE_PTHREADS
+            if (com_args->concurrent_links > 1)
+              die("Concurrent margining of Links is not supported on this platform.\n");
+#endif
             break;
           default:
             die("Invalid arguments\n\n%s", usage);
@@ -255,16 +312,11 @@ margin_parse_util_args(struct pci_access *pacc, int argc, char **argv, enum marg
 
   if (mode == FULL)
     {
-      ports_n = find_ready_links(pacc, NULL, true);
+      links = find_ready_links(pacc, &ports_n);
       if (ports_n == 0)
         die("Links not found or you don't have enough privileges.\n");
-      else
-        {
-          links = xmalloc(ports_n * sizeof(*links));
-          find_ready_links(pacc, links, false);
-          for (int i = 0; i < ports_n; i++)
-            init_link_args(&(links[i].args), com_args);
-        }
+      for (int i = 0; i < ports_n; i++)
+        init_link_args(&(links[i].args), com_args);
     }
   else if (mode == MARGIN)
     {
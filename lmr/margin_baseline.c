@@ -0,0 +1,400 @@
+/*
+ *	The PCI Utilities -- Baseline database of margining results
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lmr.h"
+
+#if !defined(PCI_OS_WINDOWS) && !defined(PCI_OS_DJGPP)
+#define BASE_USE_LOCKING
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * The database is a file of fixed-size records, one per margined lane,
+ * appended by every run. The first record of a lane is its baseline.
+ *
+ * File layout (all numbers are little-endian):
+ *
+ *	header		magic "PCILMRB\x1a", u32 version, u32 record size
+ *	records		u64 Device Serial Number of the Upstream Port (0 if not known),
+ *			u16 domain, u8 bus, u8 devfn of the Downstream Port,
+ *			u8 Receiver Number, u8 logical lane, u8 Link speed, u8 flags,
+ *			u16 vendor and u16 device ID of the Upstream Port, u32 time,
+ *			u32 eye width in fs, u32 eye height in uV
+ *
+ * Lanes are identified by the serial number of the device if it has one
+ * (so that the baseline follows the device when it moves to another slot),
+ * otherwise by the slot. Results at different Link speeds are never compared.
+ *
+ * Comparing a run with the database reads the file once, sequentially, and
+ * looks up each record in a hash table of the lanes margined by this run.
+ *
+ * As the database can be shared by many machines, it is locked while it is
+ * being read and appended to. An incomplete record at its end (left by
+ * a crash or a full disk) is cut off, so that new records stay aligned.
+ */
+
+#define BASE_MAGIC    "PCILMRB\x1a"
+#define BASE_VERSION  1
+#define BASE_HDR_SIZE 16
+#define BASE_REC_SIZE 32
+
+// Bits of the flags field
+#define BASE_HAS_DSN 1
+#define BASE_HAS_EH  2
+
+struct base_rec {
+  u64 dsn;
+  u16 domain;
+  u8 bus, devfn;
+  u8 recvn, lane, speed, flags;
+  u16 vendor, device;
+  u32 time;
+  u32 ew; // fs
+  u32 eh; // uV
+};
+
+struct base_lane {
+  struct base_rec cur;
+  struct base_rec base;
+  bool found;
+  struct base_lane *next; // In the hash chain
+};
+
+static inline void
+put_u16(byte *p, u16 x)
+{
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+static inline void
+put_u32(byte *p, u32 x)
+{
+  put_u16(p, x);
+  put_u16(p + 2, x >> 16);
+}
+
+static inline u16
+get_u16(byte *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline u32
+get_u32(byte *p)
+{
+  return get_u16(p) | ((u32) get_u16(p + 2) << 16);
+}
+
+static void
+base_encode(byte *p, struct base_rec *r)
+{
+  put_u32(p, r->dsn);
+  put_u32(p + 4, r->dsn >> 32);
+  put_u16(p + 8, r->domain);
+  p[10] = r->bus;
+  p[11] = r->devfn;
+  p[12] = r->recvn;
+  p[13] = r->lane;
+  p[14] = r->speed;
+  p[15] = r->flags;
+  put_u16(p + 16, r->vendor);
+  put_u16(p + 18, r->device);
+  put_u32(p + 20, r->time);
+  put_u32(p + 24, r->ew);
+  put_u32(p + 28, r->eh);
+}
+
+static void
+base_decode(byte *p, struct base_rec *r)
+{
+  r->dsn = get_u32(p) | ((u64) get_u32(p + 4) << 32);
+  r->domain = get_u16(p + 8);
+  r->bus = p[10];
+  r->devfn = p[11];
+  r->recvn = p[12];
+  r->lane = p[13];
+  r->speed = p[14];
+  r->flags = p[15];
+  r->vendor = get_u16(p + 16);
+  r->device = get_u16(p + 18);
+  r->time = get_u32(p + 20);
+  r->ew = get_u32(p + 24);
+  r->eh = get_u32(p + 28);
+}
+
+static bool
+base_same_lane(struct base_rec *a, struct base_rec *b)
+{
+  if (a->recvn != b->recvn || a->lane != b->lane || a->speed != b->speed
+      || (a->flags & BASE_HAS_DSN) != (b->flags & BASE_HAS_DSN))
+    return false;
+  if (a->flags & BASE_HAS_DSN)
+    return a->dsn == b->dsn;
+  return a->domain == b->domain && a->bus == b->bus && a->devfn == b->devfn;
+}
+
+static unsigned int
+base_hash(struct base_rec *r)
+{
+  u64 h;
+
+  if (r->flags & BASE_HAS_DSN)
+    h = r->dsn;
+  else
+    h = ((u64) r->domain << 16) | (r->bus << 8) | r->devfn;
+  h = h * 0x9e3779b97f4a7c15ULL + (r->recvn << 16 | r->lane << 8 | r->speed);
+  return h >> 40;
+}
+
+static u64
+base_read_dsn(struct pci_dev *dev)
+{
+  struct pci_cap *cap = pci_find_cap(dev, PCI_EXT_CAP_ID_DSN, PCI_CAP_EXTENDED);
+
+  if (!cap)
+    return 0;
+  return pci_read_long(dev, cap->addr + 4) | ((u64) pci_read_long(dev, cap->addr + 8) << 32);
+}
+
+#ifdef BASE_USE_LOCKING
+
+static FILE *
+base_open_file(char *name)
+{
+  /* Never truncate, another machine may be creating the database at the same time */
+  int fd = open(name, O_RDWR | O_CREAT, 0666);
+  FILE *f;
+  struct flock fl;
+
+  if (fd < 0 || !(f = fdopen(fd, "r+b")))
+    die("Cannot open baseline database %s: %s\n", name, strerror(errno));
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(fd, F_SETLKW, &fl) < 0)
+    if (errno != EINTR)
+      die("Cannot lock baseline database %s: %s\n", name, strerror(errno));
+  return f;
+}
+
+#else
+
+static FILE *
+base_open_file(char *name)
+{
+  FILE *f = fopen(name, "r+b");
+
+  if (!f)
+    {
+      f = fopen(name, "w+b");
+      if (!f)
+        die("Cannot create baseline database %s\n", name);
+    }
+  return f;
+}
+
+#endif
+
+/* Cut off an incomplete record at the end */
+static void
+base_check_size(FILE *f, char *name)
+{
+  long size, tail;
+
+  if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0)
+    die("%s: Cannot determine size\n", name);
+  tail = (size - BASE_HDR_SIZE) % BASE_REC_SIZE;
+  if (!tail)
+    return;
+  fprintf(stderr, "%s: Removing incomplete record (%ld bytes) at the end\n", name, tail);
+#ifdef BASE_USE_LOCKING
+  fflush(f);
+  if (ftruncate(fileno(f), size - tail))
+    die("%s: Cannot truncate: %s\n", name, strerror(errno));
+#else
+  die("%s: Cannot truncate on this platform, fix the database manually\n", name);
+#endif
+}
+
+static FILE *
+base_open(char *name)
+{
+  byte hdr[BASE_HDR_SIZE];
+  FILE *f = base_open_file(name);
+
+  size_t n = fread(hdr, 1, BASE_HDR_SIZE, f);
+  if (!n)
+    {
+      memcpy(hdr, BASE_MAGIC, 8);
+      put_u32(hdr + 8, BASE_VERSION);
+      put_u32(hdr + 12, BASE_REC_SIZE);
+      if (fwrite(hdr, BASE_HDR_SIZE, 1, f) != 1)
+        die("%s: Write error\n", name);
+    }
+  else if (n != BASE_HDR_SIZE || memcmp(hdr, BASE_MAGIC, 8))
+    die("%s: Not a pcilmr baseline database\n", name);
+  else if (get_u32(hdr + 8) != BASE_VERSION || get_u32(hdr + 12) != BASE_REC_SIZE)
+    die("%s: Unsupported baseline database version %u\n", name, get_u32(hdr + 8));
+  base_check_size(f, name);
+  fseek(f, BASE_HDR_SIZE, SEEK_SET);
+  return f;
+}
+
+/* Records of all lanes margined in this run */
+static struct base_lane *
+base_collect(struct margin_link *links, struct margin_results **results, u8 *results_n,
+             u8 links_n, int *lanes_n)
+{
+  struct base_lane *lanes = NULL;
+  int n = 0;
+  u32 now = time(NULL);
+
+  for (int i = 0; i < links_n; i++)
+    {
+      struct pci_dev *down = links[i].down_port.dev;
+      struct pci_dev *up = links[i].up_port.dev;
+      u64 dsn = base_read_dsn(up);
+
+      for (int j = 0; j < results_n[i]; j++)
+        {
+          struct margin_results *res = &results[i][j];
+          if (res->test_status != MARGIN_TEST_OK || !links[i].args.common->run_margin)
+            continue;
+          lanes = xrealloc(lanes, (n + res->lanes_n) * sizeof(*lanes));
+          for (int k = 0; k < res->lanes_n; k++)
+            {
+              struct base_lane *l = &lanes[n++];
+              struct base_rec *r = &l->cur;
+              double ew, eh;
+
+              margin_results_eye(res, &res->lanes[k], &links[i].args.recv_args[res->recvn - 1],
+                                 &ew, &eh);
+              memset(l, 0, sizeof(*l));
+              r->dsn = dsn;
+              r->domain = down->domain;
+              r->bus = down->bus;
+              r->devfn = (down->dev << 3) | down->func;
+              r->recvn = res->recvn;
+              r->lane = res->lanes[k].lane;
+              r->speed = res->link_speed;
+              r->flags = (dsn ? BASE_HAS_DSN : 0) | (res->params.volt_support ? BASE_HAS_EH : 0);
+              r->vendor = up->vendor_id;
+              r->device = up->device_id;
+              r->time = now;
+              r->ew = ew * 1000 + 0.5;
+              r->eh = eh * 1000 + 0.5;
+            }
+        }
+    }
+
+  *lanes_n = n;
+  return lanes;
+}
+
+static bool
+base_dropped(u32 base, u32 cur, double threshold)
+{
+  return base && cur < base * (1 - threshold / 100);
+}
+
+int
+margin_baseline_check(char *name, double threshold, struct margin_link *links,
+                      struct margin_results **results, u8 *results_n, u8 links_n)
+{
+  int lanes_n, regressions = 0, compared = 0;
+  struct base_lane *lanes = base_collect(links, results, results_n, links_n, &lanes_n);
+  unsigned int hash_size = 1;
+  byte *buf = xmalloc(4096 * BASE_REC_SIZE);
+  size_t n;
+
+  if (!lanes_n)
+    {
+      free(buf);
+      return 0;
+    }
+
+  while (hash_size < 2 * (unsigned int) lanes_n)
+    hash_size *= 2;
+  struct base_lane **hash = xmalloc(hash_size * sizeof(*hash));
+  memset(hash, 0, hash_size * sizeof(*hash));
+  for (int i = 0; i < lanes_n; i++)
+    {
+      unsigned int h = base_hash(&lanes[i].cur) & (hash_size - 1);
+      lanes[i].next = hash[h];
+      hash[h] = &lanes[i];
+    }
+
+  FILE *f = base_open(name);
+  while ((n = fread(buf, BASE_REC_SIZE, 4096, f)) > 0)
+    for (size_t i = 0; i < n; i++)
+      {
+        struct base_rec r;
+        base_decode(buf + i * BASE_REC_SIZE, &r);
+        for (struct base_lane *l = hash[base_hash(&r) & (hash_size - 1)]; l; l = l->next)
+          if (!l->found && base_same_lane(&l->cur, &r))
+            {
+              l->base = r;
+              l->found = true;
+            }
+      }
+
+  printf("Baseline comparison (%s, threshold %.1f%%):\n", name, threshold);
+  for (int i = 0; i < lanes_n; i++)
+    {
+      struct base_lane *l = &lanes[i];
+      if (!l->found)
+        continue;
+      compared++;
+      bool ew_drop = base_dropped(l->base.ew, l->cur.ew, threshold);
+      bool eh_drop = (l->cur.flags & BASE_HAS_EH) && base_dropped(l->base.eh, l->cur.eh, threshold);
+      if (!ew_drop && !eh_drop)
+        continue;
+
+      char when[32];
+      time_t t = l->base.time;
+      strftime(when, sizeof(when), "%Y-%m-%d", gmtime(&t));
+      printf("%04x:%02x:%02x.%x Rx(%X) Lane %2d: REGRESSION since %s:", l->cur.domain,
+             l->cur.bus, l->cur.devfn >> 3, l->cur.devfn & 7, 10 + l->cur.recvn - 1, l->cur.lane,
+             when);
+      if (ew_drop)
+        printf("  EW %.2f -> %.2f ps (%.1f%%)", l->base.ew / 1000.0, l->cur.ew / 1000.0,
+               100.0 * ((double) l->cur.ew - l->base.ew) / l->base.ew);
+      if (eh_drop)
+        printf("  EH %.1f -> %.1f mV (%.1f%%)", l->base.eh / 1000.0, l->cur.eh / 1000.0,
+               100.0 * ((double) l->cur.eh - l->base.eh) / l->base.eh);
+      printf("\n");
+      regressions++;
+    }
+  printf("%d lanes compared with their baseline, %d regressed, %d recorded as new baseline.\n\n",
+         compared, regressions, lanes_n - compared);
+
+  /* Append records of this run */
+  fseek(f, 0, SEEK_END);
+  for (int i = 0; i < lanes_n; i++)
+    {
+      base_encode(buf, &lanes[i].cur);
+      if (fwrite(buf, BASE_REC_SIZE, 1, f) != 1)
+        die("%s: Write error\n", name);
+    }
+  if (fclose(f))
+    die("%s: Write error\n", name);
+
+  free(buf);
+  free(hash);
+  free(lanes);
+  return regressions;
+}
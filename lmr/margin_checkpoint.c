@@ -0,0 +1,203 @@
+/*
+ *	The PCI Utilities -- Checkpoints and interruption of margining sessions
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lmr.h"
+
+/*
+ * The checkpoint is a text file. It starts with the command line of the session
+ * (one "arg" line per argument), followed by one "lane" line per finished lane
+ * and direction:
+ *
+ *	lane <domain>:<bus>:<dev>.<func> <recvn> <lane> <dir> <steps> <status>
+ *
+ * where the address is that of the Port the Receiver belongs to, the lane is
+ * logical, dir is one of U, D, L, R and status one of NAK, LIM, THR.
+ */
+
+volatile sig_atomic_t margin_interrupted;
+
+static FILE *ckpt_file;
+static char *ckpt_name;
+static char *ckpt_resumed; // Name of the checkpoint we are resuming from
+
+struct ckpt_lane {
+  u16 domain;
+  u8 bus, dev, func;
+  u8 recvn, lane;
+  enum margin_dir dir;
+  u8 steps;
+  enum margin_step_exec_sts status;
+};
+
+static struct ckpt_lane *ckpt_lanes;
+static int ckpt_lanes_n;
+
+static const char ckpt_dirs[] = "UDLR";
+static const char *ckpt_statuses[] = { "NAK", "LIM", "THR" };
+
+static void
+margin_signal(int sig)
+{
+  margin_interrupted = 1;
+  /* Let another signal terminate us immediately */
+  signal(sig, SIG_DFL);
+}
+
+void
+margin_catch_signals(void)
+{
+  signal(SIGINT, margin_signal);
+  signal(SIGTERM, margin_signal);
+#ifdef SIGHUP
+  signal(SIGHUP, margin_signal);
+#endif
+}
+
+void
+margin_checkpoint_open(char *name, int argc, char **argv)
+{
+  if (ckpt_resumed)
+    {
+      /* The saved command line refers to the checkpoint by the name it was created with */
+      ckpt_name = ckpt_resumed;
+      ckpt_file = fopen(ckpt_name, "a");
+      if (!ckpt_file)
+        die("Cannot append to checkpoint %s\n", ckpt_name);
+      return;
+    }
+
+  ckpt_name = name;
+  ckpt_file = fopen(name, "w");
+  if (!ckpt_file)
+    die("Cannot create checkpoint %s\n", name);
+  fprintf(ckpt_file, "# pcilmr checkpoint, continue with: pcilmr --resume %s\n", name);
+  for (int i = 1; i < argc; i++)
+    {
+      if (strchr(argv[i], '\n'))
+        die("Arguments containing newlines cannot be saved to a checkpoint\n");
+      fprintf(ckpt_file, "arg %s\n", argv[i]);
+    }
+  fflush(ckpt_file);
+}
+
+void
+margin_checkpoint_load(char *name, int *argc, char ***argv)
+{
+  FILE *f = fopen(name, "r");
+  char line[1024];
+  int n = 1, line_n = 0;
+  char **args = xmalloc(sizeof(char *));
+
+  if (!f)
+    die("Cannot open checkpoint %s\n", name);
+  args[0] = (*argv)[0];
+
+  while (fgets(line, sizeof(line), f))
+    {
+      line_n++;
+      char *nl = strchr(line, '\n');
+      if (!nl)
+        die("%s:%d: Line too long or incomplete\n", name, line_n);
+      *nl = 0;
+
+      if (!strncmp(line, "arg ", 4))
+        {
+          args = xrealloc(args, (n + 1) * sizeof(char *));
+          args[n++] = xstrdup(line + 4);
+        }
+      else if (!strncmp(line, "lane ", 5))
+        {
+          unsigned domain, bus, dev, func, recvn, lane, steps;
+          char dir, status[4];
+          char *d;
+          struct ckpt_lane *l;
+          int st;
+
+          if (sscanf(line + 5, "%x:%x:%x.%x %u %u %c %u %3s", &domain, &bus, &dev, &func,
+                     &recvn, &lane, &dir, &steps, status) != 9
+              || !(d = strchr(ckpt_dirs, dir)))
+            die("%s:%d: Invalid lane record\n", name, line_n);
+          for (st = 0; st < 3 && strcmp(status, ckpt_statuses[st]); st++)
+            ;
+          if (st == 3)
+            die("%s:%d: Invalid lane status\n", name, line_n);
+
+          ckpt_lanes = xrealloc(ckpt_lanes, (ckpt_lanes_n + 1) * sizeof(*ckpt_lanes));
+          l = &ckpt_lanes[ckpt_lanes_n++];
+          l->domain = domain;
+          l->bus = bus;
+          l->dev = dev;
+          l->func = func;
+          l->recvn = recvn;
+          l->lane = lane;
+          l->dir = d - ckpt_dirs;
+          l->steps = steps;
+          l->status = st;
+        }
+      else if (line[0] && line[0] != '#')
+        die("%s:%d: Unknown record\n", name, line_n);
+    }
+  fclose(f);
+
+  if (n == 1)
+    die("%s: No command line found, is it a pcilmr checkpoint?\n", name);
+  args = xrealloc(args, (n + 1) * sizeof(char *));
+  args[n] = NULL;
+  *argc = n;
+  *argv = args;
+  ckpt_resumed = name;
+}
+
+bool
+margin_checkpoint_find(struct pci_dev *dev, u8 recvn, u8 lane, enum margin_dir dir, u8 *steps,
+                       enum margin_step_exec_sts *status)
+{
+  for (int i = 0; i < ckpt_lanes_n; i++)
+    {
+      struct ckpt_lane *l = &ckpt_lanes[i];
+      if (l->domain == dev->domain && l->bus == dev->bus && l->dev == dev->dev
+          && l->func == dev->func && l->recvn == recvn && l->lane == lane && l->dir == dir)
+        {
+          *steps = l->steps;
+          *status = l->status;
+          return true;
+        }
+    }
+  return false;
+}
+
+void
+margin_checkpoint_lane(struct pci_dev *dev, u8 recvn, u8 lane, enum margin_dir dir, u8 steps,
+                       enum margin_step_exec_sts status)
+{
+  if (!ckpt_file)
+    return;
+  /* A single call, so that records of concurrently margined Links do not mix */
+  fprintf(ckpt_file, "lane %04x:%02x:%02x.%x %d %d %c %d %s\n", dev->domain, dev->bus, dev->dev,
+          dev->func, recvn, lane, ckpt_dirs[dir], steps, ckpt_statuses[status]);
+  fflush(ckpt_file);
+}
+
+char *
+margin_checkpoint_name(void)
+{
+  return ckpt_name;
+}
+
+void
+margin_checkpoint_close(void)
+{
+  if (ckpt_file)
+    fclose(ckpt_file);
+  ckpt_file = NULL;
+}
@@ -9,6 +9,7 @@
  */
 
 #include <memory.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lmr.h"
@@ -79,6 +80,65 @@ margin_find_pair(struct pci_access *pacc, struct pci_dev *dev, struct pci_dev **
   return false;
 }
 
+/* Function 0 of a device on the bus, candidate for the Upstream Port of a Link */
+struct margin_bus_dev {
+  struct pci_dev *dev;
+  struct margin_bus_dev *next;
+};
+
+int
+margin_find_links(struct pci_access *pacc, struct margin_pair **pairs)
+{
+  struct margin_bus_dev *by_bus[256] = { NULL };
+  int devs_n = 0, downs_n = 0, entries_n = 0, n = 0;
+
+  for (struct pci_dev *p = pacc->devices; p; p = p->next)
+    devs_n++;
+  struct margin_bus_dev *entries = xmalloc((devs_n + 1) * sizeof(*entries));
+  struct pci_dev **downs = xmalloc((devs_n + 1) * sizeof(*downs));
+
+  // Index Functions 0 by bus (the first one in the list wins, as in margin_find_pair())
+  // and collect Downstream Ports with LMR
+  for (struct pci_dev *p = pacc->devices; p; p = p->next)
+    {
+      if (p->func == 0)
+        {
+          struct margin_bus_dev *b = by_bus[p->bus];
+          while (b && b->dev->domain != p->domain)
+            b = b->next;
+          if (!b)
+            {
+              b = &entries[entries_n++];
+              b->dev = p;
+              b->next = by_bus[p->bus];
+              by_bus[p->bus] = b;
+            }
+        }
+      if (margin_port_is_down(p) && pci_find_cap(p, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED))
+        downs[downs_n++] = p;
+    }
+
+  *pairs = xmalloc((downs_n + 1) * sizeof(**pairs));
+  for (int i = 0; i < downs_n; i++)
+    {
+      struct pci_dev *down = downs[i];
+      struct margin_bus_dev *b = by_bus[pci_read_byte(down, PCI_SECONDARY_BUS)];
+      while (b && b->dev->domain != down->domain)
+        b = b->next;
+      if (b && margin_verify_link(down, b->dev)
+          && pci_find_cap(b->dev, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED))
+        {
+          (*pairs)[n].down = down;
+          (*pairs)[n].up = b->dev;
+          n++;
+        }
+    }
+
+  free(downs);
+  free(entries);
+  return n;
+}
+
 bool
 margin_verify_link(struct pci_dev *down_port, struct pci_dev *up_port)
 {
@@ -122,7 +182,8 @@ fill_dev_wrapper(struct pci_dev *dev)
     = (!!(pci_read_word(dev, cap->addr + PCI_EXP_LNKSTA2) & PCI_EXP_LINKSTA2_RETIMER))
       + (!!(pci_read_word(dev, cap->addr + PCI_EXP_LNKSTA2) & PCI_EXP_LINKSTA2_2RETIMERS)),
     .link_speed = (pci_read_word(dev, cap->addr + PCI_EXP_LNKSTA) & PCI_EXP_LNKSTA_SPEED),
-    .hw = detect_unique_hw(dev)
+    .hw = detect_unique_hw(dev),
+    .cmd_timeout = MARGIN_CMD_TIMEOUT
   };
   return res;
 }
@@ -10,22 +10,116 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "lmr.h"
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 bool margin_global_logging = false;
 bool margin_print_domain = true;
 
+#ifdef PCI_HAVE_PTHREADS
+
+/* Log of the current thread collected in memory while Links are margined concurrently */
+struct margin_log_buf {
+  char *buf;
+  size_t len, size;
+};
+
+static pthread_key_t margin_log_key;
+static pthread_once_t margin_log_key_once = PTHREAD_ONCE_INIT;
+
+static void
+margin_log_key_init(void)
+{
+  if (pthread_key_create(&margin_log_key, NULL))
+    die("Cannot create thread-specific log key");
+}
+
+void
+margin_log_capture_start(void)
+{
+  struct margin_log_buf *b = xmalloc(sizeof(*b));
+
+  pthread_once(&margin_log_key_once, margin_log_key_init);
+  b->size = 4096;
+  b->buf = xmalloc(b->size);
+  b->buf[0] = 0;
+  b->len = 0;
+  pthread_setspecific(margin_log_key, b);
+}
+
+char *
+margin_log_capture_end(void)
+{
+  struct margin_log_buf *b = pthread_getspecific(margin_log_key);
+  char *buf = b->buf;
+
+  pthread_setspecific(margin_log_key, NULL);
+  free(b);
+  return buf;
+}
+
+static struct margin_log_buf *
+margin_log_capture_buf(void)
+{
+  pthread_once(&margin_log_key_once, margin_log_key_init);
+  return pthread_getspecific(margin_log_key);
+}
+
+static void
+margin_log_capture(struct margin_log_buf *b, char *format, va_list arg)
+{
+  va_list arg2;
+  int n;
+
+  va_copy(arg2, arg);
+  n = vsnprintf(b->buf + b->len, b->size - b->len, format, arg);
+  if (n >= 0 && b->len + n >= b->size)
+    {
+      while (b->len + n >= b->size)
+        b->size *= 2;
+      b->buf = xrealloc(b->buf, b->size);
+      n = vsnprintf(b->buf + b->len, b->size - b->len, format, arg2);
+    }
+  va_end(arg2);
+  if (n > 0)
+    b->len += n;
+}
+
+#endif
+
 void
 margin_log(char *format, ...)
 {
   va_list arg;
   va_start(arg, format);
   if (margin_global_logging)
-    vprintf(format, arg);
+    {
+#ifdef PCI_HAVE_PTHREADS
+      struct margin_log_buf *b = margin_log_capture_buf();
+      if (b)
+        margin_log_capture(b, format, arg);
+      else
+#endif
+        vprintf(format, arg);
+    }
   va_end(arg);
 }
 
+bool
+margin_log_captured(void)
+{
+#ifdef PCI_HAVE_PTHREADS
+  return margin_log_capture_buf() != NULL;
+#else
+  return false;
+#endif
+}
+
 void
 margin_log_bdfs(struct pci_dev *down, struct pci_dev *up)
 {
@@ -92,7 +186,11 @@ margin_log_receiver(struct margin_recv *recv)
 
   margin_log("\nError Count Limit = %d\n", recv->error_limit);
   margin_log("Parallel Lanes: %d\n", recv->parallel_lanes);
-  margin_log("Margining dwell time: %d s\n\n", recv->dwell_time);
+  margin_log("Margining dwell time: %g s\n", recv->dwell_time / 1000.0);
+  if (recv->step_accuracy)
+    margin_log("Step search: adaptive, accuracy %d steps\n\n", recv->step_accuracy);
+  else
+    margin_log("Step search: all steps\n\n");
 
   margin_log_params(recv->params);
 
@@ -115,44 +213,30 @@ margin_log_receiver(struct margin_recv *recv)
 void
 margin_log_margining(struct margin_lanes_data arg)
 {
-  char *ind_dirs[] = { "Up", "Down", "Left", "Right" };
-  char *non_ind_dirs[] = { "Voltage", "", "Timing" };
+  char *ind_dirs[] = { "U", "D", "L", "R" };
+  char *non_ind_dirs[] = { "V", "", "T" };
 
-  if (arg.verbosity > 0)
+  /* Progress of concurrently margined Links is reported by the scheduler */
+  if (arg.verbosity > 0 && !margin_log_captured())
     {
-      margin_log("\033[2K\rMargining - ");
-      if (arg.ind)
-        margin_log("%s", ind_dirs[arg.dir]);
-      else
-        margin_log("%s", non_ind_dirs[arg.dir]);
-
-      u8 lanes_counter = 0;
-      margin_log(" - Lanes ");
-      margin_log("[%d", arg.lanes_numbers[0]);
-      for (int i = 1; i < arg.lanes_n; i++)
+      margin_log("\033[2K\rMargining - Lanes [");
+      bool first = true;
+      for (int s = 0; s < arg.slots_n; s++)
         {
-          if (arg.lanes_numbers[i] - 1 == arg.lanes_numbers[i - 1])
-            {
-              lanes_counter++;
-              if (lanes_counter == 1)
-                margin_log("-");
-              if (i + 1 == arg.lanes_n)
-                margin_log("%d", arg.lanes_numbers[i]);
-            }
-          else
-            {
-              if (lanes_counter > 0)
-                margin_log("%d", arg.lanes_numbers[i - 1]);
-              margin_log(",%d", arg.lanes_numbers[i]);
-              lanes_counter = 0;
-            }
+          struct margin_lane_job *job = arg.slots[s];
+          if (!job)
+            continue;
+          bool ind = job->timing ? arg.ind_tim : arg.ind_volt;
+          margin_log("%s%d%s", first ? "" : ",", arg.lanes_numbers[job->lane],
+                     ind ? ind_dirs[job->dir] : non_ind_dirs[job->dir]);
+          first = false;
         }
-      margin_log("]");
+      margin_log("] - Jobs: %d/%d", arg.jobs_done, arg.jobs_n);
 
-      u64 lane_eta_s = (arg.steps_lane_total - arg.steps_lane_done) * arg.recv->dwell_time;
-      u64 total_eta_s = *arg.steps_utility * arg.recv->dwell_time + lane_eta_s;
-      margin_log(" - ETA: %3ds Steps: %3d Total ETA: %3dm %2ds", lane_eta_s, arg.steps_lane_done,
-                 total_eta_s / 60, total_eta_s % 60);
+      u64 lane_eta_s;
+      u64 total_eta_s = margin_progress_eta(arg.progress, &lane_eta_s);
+      margin_log(" - ETA: %3ds Total ETA: %3dm %2ds", (int) lane_eta_s, (int) (total_eta_s / 60),
+                 (int) (total_eta_s % 60));
 
       fflush(stdout);
     }
@@ -174,3 +258,10 @@ margin_log_hw_quirks(struct margin_recv *recv)
         break;
     }
 }
+
+void
+margin_log_handshakes(struct margin_dev *dev)
+{
+  margin_log("Command handshakes: %u, total time: %.1f ms, longest: %.2f ms\n", dev->handshakes,
+             dev->handshake_time / 1000.0, dev->handshake_max / 1000.0);
+}
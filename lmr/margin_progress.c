@@ -0,0 +1,298 @@
+/*
+ *	The PCI Utilities -- Progress and ETA of margining sessions
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lmr.h"
+
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+ * Progress of the whole session: Receivers are registered before margining
+ * starts. Their capabilities are not read until they are margined, so they get
+ * a provisional plan first. Once some Receivers have started, the rest is
+ * expected to need the average of their plans (number of rounds, i.e., dwells
+ * of all lanes margined at once). The plan is an upper estimate, lanes usually
+ * fail long before they reach the last step. So the ETA is calculated from
+ * measured values:
+ *
+ *   - duration of a round (dwell time plus the command handshakes),
+ *   - time a Receiver spends outside rounds (reading capabilities etc.),
+ *   - ratio of rounds really needed to rounds planned by finished Receivers,
+ *     which is applied to plans of Receivers not started yet,
+ *   - the number of Receivers margined at once (Links margined concurrently).
+ *
+ * Receivers being margined estimate their remaining rounds from their jobs.
+ *
+ * Progress can be written to a status file, which is rewritten (atomically,
+ * by renaming a temporary file) at most once per second and whenever
+ * a Receiver starts or finishes.
+ */
+
+#define PROGRESS_WRITE_INTERVAL 1000000 // us
+
+static struct {
+  char *status_file;
+  char *status_tmp;
+  u32 dwell_time; // ms
+  u64 start;      // us
+  u64 last_write; // us
+
+  int recvs_total;
+  int recvs_done;
+  u64 pending_plan; // Provisional plans of Receivers not started yet
+
+  // Started Receivers
+  int recvs_started;
+  u64 started_plan;
+
+  // Finished Receivers
+  u64 done_plan, done_rounds;
+  u64 recv_time; // Time spent outside rounds, us
+
+  // All Receivers
+  u64 rounds;
+  u64 round_time; // us
+  u64 handshakes;
+  u64 handshake_time; // us
+  u32 jobs_done;
+  u32 jobs_early; // Finished before reaching the step threshold
+
+  struct margin_progress *active;
+  int active_n;
+} prog;
+
+#ifdef PCI_HAVE_PTHREADS
+static pthread_mutex_t prog_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PROG_LOCK()   pthread_mutex_lock(&prog_lock)
+#define PROG_UNLOCK() pthread_mutex_unlock(&prog_lock)
+#else
+#define PROG_LOCK()   do { } while (0)
+#define PROG_UNLOCK() do { } while (0)
+#endif
+
+void
+margin_progress_start(char *status_file, u32 dwell_time)
+{
+  prog.status_file = status_file;
+  if (status_file)
+    {
+      prog.status_tmp = xmalloc(strlen(status_file) + 5);
+      sprintf(prog.status_tmp, "%s.tmp", status_file);
+    }
+  prog.dwell_time = dwell_time;
+  prog.start = margin_time_us();
+}
+
+void
+margin_progress_plan(u64 provisional)
+{
+  prog.recvs_total++;
+  prog.pending_plan += provisional;
+}
+
+static void
+margin_progress_unplan(u64 provisional)
+{
+  prog.pending_plan -= provisional < prog.pending_plan ? provisional : prog.pending_plan;
+}
+
+/* Average duration of a round in us, the dwell time until we measure it */
+static double
+margin_progress_round_us(void)
+{
+  if (prog.rounds)
+    return (double) prog.round_time / prog.rounds;
+  return prog.dwell_time * 1000.0;
+}
+
+/* Share of planned rounds really needed by finished Receivers */
+static double
+margin_progress_ratio(void)
+{
+  return prog.done_plan ? (double) prog.done_rounds / prog.done_plan : 1;
+}
+
+/* Rounds left to the Receiver: its own estimate, unless finished Receivers suggest less */
+static double
+margin_progress_left(struct margin_progress *p)
+{
+  double left = p->left;
+
+  if (prog.done_plan)
+    {
+      double calibrated = p->plan * margin_progress_ratio() - p->rounds;
+      if (calibrated < 1)
+        calibrated = 1;
+      if (calibrated < left)
+        left = calibrated;
+    }
+  return left;
+}
+
+static u64
+margin_progress_eta_locked(void)
+{
+  double round_us = margin_progress_round_us();
+  double active_us = 0;
+  int pending_n = prog.recvs_total - prog.recvs_done - prog.active_n;
+
+  for (struct margin_progress *p = prog.active; p; p = p->next)
+    active_us += margin_progress_left(p) * round_us;
+
+  double pending_us = 0;
+  if (pending_n > 0)
+    {
+      double plan = prog.pending_plan;
+      if (prog.recvs_started)
+        plan = (double) pending_n * prog.started_plan / prog.recvs_started;
+      double ratio = margin_progress_ratio();
+      double overhead_us = prog.recvs_done ? (double) prog.recv_time / prog.recvs_done : 0;
+      pending_us = plan * ratio * round_us + pending_n * overhead_us;
+    }
+
+  // Receivers margined at once share the wall clock
+  int parallel = prog.active_n > 1 ? prog.active_n : 1;
+  return (active_us + pending_us) / parallel / 1000000;
+}
+
+static void
+margin_progress_write_locked(char *state, bool force)
+{
+  u64 now = margin_time_us();
+
+  if (!prog.status_file || (!force && now - prog.last_write < PROGRESS_WRITE_INTERVAL))
+    return;
+  prog.last_write = now;
+
+  FILE *f = fopen(prog.status_tmp, "w");
+  if (!f)
+    die("Cannot write status file %s\n", prog.status_tmp);
+
+  fprintf(f, "{\"state\":\"%s\",\"time\":%ld,\"elapsed_s\":%.1f,\"eta_s\":%llu,", state,
+          (long) time(NULL), (now - prog.start) / 1e6,
+          (unsigned long long) (strcmp(state, "running") ? 0 : margin_progress_eta_locked()));
+  fprintf(f, "\"receivers_total\":%d,\"receivers_done\":%d,\"receivers_active\":%d,",
+          prog.recvs_total, prog.recvs_done, prog.active_n);
+  fprintf(f, "\"rounds\":%llu,\"round_ms\":%.3f,\"handshakes\":%llu,\"handshake_us\":%.1f,",
+          (unsigned long long) prog.rounds, margin_progress_round_us() / 1000,
+          (unsigned long long) prog.handshakes,
+          prog.handshakes ? (double) prog.handshake_time / prog.handshakes : 0.0);
+  fprintf(f, "\"jobs_done\":%u,\"jobs_early\":%u,\"active\":[", prog.jobs_done, prog.jobs_early);
+  for (struct margin_progress *p = prog.active; p; p = p->next)
+    fprintf(f, "%s{\"port\":\"%04x:%02x:%02x.%x\",\"recvn\":%d,\"rounds\":%llu,\"rounds_left\":%llu}",
+            p == prog.active ? "" : ",", p->dev->domain, p->dev->bus, p->dev->dev, p->dev->func,
+            p->recvn, (unsigned long long) p->rounds, (unsigned long long) p->left);
+  fprintf(f, "]}\n");
+
+  if (fclose(f) || rename(prog.status_tmp, prog.status_file))
+    die("Cannot write status file %s\n", prog.status_file);
+}
+
+void
+margin_progress_recv_start(struct margin_progress *p, struct pci_dev *dev, u8 recvn,
+                           u64 provisional, u64 plan, u64 left)
+{
+  p->dev = dev;
+  p->recvn = recvn;
+  p->plan = plan;
+  p->left = left;
+  p->rounds = 0;
+  p->start = margin_time_us();
+  p->round_time = 0;
+
+  PROG_LOCK();
+  margin_progress_unplan(provisional);
+  prog.recvs_started++;
+  prog.started_plan += plan;
+  p->next = prog.active;
+  prog.active = p;
+  prog.active_n++;
+  margin_progress_write_locked("running", true);
+  PROG_UNLOCK();
+}
+
+void
+margin_progress_round(struct margin_progress *p, u64 left, u64 time)
+{
+  PROG_LOCK();
+  p->rounds++;
+  p->round_time += time;
+  p->left = left;
+  prog.rounds++;
+  prog.round_time += time;
+  margin_progress_write_locked("running", false);
+  PROG_UNLOCK();
+}
+
+void
+margin_progress_job(bool early)
+{
+  PROG_LOCK();
+  prog.jobs_done++;
+  if (early)
+    prog.jobs_early++;
+  PROG_UNLOCK();
+}
+
+void
+margin_progress_recv_end(struct margin_progress *p, struct margin_dev *dev)
+{
+  u64 time = margin_time_us() - p->start;
+
+  PROG_LOCK();
+  for (struct margin_progress **q = &prog.active; *q; q = &(*q)->next)
+    if (*q == p)
+      {
+        *q = p->next;
+        break;
+      }
+  prog.active_n--;
+  prog.recvs_done++;
+  prog.done_plan += p->plan;
+  prog.done_rounds += p->rounds;
+  prog.recv_time += time > p->round_time ? time - p->round_time : 0;
+  prog.handshakes += dev->handshakes;
+  prog.handshake_time += dev->handshake_time;
+  margin_progress_write_locked("running", true);
+  PROG_UNLOCK();
+}
+
+void
+margin_progress_recv_skip(u64 provisional)
+{
+  PROG_LOCK();
+  prog.recvs_total--;
+  margin_progress_unplan(provisional);
+  margin_progress_write_locked("running", true);
+  PROG_UNLOCK();
+}
+
+u64
+margin_progress_eta(struct margin_progress *p, u64 *recv_eta)
+{
+  PROG_LOCK();
+  u64 eta = margin_progress_eta_locked();
+  if (recv_eta)
+    *recv_eta = margin_progress_left(p) * margin_progress_round_us() / 1000000;
+  PROG_UNLOCK();
+  return eta;
+}
+
+void
+margin_progress_finish(char *state)
+{
+  PROG_LOCK();
+  margin_progress_write_locked(state, true);
+  PROG_UNLOCK();
+}
@@ -15,6 +15,10 @@
 
 #include "lmr.h"
 
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 enum lane_rating {
   FAIL = 0,
   PASS,
@@ -24,6 +28,15 @@ enum lane_rating {
 
 static char *const grades[] = { "Fail", "Pass", "Perfect" };
 static char *const sts_strings[] = { "NAK", "LIM", "THR" };
+static char *const no_test_msgs[] = {
+  "",
+  "Margining Ready bit is Clear",
+  "Error during caps reading",
+  "Margining prerequisites are not satisfied (supported rate, D0)",
+  "Invalid lanes specified with arguments",
+  "Invalid receivers specified with arguments",
+  "Couldn't disable ASPM"
+};
 
 static enum lane_rating
 rate_lane(double value, double min, double recommended, enum lane_rating cur_rate)
@@ -41,6 +54,31 @@ rate_lane(double value, double min, double recommended, enum lane_rating cur_rat
     return cur_rate;
 }
 
+void
+margin_results_eye(struct margin_results *res, struct margin_res_lane *lane,
+                   struct margin_recv_args *grade_args, double *ew, double *eh)
+{
+  u8 link_speed = res->link_speed - 4;
+  double left_ps = lane->steps[TIM_LEFT] * res->tim_coef / 100.0 * margin_ui[link_speed];
+  double right_ps = lane->steps[TIM_RIGHT] * res->tim_coef / 100.0 * margin_ui[link_speed];
+
+  *ew = left_ps;
+  if (res->params.ind_left_right_tim)
+    *ew += right_ps;
+  else if (!grade_args->t.one_side_is_whole)
+    *ew *= 2.0;
+
+  *eh = 0.0;
+  if (res->params.volt_support)
+    {
+      *eh += lane->steps[VOLT_UP] * res->volt_coef;
+      if (res->params.ind_up_down_volt)
+        *eh += lane->steps[VOLT_DOWN] * res->volt_coef;
+      else if (!grade_args->v.one_side_is_whole)
+        *eh *= 2.0;
+    }
+}
+
 void
 margin_results_print_brief(struct margin_results *results, u8 recvs_n,
                            struct margin_link_args *args)
@@ -61,14 +99,6 @@ margin_results_print_brief(struct margin_results *results, u8 recvs_n,
   double eh_min;
   double eh_rec;
 
-  char *no_test_msgs[] = { "",
-                           "Margining Ready bit is Clear",
-                           "Error during caps reading",
-                           "Margining prerequisites are not satisfied (supported rate, D0)",
-                           "Invalid lanes specified with arguments",
-                           "Invalid receivers specified with arguments",
-                           "Couldn't disable ASPM" };
-
   for (int i = 0; i < recvs_n; i++)
     {
       res = &(results[i]);
@@ -176,21 +206,8 @@ margin_results_print_brief(struct margin_results *results, u8 recvs_n,
           double up_volt = lane->steps[VOLT_UP] * res->volt_coef;
           double down_volt = lane->steps[VOLT_DOWN] * res->volt_coef;
 
-          double ew = left_ps;
-          if (params.ind_left_right_tim)
-            ew += right_ps;
-          else if (!grade_args.t.one_side_is_whole)
-            ew *= 2.0;
-
-          double eh = 0.0;
-          if (params.volt_support)
-            {
-              eh += up_volt;
-              if (params.ind_up_down_volt)
-                eh += down_volt;
-              else if (!grade_args.v.one_side_is_whole)
-                eh *= 2.0;
-            }
+          double ew, eh;
+          margin_results_eye(res, lane, &grade_args, &ew, &eh);
 
           lane_rating = rate_lane(ew, ew_min, ew_rec, lane_rating);
           if (params.volt_support)
@@ -313,21 +330,8 @@ margin_results_save_csv(struct margin_results *results, u8 recvs_n, struct margi
           double up_volt = lane->steps[VOLT_UP] * res->volt_coef;
           double down_volt = lane->steps[VOLT_DOWN] * res->volt_coef;
 
-          double ew = left_ps;
-          if (params.ind_left_right_tim)
-            ew += right_ps;
-          else if (!grade_args.t.one_side_is_whole)
-            ew *= 2.0;
-
-          double eh = 0.0;
-          if (params.volt_support)
-            {
-              eh += up_volt;
-              if (params.ind_up_down_volt)
-                eh += down_volt;
-              else if (!grade_args.v.one_side_is_whole)
-                eh *= 2.0;
-            }
+          double ew, eh;
+          margin_results_eye(res, lane, &grade_args, &ew, &eh);
 
           lane_rating = rate_lane(ew, ew_min, ew_rec, lane_rating);
           if (params.volt_support)
@@ -384,3 +388,131 @@ margin_results_save_csv(struct margin_results *results, u8 recvs_n, struct margi
     }
   free(path);
 }
+
+/*
+ * Streaming results: one JSON object per line for each margined lane, written
+ * as soon as its Receiver is finished. Receivers and Links which could not be
+ * margined get a single record with an "error" field instead.
+ */
+
+static FILE *json_file;
+static char *json_name;
+
+#ifdef PCI_HAVE_PTHREADS
+static pthread_mutex_t json_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void
+margin_results_json_open(char *name)
+{
+  json_file = fopen(name, "a");
+  if (!json_file)
+    die("Cannot open results file %s\n", name);
+  json_name = name;
+}
+
+void
+margin_results_json_close(void)
+{
+  if (json_file && fclose(json_file))
+    die("%s: Write error\n", json_name);
+  json_file = NULL;
+}
+
+static void
+json_dir(FILE *f, char *name, struct margin_results *res, struct margin_res_lane *lane,
+         enum margin_dir dir)
+{
+  u8 link_speed = res->link_speed - 4;
+
+  fprintf(f, ",\"%s\":{\"steps\":%d,\"status\":\"%s\",", name, lane->steps[dir],
+          sts_strings[lane->statuses[dir]]);
+  if (dir == TIM_LEFT || dir == TIM_RIGHT)
+    {
+      double ps = lane->steps[dir] * res->tim_coef / 100.0 * margin_ui[link_speed];
+      fprintf(f, "\"ui_pct\":%.2f,\"ps\":%.3f}", ps / margin_ui[link_speed] * 100.0, ps);
+    }
+  else
+    fprintf(f, "\"mv\":%.2f}", lane->steps[dir] * res->volt_coef);
+}
+
+void
+margin_results_json(struct margin_link *link, struct margin_results *res)
+{
+  struct pci_dev *down = link->down_port.dev;
+  struct pci_dev *up = link->up_port.dev;
+  char head[160], timestamp[32];
+  time_t tim = time(NULL);
+
+  if (!json_file || !link->args.common->run_margin)
+    return;
+
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&tim));
+  int n = snprintf(head, sizeof(head),
+                   "{\"time\":\"%s\",\"down\":\"%04x:%02x:%02x.%x\",\"up\":\"%04x:%02x:%02x.%x\"",
+                   timestamp, down->domain, down->bus, down->dev, down->func, up->domain, up->bus,
+                   up->dev, up->func);
+  if (res->recvn)
+    snprintf(head + n, sizeof(head) - n, ",\"rx\":\"%X\",\"recvn\":%d", 10 + res->recvn - 1,
+             res->recvn);
+
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_lock(&json_lock);
+#endif
+
+  if (res->test_status != MARGIN_TEST_OK)
+    fprintf(json_file, "%s,\"error\":\"%s\"}\n", head, no_test_msgs[res->test_status]);
+  else
+    {
+      struct margin_params *params = &res->params;
+      struct margin_recv_args *grade_args = &link->args.recv_args[res->recvn - 1];
+      u8 link_speed = res->link_speed - 4;
+      bool spec_ref_only = !grade_args->t.criteria && !grade_args->v.criteria;
+      double ew_min = grade_args->t.criteria ? grade_args->t.criteria : margin_ew_min[link_speed];
+      double ew_rec = grade_args->t.criteria ? grade_args->t.criteria : margin_ew_rec[link_speed];
+      double eh_min = grade_args->v.criteria ? grade_args->v.criteria : margin_eh_min[link_speed];
+      double eh_rec = grade_args->v.criteria ? grade_args->v.criteria : margin_eh_rec[link_speed];
+
+      for (int i = 0; i < res->lanes_n; i++)
+        {
+          struct margin_res_lane *lane = &res->lanes[i];
+          enum lane_rating lane_rating = spec_ref_only ? INIT : PASS;
+          double ew, eh;
+
+          margin_results_eye(res, lane, grade_args, &ew, &eh);
+          lane_rating = rate_lane(ew, ew_min, ew_rec, lane_rating);
+          if (params->volt_support)
+            lane_rating = rate_lane(eh, eh_min, eh_rec, lane_rating);
+
+          fprintf(json_file, "%s,\"speed\":%d,\"lane\":%d,\"grade\":\"%s\",", head,
+                  16 << link_speed, lane->lane, grades[lane_rating]);
+          fprintf(json_file,
+                  "\"ew_ps\":%.3f,\"ew_ui_pct\":%.2f,\"ew_min_ps\":%.3f,\"ew_rec_ps\":%.3f", ew,
+                  ew / margin_ui[link_speed] * 100.0, ew_min, ew_rec);
+          if (params->volt_support)
+            fprintf(json_file, ",\"eh_mv\":%.2f,\"eh_min_mv\":%.2f,\"eh_rec_mv\":%.2f", eh,
+                    eh_min, eh_rec);
+          if (params->ind_left_right_tim)
+            {
+              json_dir(json_file, "left", res, lane, TIM_LEFT);
+              json_dir(json_file, "right", res, lane, TIM_RIGHT);
+            }
+          else
+            json_dir(json_file, "timing", res, lane, TIM_LEFT);
+          if (params->volt_support && params->ind_up_down_volt)
+            {
+              json_dir(json_file, "up", res, lane, VOLT_UP);
+              json_dir(json_file, "down", res, lane, VOLT_DOWN);
+            }
+          else if (params->volt_support)
+            json_dir(json_file, "voltage", res, lane, VOLT_UP);
+          fprintf(json_file, "}\n");
+        }
+    }
+  if (fflush(json_file))
+    die("%s: Write error\n", json_name);
+
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_unlock(&json_lock);
+#endif
+}
@@ -0,0 +1,230 @@
+/*
+ *	The PCI Utilities -- Margin independent Links concurrently
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lmr.h"
+
+#ifdef PCI_HAVE_PTHREADS
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Links whose Downstream Ports are on the same bus (i.e., belong to the same
+ * Switch or Root Complex) form a group, at most com_args->concurrent_links Links
+ * of a group are margined at once. Every Link is margined through its own
+ * pci_access (see pci_alloc() in pci.h).
+ */
+
+enum margin_job_state { JOB_WAITING, JOB_RUNNING, JOB_DONE, JOB_FINISHED };
+
+struct margin_job {
+  struct margin_link *link;  // Link in the main pci_access
+  struct margin_link local;  // The same Link in the job's own pci_access
+  struct margin_com_args common;
+  struct pci_access *pacc;
+  struct pci_dev *down, *up;
+  int group;
+  enum margin_job_state state;
+  pthread_t thread;
+
+  struct margin_results *results;
+  u8 results_n;
+  char *log;
+
+  pthread_mutex_t *lock;
+  pthread_cond_t *done;
+};
+
+static struct pci_access *
+margin_clone_access(struct pci_access *pacc)
+{
+  struct pci_access *a = pci_alloc();
+  struct pci_param *p = NULL;
+
+  a->method = pacc->method;
+  a->debugging = pacc->debugging;
+  while ((p = pci_walk_params(pacc, p)))
+    pci_set_param(a, p->param, p->value);
+  pci_init(a);
+  return a;
+}
+
+static void
+margin_job_prepare(struct pci_access *pacc, struct margin_job *job)
+{
+  struct pci_dev *down = job->link->down_port.dev;
+  struct pci_dev *up = job->link->up_port.dev;
+
+  job->pacc = margin_clone_access(pacc);
+  job->down = pci_get_dev(job->pacc, down->domain, down->bus, down->dev, down->func);
+  job->up = pci_get_dev(job->pacc, up->domain, up->bus, up->dev, up->func);
+  if (!margin_fill_link(job->down, job->up, &job->local))
+    {
+      char bdfs[64];
+      margin_gen_bdfs(down, up, bdfs, sizeof(bdfs));
+      die("Cannot access Link %s from a margining thread.\n", bdfs);
+    }
+
+  job->common = *job->link->args.common;
+  job->local.args = job->link->args;
+  job->local.args.common = &job->common;
+}
+
+static void
+margin_job_finish(struct margin_job *job)
+{
+  pthread_join(job->thread, NULL);
+
+  /* Hardware quirks may have adjusted the arguments, results are graded using them */
+  job->local.args.common = job->link->args.common;
+  job->link->args = job->local.args;
+
+  pci_free_dev(job->down);
+  pci_free_dev(job->up);
+  pci_cleanup(job->pacc);
+}
+
+static void *
+margin_job_run(void *arg)
+{
+  struct margin_job *job = arg;
+
+  margin_log_capture_start();
+  job->results = margin_test_link(&job->local, &job->results_n);
+  job->log = margin_log_capture_end();
+
+  pthread_mutex_lock(job->lock);
+  job->state = JOB_DONE;
+  pthread_cond_signal(job->done);
+  pthread_mutex_unlock(job->lock);
+  return NULL;
+}
+
+static void
+margin_log_progress(u8 verbosity, int done, int running, int waiting)
+{
+  if (verbosity > 0)
+    {
+      u64 eta = margin_progress_eta(NULL, NULL);
+      margin_log("\033[2K\rMargining Links - done: %d, in progress: %d, waiting: %d - Total ETA: %3dm %2ds",
+                 done, running, waiting, (int) (eta / 60), (int) (eta % 60));
+      fflush(stdout);
+    }
+}
+
+void
+margin_test_links_concurrently(struct pci_access *pacc, struct margin_link *links, u8 links_n,
+                               bool *run, struct margin_results **results, u8 *results_n)
+{
+  struct margin_com_args *com_args = links[0].args.common;
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+  struct margin_job *jobs = xmalloc(links_n * sizeof(*jobs));
+  int *running = xmalloc(links_n * sizeof(*running));
+  int *index = xmalloc(links_n * sizeof(*index));
+  int jobs_n = 0, finished = 0, in_progress = 0;
+
+  for (int i = 0; i < links_n; i++)
+    {
+      if (!run[i])
+        continue;
+      struct margin_job *job = &jobs[jobs_n];
+      struct pci_dev *down = links[i].down_port.dev;
+      memset(job, 0, sizeof(*job));
+      job->link = &links[i];
+      job->lock = &lock;
+      job->done = &done;
+      job->group = jobs_n;
+      for (int j = 0; j < jobs_n; j++)
+        if (jobs[j].link->down_port.dev->domain == down->domain
+            && jobs[j].link->down_port.dev->bus == down->bus)
+          {
+            job->group = jobs[j].group;
+            break;
+          }
+      running[jobs_n] = 0;
+      index[jobs_n] = i;
+      jobs_n++;
+    }
+
+  pthread_mutex_lock(&lock);
+  while (finished < jobs_n)
+    {
+      for (int j = 0; j < jobs_n; j++)
+        {
+          struct margin_job *job = &jobs[j];
+          if (job->state != JOB_WAITING || running[job->group] >= com_args->concurrent_links)
+            continue;
+          if (margin_interrupted)
+            {
+              job->state = JOB_FINISHED;
+              finished++;
+              continue;
+            }
+          margin_job_prepare(pacc, job);
+          job->state = JOB_RUNNING;
+          running[job->group]++;
+          in_progress++;
+          if (pthread_create(&job->thread, NULL, margin_job_run, job))
+            die("Cannot create margining thread.\n");
+        }
+      margin_log_progress(com_args->verbosity, finished, in_progress,
+                          jobs_n - finished - in_progress);
+
+      bool any_done = false;
+      while (!any_done && in_progress)
+        {
+          for (int j = 0; j < jobs_n && !any_done; j++)
+            any_done = jobs[j].state == JOB_DONE;
+          if (!any_done)
+            {
+              /* Refresh the ETA every second */
+              struct timespec ts;
+              clock_gettime(CLOCK_REALTIME, &ts);
+              ts.tv_sec++;
+              if (pthread_cond_timedwait(&done, &lock, &ts) == ETIMEDOUT)
+                margin_log_progress(com_args->verbosity, finished, in_progress,
+                                    jobs_n - finished - in_progress);
+            }
+        }
+
+      for (int j = 0; j < jobs_n; j++)
+        {
+          struct margin_job *job = &jobs[j];
+          if (job->state != JOB_DONE)
+            continue;
+          job->state = JOB_FINISHED;
+          running[job->group]--;
+          in_progress--;
+          finished++;
+
+          pthread_mutex_unlock(&lock);
+          margin_job_finish(job);
+          results[index[j]] = job->results;
+          results_n[index[j]] = job->results_n;
+          if (com_args->verbosity > 0)
+            margin_log("\033[2K\r");
+          fputs(job->log, stdout);
+          printf("\n----\n\n");
+          free(job->log);
+          pthread_mutex_lock(&lock);
+        }
+    }
+  pthread_mutex_unlock(&lock);
+
+  free(index);
+  free(running);
+  free(jobs);
+}
+
+#endif
@@ -245,6 +245,17 @@ do_show_vendor_caps(struct device *d, int where, int cap)
   return 0;
 }
 
+/* How much of a vendor-specific capability is read by its decoder */
+int
+plan_vendor_caps(struct device *d, int cap)
+{
+  if (d->dev->vendor_id == 0x1af4 &&
+      d->dev->device_id >= 0x1000 &&
+      d->dev->device_id <= 0x107f)
+    return BITS(cap, 0, 8);
+  return 4;
+}
+
 void
 show_vendor_caps(struct device *d, int where, int cap)
 {
@@ -1803,6 +1803,88 @@ static void cap_ea(struct device *d, int where, int cap)
   }
 }
 
+/*
+ *  Walk the capability chain without printing anything and record which parts
+ *  of each capability its decoder is going to read, so that they can be
+ *  prefetched together. This has to be kept in sync with the decoders above,
+ *  but if it is not, we only lose some efficiency.
+ */
+void
+plan_caps(struct device *d, struct config_plan *plan)
+{
+  int htype = get_conf_byte(d, PCI_HEADER_TYPE) & 0x7f;
+  int can_have_ext_caps = 0;
+  int type = -1;
+  byte been_there[256];
+  int where;
+
+  if (!(get_conf_word(d, PCI_STATUS) & PCI_STATUS_CAP_LIST))
+    return;
+  if (htype == PCI_HEADER_TYPE_NORMAL || htype == PCI_HEADER_TYPE_BRIDGE)
+    where = get_conf_byte(d, PCI_CAPABILITY_LIST) & ~3;
+  else if (htype == PCI_HEADER_TYPE_CARDBUS)
+    where = get_conf_byte(d, PCI_CB_CAPABILITY_LIST) & ~3;
+  else
+    return;
+
+  memset(been_there, 0, 256);
+  while (where && !been_there[where]++)
+    {
+      int id, cap, len;
+
+      if (!config_fetch(d, where, 4))
+	break;
+      id = get_conf_byte(d, where + PCI_CAP_LIST_ID);
+      cap = get_conf_word(d, where + PCI_CAP_FLAGS);
+      switch (id)
+	{
+	case PCI_CAP_ID_PM:
+	  len = PCI_PM_SIZEOF;
+	  break;
+	case PCI_CAP_ID_AGP:
+	  len = PCI_AGP_SIZEOF;
+	  break;
+	case PCI_CAP_ID_MSI:
+	  if (cap & PCI_MSI_FLAGS_64BIT)
+	    len = (cap & PCI_MSI_FLAGS_MASK_BIT) ? PCI_MSI_MASK_BIT_64 + 8 : PCI_MSI_DATA_64 + 2;
+	  else
+	    len = (cap & PCI_MSI_FLAGS_MASK_BIT) ? PCI_MSI_MASK_BIT_32 + 8 : PCI_MSI_DATA_32 + 2;
+	  break;
+	case PCI_CAP_ID_PCIX:
+	  len = (htype == PCI_HEADER_TYPE_BRIDGE) ? PCI_PCIX_BRIDGE_STATUS + 12 : PCI_PCIX_STATUS + 4;
+	  can_have_ext_caps = 1;
+	  break;
+	case PCI_CAP_ID_SSVID:
+	  len = 8;
+	  break;
+	case PCI_CAP_ID_VNDR:
+	  len = plan_vendor_caps(d, cap);
+	  break;
+	case PCI_CAP_ID_EXP:
+	  len = ((cap & PCI_EXP_FLAGS_VERS) < 2) ? PCI_EXP_DEVCAP + 32 : PCI_EXP_DEVCAP2 + 24;
+	  type = (cap & PCI_EXP_FLAGS_TYPE) >> 4;
+	  can_have_ext_caps = 1;
+	  break;
+	case PCI_CAP_ID_MSIX:
+	  len = PCI_MSIX_PBA + 4;
+	  break;
+	case PCI_CAP_ID_SATA:
+	  len = PCI_SATA_HBA_BARS + 4;
+	  break;
+	case PCI_CAP_ID_AF:
+	  len = PCI_AF_STATUS + 1;
+	  break;
+	default:
+	  len = 4;
+	}
+      if (cap_selected(PCI_CAP_NORMAL, id))
+	config_plan_add(plan, where, len);
+      where = get_conf_byte(d, where + PCI_CAP_LIST_NEXT) & ~3;
+    }
+  if (can_have_ext_caps)
+    plan_ext_caps(d, plan, type);
+}
+
 void
 show_caps(struct device *d, int where)
 {
@@ -1817,26 +1899,35 @@ show_caps(struct device *d, int where)
       while (where)
 	{
 	  int id, next, cap;
-	  printf("\tCapabilities: ");
 	  if (!config_fetch(d, where, 4))
 	    {
-	      puts("<access denied>");
+	      puts("\tCapabilities: <access denied>");
 	      break;
 	    }
 	  id = get_conf_byte(d, where + PCI_CAP_LIST_ID);
 	  next = get_conf_byte(d, where + PCI_CAP_LIST_NEXT) & ~3;
 	  cap = get_conf_word(d, where + PCI_CAP_FLAGS);
-	  printf("[%02x] ", where);
 	  if (been_there[where]++)
 	    {
-	      printf("<chain looped>\n");
+	      printf("\tCapabilities: [%02x] <chain looped>\n", where);
 	      break;
 	    }
 	  if (id == 0xff)
 	    {
-	      printf("<chain broken>\n");
+	      printf("\tCapabilities: [%02x] <chain broken>\n", where);
 	      break;
 	    }
+	  if (!cap_selected(PCI_CAP_NORMAL, id))
+	    {
+	      /* We still need to know if and where to look for extended capabilities */
+	      if (id == PCI_CAP_ID_EXP)
+		type = (cap & PCI_EXP_FLAGS_TYPE) >> 4;
+	      if (id == PCI_CAP_ID_EXP || id == PCI_CAP_ID_PCIX)
+		can_have_ext_caps = 1;
+	      where = next;
+	      continue;
+	    }
+	  printf("\tCapabilities: [%02x] ", where);
 	  switch (id)
 	    {
 	    case PCI_CAP_ID_NULL:
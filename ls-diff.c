@@ -0,0 +1,159 @@
+/*
+ *	The PCI Utilities -- Compare Config Space with a Dump
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "lspci.h"
+
+/*
+ *  Devices of the other dump are sorted by their address, so that we can
+ *  pair them with our devices by binary search even for huge fleets.
+ */
+
+static int
+diff_cmp_devs(const void *A, const void *B)
+{
+  const struct pci_dev *a = *(const struct pci_dev **) A;
+  const struct pci_dev *b = *(const struct pci_dev **) B;
+
+  if (a->domain != b->domain)
+    return (a->domain < b->domain) ? -1 : 1;
+  if (a->bus != b->bus)
+    return (a->bus < b->bus) ? -1 : 1;
+  if (a->dev != b->dev)
+    return (a->dev < b->dev) ? -1 : 1;
+  if (a->func != b->func)
+    return (a->func < b->func) ? -1 : 1;
+  return 0;
+}
+
+static int
+diff_find_dev(struct pci_dev **devs, int n, struct pci_dev *key)
+{
+  int lo = 0, hi = n;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      int c = diff_cmp_devs(&devs[mid], &key);
+      if (!c)
+	return mid;
+      if (c < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return -1;
+}
+
+/* Read as much of the other device's config space as available, up to len */
+static unsigned int
+diff_read_other(struct pci_dev *o, byte *buf, unsigned int len)
+{
+  static const unsigned int sizes[] = { 4096, 256, 128, 64, 0 };
+  int i;
+
+  for (i=0; sizes[i]; i++)
+    if (sizes[i] <= len && pci_read_block(o, 0, buf, sizes[i]))
+      return sizes[i];
+  return 0;
+}
+
+static void
+diff_show_dword(struct device *d, unsigned int pos, byte *old)
+{
+  struct pci_cap *cap = pci_find_cap_by_pos(d->dev, pos);
+  char namebuf[16];
+
+  show_slot_name(d);
+  if (cap)
+    printf(" %s@%03x", format_cap_name(cap->type, cap->id, namebuf), cap->addr);
+  else
+    printf(" header");
+  printf(" [%03x] %08x -> %08x\n", pos,
+	 old[pos] | (old[pos+1] << 8) | (old[pos+2] << 16) | ((u32) old[pos+3] << 24),
+	 get_conf_long(d, pos));
+}
+
+static void
+diff_device(struct device *d, struct pci_dev *o)
+{
+  static byte other[CONFIG_SPACE_SIZE];
+  struct pci_diff_range ranges[CONFIG_SPACE_SIZE / 8];
+  unsigned int len, olen;
+  int i, n;
+
+  len = fetch_hex_dump(d);
+  olen = diff_read_other(o, other, len);
+  if (olen < len)
+    len = olen;
+
+  n = pci_config_diff(other, d->config, len & ~3U, ranges, CONFIG_SPACE_SIZE / 8);
+  for (i=0; i<n; i++)
+    {
+      unsigned int pos;
+      for (pos = ranges[i].pos; pos < (unsigned int)(ranges[i].pos + ranges[i].len); pos += 4)
+	diff_show_dword(d, pos, other);
+    }
+}
+
+void
+show_diff(char *name)
+{
+  struct pci_access *other = pci_alloc();
+  struct pci_dev **odevs, *o;
+  char *matched;
+  struct device *d;
+  int n = 0, i;
+
+  other->error = die;
+  other->method = PCI_ACCESS_DUMP;
+  pci_set_param(other, "dump.name", name);
+  pci_init(other);
+  pci_scan_bus(other);
+
+  for (o = other->devices; o; o = o->next)
+    n++;
+  odevs = xmalloc((n + 1) * sizeof(*odevs));
+  matched = xmalloc(n + 1);
+  memset(matched, 0, n + 1);
+  for (i = 0, o = other->devices; o; o = o->next)
+    odevs[i++] = o;
+  qsort(odevs, n, sizeof(*odevs), diff_cmp_devs);
+
+  for (d=first_dev; d; d=d->next)
+    {
+      if (!pci_filter_match(&filter, d->dev))
+	continue;
+      i = diff_find_dev(odevs, n, d->dev);
+      if (i < 0)
+	{
+	  show_slot_name(d);
+	  printf(" added\n");
+	  continue;
+	}
+      matched[i] = 1;
+      if (!d->no_config_access)
+	diff_device(d, odevs[i]);
+    }
+
+  for (i=0; i<n; i++)
+    if (!matched[i] && pci_filter_match(&filter, odevs[i]))
+      {
+	o = odevs[i];
+	if (o->domain)
+	  printf("%04x:", o->domain);
+	printf("%02x:%02x.%d removed\n", o->bus, o->dev, o->func);
+      }
+
+  free(matched);
+  free(odevs);
+  pci_cleanup(other);
+}
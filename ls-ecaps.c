@@ -2356,6 +2356,119 @@ cap_flit_log(struct device *d, int where)
          PCI_FLIT_LOG_MES_STS10_LN15(mes_sts10));
 }
 
+void
+plan_ext_caps(struct device *d, struct config_plan *plan, int type)
+{
+  int where = 0x100;
+  char been_there[0x1000];
+  memset(been_there, 0, 0x1000);
+  do
+    {
+      u32 header;
+      int len;
+
+      if (!config_fetch(d, where, 4))
+	break;
+      header = get_conf_long(d, where);
+      if (!header || header == 0xffffffff || been_there[where]++)
+	break;
+      switch (header & 0xffff)
+	{
+	  case PCI_EXT_CAP_ID_AER:
+	    if (type == PCI_EXP_TYPE_ROOT_PORT || type == PCI_EXP_TYPE_ROOT_EC)
+	      len = PCI_ERR_ROOT_COMMAND + 12;
+	    else
+	      len = PCI_ERR_UNCOR_STATUS + 40;
+	    break;
+	  case PCI_EXT_CAP_ID_DPC:
+	    len = PCI_DPC_CAP + 8;
+	    break;
+	  case PCI_EXT_CAP_ID_VC:
+	  case PCI_EXT_CAP_ID_VC2:
+	    len = 0x1c;
+	    break;
+	  case PCI_EXT_CAP_ID_DSN:
+	  case PCI_EXT_CAP_ID_PTM:
+	    len = 12;
+	    break;
+	  case PCI_EXT_CAP_ID_RCLINK:
+	    len = PCI_RCLINK_LINK1;
+	    break;
+	  case PCI_EXT_CAP_ID_VNDR:
+	    len = PCI_EVNDR_HEADER + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_ACS:
+	    len = PCI_ACS_CAP + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_ARI:
+	    len = PCI_ARI_CAP + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_ATS:
+	    len = PCI_ATS_CAP + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_SRIOV:
+	    len = PCI_IOV_CAP + 0x3c;
+	    break;
+	  case PCI_EXT_CAP_ID_MCAST:
+	    len = PCI_MCAST_CAP + 0x30;
+	    break;
+	  case PCI_EXT_CAP_ID_PRI:
+	    len = PCI_PRI_CTRL + 0xc;
+	    break;
+	  case PCI_EXT_CAP_ID_TPH:
+	    len = PCI_TPH_CAPABILITIES + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_LTR:
+	    len = PCI_LTR_MAX_SNOOP + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_SECPCI:
+	    len = PCI_SEC_LNKCTL3 + 12;
+	    break;
+	  case PCI_EXT_CAP_ID_PASID:
+	    len = PCI_PASID_CAP + 4;
+	    break;
+	  case PCI_EXT_CAP_ID_L1PM:
+	    len = PCI_L1PM_SUBSTAT_CAP + 12;
+	    break;
+	  case PCI_EXT_CAP_ID_DVSEC:
+	    len = PCI_DVSEC_HEADER1 + 8;
+	    break;
+	  case PCI_EXT_CAP_ID_16GT:
+	    len = PCI_16GT_CAP + 0x18;
+	    break;
+	  case PCI_EXT_CAP_ID_LMR:
+	    len = 8;
+	    break;
+	  case PCI_EXT_CAP_ID_32GT:
+	    len = PCI_32GT_CAP + 0x1c;
+	    break;
+	  case PCI_EXT_CAP_ID_DOE:
+	    len = PCI_DOE_CAP + 0x14;
+	    break;
+	  case PCI_EXT_CAP_ID_IDE:
+	    len = PCI_IDE_CAP + 8;
+	    break;
+	  case PCI_EXT_CAP_ID_64GT:
+	    len = PCI_64GT_CAP + 0x0c;
+	    break;
+	  case PCI_EXT_CAP_ID_MMIO_RBL:
+	    len = PCI_MRBL_CAP + 0x0c;
+	    break;
+	  case PCI_EXT_CAP_ID_FLIT_EI:
+	    len = PCI_FLIT_EI_CAP + 32;
+	    break;
+	  case PCI_EXT_CAP_ID_FLIT_LOG:
+	    len = PCI_FLIT_LOG_ERR1 + 56;
+	    break;
+	  default:
+	    len = 4;
+	}
+      if (cap_selected(PCI_CAP_EXTENDED, header & 0xffff))
+	config_plan_add(plan, where, len);
+      where = (header >> 20) & ~3;
+    } while (where);
+}
+
 void
 show_ext_caps(struct device *d, int type)
 {
@@ -2374,6 +2487,11 @@ show_ext_caps(struct device *d, int type)
 	break;
       id = header & 0xffff;
       version = (header >> 16) & 0xf;
+      if (!cap_selected(PCI_CAP_EXTENDED, id) && !been_there[where]++)
+	{
+	  where = (header >> 20) & ~3;
+	  continue;
+	}
       printf("\tCapabilities: [%03x", where);
       if (verbose > 1)
 	printf(" v%d", version);
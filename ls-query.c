@@ -0,0 +1,173 @@
+/*
+ *	The PCI Utilities -- Query Individual Registers
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lspci.h"
+
+/*
+ *  Each queryable item is either a whole register (mask == 0), which is
+ *  printed in hex, or a bit field within it, which is printed in decimal.
+ *  Registers are addressed relative to the start of a capability, or
+ *  relative to the start of the config space if cap_type is 0.
+ */
+
+static const struct query_field query_fields[] = {
+  /* Standard header */
+  { "Vendor",		0, 0,				PCI_VENDOR_ID,		2, 0 },
+  { "Device",		0, 0,				PCI_DEVICE_ID,		2, 0 },
+  { "Command",		0, 0,				PCI_COMMAND,		2, 0 },
+  { "Status",		0, 0,				PCI_STATUS,		2, 0 },
+  { "Revision",		0, 0,				PCI_REVISION_ID,	1, 0 },
+  { "Class",		0, 0,				PCI_CLASS_DEVICE,	2, 0 },
+  /* Power Management */
+  { "PM.Ctl",		PCI_CAP_NORMAL, PCI_CAP_ID_PM,	PCI_PM_CTRL,		2, 0 },
+  { "PM.State",		PCI_CAP_NORMAL, PCI_CAP_ID_PM,	PCI_PM_CTRL,		2, PCI_PM_CTRL_STATE_MASK },
+  /* PCI Express */
+  { "DevCap",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCAP,		4, 0 },
+  { "DevCap.MPS",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCAP,		4, PCI_EXP_DEVCAP_PAYLOAD },
+  { "DevCtl",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCTL,		2, 0 },
+  { "DevCtl.MPS",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCTL,		2, PCI_EXP_DEVCTL_PAYLOAD },
+  { "DevCtl.MRRS",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCTL,		2, PCI_EXP_DEVCTL_READRQ },
+  { "DevSta",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVSTA,		2, 0 },
+  { "DevSta.CorrErr",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVSTA,		2, PCI_EXP_DEVSTA_CED },
+  { "DevSta.NonFatalErr", PCI_CAP_NORMAL, PCI_CAP_ID_EXP, PCI_EXP_DEVSTA,	2, PCI_EXP_DEVSTA_NFED },
+  { "DevSta.FatalErr",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVSTA,		2, PCI_EXP_DEVSTA_FED },
+  { "DevSta.UnsupReq",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVSTA,		2, PCI_EXP_DEVSTA_URD },
+  { "LnkCap",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCAP,		4, 0 },
+  { "LnkCap.Speed",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCAP,		4, PCI_EXP_LNKCAP_SPEED },
+  { "LnkCap.Width",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCAP,		4, PCI_EXP_LNKCAP_WIDTH },
+  { "LnkCap.Port",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCAP,		4, PCI_EXP_LNKCAP_PORT },
+  { "LnkCtl",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCTL,		2, 0 },
+  { "LnkCtl.ASPM",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCTL,		2, PCI_EXP_LNKCTL_ASPM },
+  { "LnkSta",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKSTA,		2, 0 },
+  { "LnkSta.Speed",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKSTA,		2, PCI_EXP_LNKSTA_SPEED },
+  { "LnkSta.Width",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKSTA,		2, PCI_EXP_LNKSTA_WIDTH },
+  { "LnkSta.Train",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKSTA,		2, PCI_EXP_LNKSTA_TRAIN },
+  { "SltCap",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_SLTCAP,		4, 0 },
+  { "SltCtl",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_SLTCTL,		2, 0 },
+  { "SltSta",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_SLTSTA,		2, 0 },
+  { "RootCtl",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_RTCTL,		2, 0 },
+  { "RootSta",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_RTSTA,		4, 0 },
+  { "DevCap2",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCAP2,	4, 0 },
+  { "DevCtl2",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_DEVCTL2,	2, 0 },
+  { "LnkCap2",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCAP2,	4, 0 },
+  { "LnkCtl2",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCTL2,	2, 0 },
+  { "LnkCtl2.Speed",	PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKCTL2,	2, 0x000f },
+  { "LnkSta2",		PCI_CAP_NORMAL, PCI_CAP_ID_EXP,	PCI_EXP_LNKSTA2,	2, 0 },
+  /* Advanced Error Reporting */
+  { "AER.UESta",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_STATUS,	4, 0 },
+  { "AER.UEMsk",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_MASK,	4, 0 },
+  { "AER.UESvrt",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_UNCOR_SEVER,	4, 0 },
+  { "AER.CESta",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_COR_STATUS,	4, 0 },
+  { "AER.CEMsk",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_COR_MASK,	4, 0 },
+  { "AER.AERCap",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_CAP,		4, 0 },
+  { "AER.RootCmd",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_ROOT_COMMAND,	4, 0 },
+  { "AER.RootSta",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_ROOT_STATUS,	4, 0 },
+  { "AER.ErrorSrc",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_AER, PCI_ERR_ROOT_COR_SRC,	4, 0 },
+  /* Downstream Port Containment */
+  { "DPC.Cap",		PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_DPC, PCI_DPC_CAP,	2, 0 },
+  { "DPC.Ctl",		PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_DPC, PCI_DPC_CTL,	2, 0 },
+  { "DPC.Sta",		PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_DPC, PCI_DPC_STATUS,	2, 0 },
+  { "DPC.SrcID",	PCI_CAP_EXTENDED, PCI_EXT_CAP_ID_DPC, PCI_DPC_SOURCE,	2, 0 },
+  { NULL, 0, 0, 0, 0, 0 }
+};
+
+static const struct query_field **query;
+static int query_count;
+
+static const struct query_field *
+query_find_field(char *name)
+{
+  const struct query_field *f;
+
+  for (f = query_fields; f->name; f++)
+    if (!strcasecmp(f->name, name))
+      return f;
+  return NULL;
+}
+
+char *
+query_parse(char *list)
+{
+  char *c;
+  const struct query_field *f;
+
+  for (c = strtok(list, ","); c; c = strtok(NULL, ","))
+    {
+      if (!(f = query_find_field(c)))
+	return c;
+      query = xrealloc(query, (query_count + 1) * sizeof(*query));
+      query[query_count++] = f;
+    }
+  return NULL;
+}
+
+static int
+query_read_field(struct device *d, const struct query_field *f, u32 *val)
+{
+  unsigned int base = 0;
+
+  if (d->no_config_access)
+    return -1;
+  if (f->cap_type)
+    {
+      struct pci_cap *cap = pci_find_cap(d->dev, f->cap_id, f->cap_type);
+      if (!cap)
+	return 0;
+      base = cap->addr;
+    }
+  if (!config_fetch(d, base + f->pos, f->width))
+    return -1;
+
+  switch (f->width)
+    {
+    case 1:
+      *val = get_conf_byte(d, base + f->pos);
+      break;
+    case 2:
+      *val = get_conf_word(d, base + f->pos);
+      break;
+    default:
+      *val = get_conf_long(d, base + f->pos);
+    }
+  if (f->mask)
+    *val = GET_REG_MASK(*val, f->mask);
+  return 1;
+}
+
+void
+show_query(struct device *d)
+{
+  int i;
+  u32 val;
+
+  show_slot_name(d);
+  for (i = 0; i < query_count; i++)
+    {
+      const struct query_field *f = query[i];
+
+      printf(" %s=", f->name);
+      switch (query_read_field(d, f, &val))
+	{
+	case 0:
+	  putchar('-');
+	  break;
+	case 1:
+	  if (f->mask)
+	    printf("%u", val);
+	  else
+	    printf("%0*x", 2 * f->width, val);
+	  break;
+	default:
+	  putchar('?');
+	}
+    }
+  putchar('\n');
+}
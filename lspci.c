@@ -12,9 +12,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "lspci.h"
 
+#ifdef PCI_COMPRESSED_IDS
+#include <zlib.h>
+#endif
+
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 /* Options */
 
 int verbose;				/* Show detailed information */
@@ -30,17 +42,52 @@ static int opt_kernel;			/* Show kernel drivers */
 static int opt_query_dns;		/* Query the DNS (0=disabled, 1=enabled, 2=refresh cache) */
 static int opt_query_all;		/* Query the DNS for all entries */
 char *opt_pcimap;			/* Override path to Linux modules.pcimap */
+static int opt_caps;			/* Decode only selected capabilities */
+static int opt_query;			/* Show only values of selected registers */
+static char *opt_snapshot;		/* Write a binary snapshot to this file */
+static char *opt_dump;			/* Write a hex dump to this file */
+static char *opt_diff;			/* Compare config space with this dump */
+static int opt_samples;			/* Number of samples to add to the snapshot */
+static int opt_interval = 1000;		/* Interval between samples [ms] */
+static int opt_changes;			/* Show changes recorded in a time series */
 
 const char program_name[] = "lspci";
 
 static char options[] = "nvbxs:d:tPi:mgp:qkMDQ" GENERIC_OPTIONS ;
 
+enum {
+  OPT_CAPS = 0x100,
+  OPT_QUERY,
+  OPT_SNAPSHOT,
+  OPT_DUMP,
+  OPT_SAMPLES,
+  OPT_CHANGES,
+  OPT_DIFF,
+};
+
+static const struct option long_options[] = {
+  { "caps", required_argument, NULL, OPT_CAPS },
+  { "query", required_argument, NULL, OPT_QUERY },
+  { "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+  { "dump", required_argument, NULL, OPT_DUMP },
+  { "samples", required_argument, NULL, OPT_SAMPLES },
+  { "changes", no_argument, NULL, OPT_CHANGES },
+  { "diff", required_argument, NULL, OPT_DIFF },
+  { NULL, 0, NULL, 0 }
+};
+
 static char help_msg[] =
 "Usage: lspci [<switches>]\n"
 "\n"
 "Basic display modes:\n"
 "-mm\t\tProduce machine-readable output (single -m for an obsolete format)\n"
 "-t\t\tShow bus tree\n"
+"--query=<list>\tShow only values of the given registers (e.g., LnkSta.Speed,AER.UESta)\n"
+"--snapshot=<file>\tWrite a binary snapshot of the devices to <file>\n"
+"--samples=<n>[,<ms>]\tWith --snapshot, append <n> samples taken every <ms> milliseconds\n"
+"--changes\tShow changes of config space recorded in a time series (use with -F)\n"
+"--diff=<file>\tShow differences of config space against a dump or snapshot\n"
+"--dump=<file>\tWrite a hex dump of the devices to <file> (compressed if it ends with .gz)\n"
 "\n"
 "Display options:\n"
 "-v\t\tBe verbose (-vv or -vvv for higher verbosity)\n"
@@ -54,6 +101,7 @@ static char help_msg[] =
 "-D\t\tAlways show domain numbers\n"
 "-P\t\tDisplay bridge path in addition to bus and device number\n"
 "-PP\t\tDisplay bus path in addition to bus and device number\n"
+"--caps=<list>\tDecode only the given capabilities (e.g., CAP_EXP,ECAP_AER)\n"
 "\n"
 "Resolving of device IDs to names:\n"
 "-n\t\tShow numeric IDs\n"
@@ -86,57 +134,173 @@ struct device *first_dev;
 static int seen_errors;
 static int need_topology;
 
+/*
+ *  Config space buffers live until the program exits, so we allocate them
+ *  from a simple arena instead of calling malloc() for each of them.
+ */
+
+#define CONFIG_ARENA_SIZE 65536
+
+#ifdef PCI_HAVE_PTHREADS
+static pthread_mutex_t config_arena_lock = PTHREAD_MUTEX_INITIALIZER;	/* Prefetch threads grow buffers, too */
+#endif
+
+static byte *
+config_alloc(unsigned int size)
+{
+  static byte *arena;
+  static unsigned int arena_left;
+  byte *buf;
+
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_lock(&config_arena_lock);
+#endif
+  if (size > arena_left)
+    {
+      arena_left = (size > CONFIG_ARENA_SIZE) ? size : CONFIG_ARENA_SIZE;
+      arena = xmalloc(arena_left);
+    }
+  buf = arena;
+  arena += size;
+  arena_left -= size;
+#ifdef PCI_HAVE_PTHREADS
+  pthread_mutex_unlock(&config_arena_lock);
+#endif
+  return buf;
+}
+
+static void
+config_resize(struct device *d, unsigned int size)
+{
+  byte *buf;
+
+  /* Config spaces come in only three sizes, so we grow directly to the next one */
+  if (size <= 64)
+    size = 64;
+  else if (size <= 256)
+    size = 256;
+  else
+    size = CONFIG_SPACE_SIZE;
+
+  buf = config_alloc(size);
+  if (d->config_bufsize)
+    memcpy(buf, d->config, d->config_bufsize);
+  d->config = buf;
+  d->config_bufsize = size;
+  pci_setup_cache(d->dev, d->config, d->dev->cache_len);
+}
+
+static inline int
+config_dword_present(struct device *d, unsigned int dw)
+{
+  return d->present[dw / 32] & (1U << (dw % 32));
+}
+
+static void
+config_mark_present(struct device *d, unsigned int first, unsigned int last)
+{
+  while (first <= last)
+    {
+      d->present[first / 32] |= 1U << (first % 32);
+      first++;
+    }
+}
+
 int
 config_fetch(struct device *d, unsigned int pos, unsigned int len)
 {
-  unsigned int end = pos+len;
-  int result;
+  unsigned int first, last;
 
-  while (pos < d->config_bufsize && len && d->present[pos])
-    pos++, len--;
-  while (pos+len <= d->config_bufsize && len && d->present[pos+len-1])
-    len--;
   if (!len)
     return 1;
+  if (pos + len > CONFIG_SPACE_SIZE)
+    return 0;
+
+  /* Presence is tracked per dword, so we always fetch whole dwords */
+  first = pos / 4;
+  last = (pos + len - 1) / 4;
+  while (first <= last && config_dword_present(d, first))
+    first++;
+  while (first <= last && config_dword_present(d, last))
+    last--;
+  if (first > last)
+    return 1;
+
+  if (4*(last+1) > d->config_bufsize)
+    config_resize(d, 4*(last+1));
+  if (!pci_read_block(d->dev, 4*first, d->config + 4*first, 4*(last-first+1)))
+    return 0;
+  config_mark_present(d, first, last);
+  return 1;
+}
+
+void
+config_plan_add(struct config_plan *plan, unsigned int pos, unsigned int len)
+{
+  unsigned int dw;
+
+  if (!len || pos + len > CONFIG_SPACE_SIZE)
+    return;
+  for (dw = pos / 4; dw <= (pos + len - 1) / 4; dw++)
+    plan->wanted[dw / 32] |= 1U << (dw % 32);
+}
 
-  if (end > d->config_bufsize)
+void
+config_plan_fetch(struct device *d, struct config_plan *plan)
+{
+  unsigned int dw = 0, start;
+
+  /*
+   *  Each maximal run of dwords which are either wanted or already present
+   *  is fetched by a single read (config_fetch() trims the present dwords
+   *  at both ends). We never read dwords nobody asked for. If a read fails,
+   *  we just leave the dwords alone and let the decoders fetch them one by
+   *  one as usual.
+   */
+  while (dw < CONFIG_SPACE_SIZE / 4)
     {
-      int orig_size = d->config_bufsize;
-      while (end > d->config_bufsize)
-	d->config_bufsize *= 2;
-      d->config = xrealloc(d->config, d->config_bufsize);
-      d->present = xrealloc(d->present, d->config_bufsize);
-      memset(d->present + orig_size, 0, d->config_bufsize - orig_size);
-      pci_setup_cache(d->dev, d->config, d->dev->cache_len);
+      if (!(plan->wanted[dw / 32] & (1U << (dw % 32))))
+	{
+	  dw++;
+	  continue;
+	}
+      start = dw;
+      while (dw < CONFIG_SPACE_SIZE / 4 &&
+	     ((plan->wanted[dw / 32] & (1U << (dw % 32))) || config_dword_present(d, dw)))
+	dw++;
+      config_fetch(d, 4*start, 4*(dw-start));
     }
-  result = pci_read_block(d->dev, pos, d->config + pos, len);
-  if (result)
-    memset(d->present + pos, 1, len);
-  return result;
 }
 
 struct device *
 scan_device(struct pci_dev *p)
 {
   struct device *d;
+  int match;
 
   if (p->domain && !opt_domains)
     opt_domains = 1;
-  if (!pci_filter_match(&filter, p) && !need_topology)
+  match = pci_filter_match(&filter, p);
+  if (!match && !need_topology)
     return NULL;
   d = xmalloc(sizeof(struct device));
   memset(d, 0, sizeof(*d));
   d->dev = p;
   d->no_config_access = p->no_config_access;
-  d->config_cached = d->config_bufsize = 64;
-  d->config = xmalloc(64);
-  d->present = xmalloc(64);
-  memset(d->present, 1, 64);
-  if (!d->no_config_access && !pci_read_block(p, 0, d->config, 64))
+  d->config_cached = 64;
+  /* Allocate as much as we are likely going to need to avoid growing the buffer later */
+  if (match && opt_hex >= 4)
+    config_resize(d, CONFIG_SPACE_SIZE);
+  else if (match && (opt_hex >= 3 || verbose > 1))
+    config_resize(d, 256);
+  else
+    config_resize(d, 64);
+  if (!d->no_config_access && pci_read_block(p, 0, d->config, 64))
+    config_mark_present(d, 0, 64/4 - 1);
+  else
     {
       d->no_config_access = 1;
-      d->config_cached = d->config_bufsize = 0;
-      memset(d->present, 0, 64);
+      d->config_cached = 0;
     }
   if (!d->no_config_access && (d->config[PCI_HEADER_TYPE] & 0x7f) == PCI_HEADER_TYPE_CARDBUS)
     {
@@ -150,6 +314,67 @@ scan_device(struct pci_dev *p)
   return d;
 }
 
+/*
+ *  Prefetching: Before anything gets printed, we fetch everything the output
+ *  phase is going to need for the selected devices. Each device is read in as
+ *  few large block reads as possible, which is considerably cheaper than many
+ *  small reads on back-ends where every access is a system call.
+ */
+
+#define FILL_VERBOSE (PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES |	\
+    PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP |		\
+    PCI_FILL_BRIDGE_BASES | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | PCI_FILL_RCD_LNK)
+#define FILL_MACHINE (PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP)
+
+unsigned int
+fetch_hex_dump(struct device *d)
+{
+  unsigned int cnt = d->config_cached;
+
+  if (opt_hex >= 3 && config_fetch(d, cnt, 256-cnt))
+    {
+      cnt = 256;
+      if (opt_hex >= 4 && config_fetch(d, 256, 4096-256))
+	cnt = 4096;
+    }
+  return cnt;
+}
+
+static void
+prefetch_info(struct device *d)
+{
+  struct pci_dev *p = d->dev;
+
+  if (opt_machine)
+    {
+      if (verbose)
+	pci_fill_info(p, FILL_MACHINE);
+    }
+  else if (verbose)
+    pci_fill_info(p, FILL_VERBOSE);
+}
+
+static int
+prefetch_wants_config(struct device *d)
+{
+  return !d->no_config_access && (opt_hex || (verbose > 1 && !opt_machine));
+}
+
+static void
+prefetch_config(struct device *d)
+{
+  if (opt_hex)
+    fetch_hex_dump(d);
+
+  if (verbose > 1 && !opt_machine)
+    {
+      struct config_plan plan;
+      memset(&plan, 0, sizeof(plan));
+      plan_caps(d, &plan);
+      config_plan_fetch(d, &plan);
+    }
+}
+
 static void
 scan_devices(void)
 {
@@ -165,16 +390,296 @@ scan_devices(void)
       }
 }
 
+#ifdef PCI_HAVE_PTHREADS
+
+/*
+ *  With back-ends where every config read is a system call, config spaces
+ *  of larger sets of devices are fetched by several threads. Each thread reads
+ *  through its own pci_access (see pci_alloc() in pci.h) and its own pci_dev
+ *  for the device, but the data land in the device's buffers. Other properties
+ *  are still filled in by the main thread.
+ */
+
+#define PREFETCH_MAX_THREADS 8
+#define PREFETCH_DEVS_PER_THREAD 16
+
+struct prefetch_thread {
+  pthread_t thread;
+  struct pci_access *acc;
+};
+
+static struct device **prefetch_queue;
+static int prefetch_queue_len, prefetch_next;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+prefetch_thread(void *arg)
+{
+  struct prefetch_thread *t = arg;
+  struct device *d;
+  struct pci_dev *p, *q;
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&prefetch_lock);
+      i = prefetch_next++;
+      pthread_mutex_unlock(&prefetch_lock);
+      if (i >= prefetch_queue_len)
+	break;
+
+      d = prefetch_queue[i];
+      p = d->dev;
+      q = pci_get_dev(t->acc, p->domain, p->bus, p->dev, p->func);
+      q->vendor_id = p->vendor_id;	/* Needed by plan_vendor_caps() */
+      q->device_id = p->device_id;
+      d->dev = q;
+      prefetch_config(d);
+      d->dev = p;
+      pci_free_dev(q);
+    }
+  return NULL;
+}
+
+static int
+prefetch_parallel(void)
+{
+  struct prefetch_thread *threads;
+  struct pci_param *par = NULL;
+  struct device *d;
+  int n = 0, threads_n, i;
+
+  if (pacc->method != PCI_ACCESS_SYS_BUS_PCI && pacc->method != PCI_ACCESS_PROC_BUS_PCI)
+    return 0;
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&filter, d->dev) && prefetch_wants_config(d))
+      n++;
+  threads_n = n / PREFETCH_DEVS_PER_THREAD;
+  if (threads_n > PREFETCH_MAX_THREADS)
+    threads_n = PREFETCH_MAX_THREADS;
+  if (threads_n < 2)
+    return 0;
+
+  prefetch_queue = xmalloc(n * sizeof(struct device *));
+  prefetch_queue_len = 0;
+  prefetch_next = 0;
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&filter, d->dev) && prefetch_wants_config(d))
+      prefetch_queue[prefetch_queue_len++] = d;
+
+  threads = xmalloc(threads_n * sizeof(struct prefetch_thread));
+  for (i=0; i<threads_n; i++)
+    {
+      struct pci_access *a = pci_alloc();
+      a->method = pacc->method;
+      a->debugging = pacc->debugging;
+      while (par = pci_walk_params(pacc, par))
+	pci_set_param(a, par->param, par->value);
+      pci_init(a);
+      threads[i].acc = a;
+    }
+  for (i=0; i<threads_n; i++)
+    if (pthread_create(&threads[i].thread, NULL, prefetch_thread, &threads[i]))
+      die("Cannot create prefetch thread");
+  for (i=0; i<threads_n; i++)
+    {
+      pthread_join(threads[i].thread, NULL);
+      pci_cleanup(threads[i].acc);
+    }
+
+  /* Buffers might have moved while growing */
+  for (i=0; i<prefetch_queue_len; i++)
+    {
+      d = prefetch_queue[i];
+      pci_setup_cache(d->dev, d->config, d->dev->cache_len);
+    }
+
+  free(threads);
+  free(prefetch_queue);
+  return 1;
+}
+
+#else
+
+static int
+prefetch_parallel(void)
+{
+  return 0;
+}
+
+#endif
+
+static void
+prefetch_devices(void)
+{
+  struct device *d;
+  int parallel = prefetch_parallel();
+
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&filter, d->dev))
+      {
+	prefetch_info(d);
+	if (!parallel && prefetch_wants_config(d))
+	  prefetch_config(d);
+      }
+}
+
+/*** Selection of capabilities ***/
+
+static const struct cap_name {
+  const char *name;
+  int type, id;
+} cap_names[] = {
+  { "CAP_PM",		PCI_CAP_NORMAL,		PCI_CAP_ID_PM },
+  { "CAP_AGP",		PCI_CAP_NORMAL,		PCI_CAP_ID_AGP },
+  { "CAP_VPD",		PCI_CAP_NORMAL,		PCI_CAP_ID_VPD },
+  { "CAP_SLOTID",	PCI_CAP_NORMAL,		PCI_CAP_ID_SLOTID },
+  { "CAP_MSI",		PCI_CAP_NORMAL,		PCI_CAP_ID_MSI },
+  { "CAP_CHSWP",	PCI_CAP_NORMAL,		PCI_CAP_ID_CHSWP },
+  { "CAP_PCIX",		PCI_CAP_NORMAL,		PCI_CAP_ID_PCIX },
+  { "CAP_HT",		PCI_CAP_NORMAL,		PCI_CAP_ID_HT },
+  { "CAP_VNDR",		PCI_CAP_NORMAL,		PCI_CAP_ID_VNDR },
+  { "CAP_DBG",		PCI_CAP_NORMAL,		PCI_CAP_ID_DBG },
+  { "CAP_CCRC",		PCI_CAP_NORMAL,		PCI_CAP_ID_CCRC },
+  { "CAP_HOTPLUG",	PCI_CAP_NORMAL,		PCI_CAP_ID_HOTPLUG },
+  { "CAP_SSVID",	PCI_CAP_NORMAL,		PCI_CAP_ID_SSVID },
+  { "CAP_AGP3",		PCI_CAP_NORMAL,		PCI_CAP_ID_AGP3 },
+  { "CAP_SECURE",	PCI_CAP_NORMAL,		PCI_CAP_ID_SECURE },
+  { "CAP_EXP",		PCI_CAP_NORMAL,		PCI_CAP_ID_EXP },
+  { "CAP_MSIX",		PCI_CAP_NORMAL,		PCI_CAP_ID_MSIX },
+  { "CAP_SATA",		PCI_CAP_NORMAL,		PCI_CAP_ID_SATA },
+  { "CAP_AF",		PCI_CAP_NORMAL,		PCI_CAP_ID_AF },
+  { "CAP_EA",		PCI_CAP_NORMAL,		PCI_CAP_ID_EA },
+  { "ECAP_AER",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_AER },
+  { "ECAP_VC",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_VC },
+  { "ECAP_DSN",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DSN },
+  { "ECAP_PB",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_PB },
+  { "ECAP_RCLINK",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_RCLINK },
+  { "ECAP_RCILINK",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_RCILINK },
+  { "ECAP_RCEC",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_RCEC },
+  { "ECAP_MFVC",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_MFVC },
+  { "ECAP_VC2",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_VC2 },
+  { "ECAP_RCRB",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_RCRB },
+  { "ECAP_VNDR",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_VNDR },
+  { "ECAP_ACS",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_ACS },
+  { "ECAP_ARI",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_ARI },
+  { "ECAP_ATS",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_ATS },
+  { "ECAP_SRIOV",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_SRIOV },
+  { "ECAP_MRIOV",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_MRIOV },
+  { "ECAP_MCAST",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_MCAST },
+  { "ECAP_PRI",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_PRI },
+  { "ECAP_REBAR",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_REBAR },
+  { "ECAP_DPA",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DPA },
+  { "ECAP_TPH",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_TPH },
+  { "ECAP_LTR",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_LTR },
+  { "ECAP_SECPCI",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_SECPCI },
+  { "ECAP_PMUX",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_PMUX },
+  { "ECAP_PASID",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_PASID },
+  { "ECAP_LNR",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_LNR },
+  { "ECAP_DPC",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DPC },
+  { "ECAP_L1PM",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_L1PM },
+  { "ECAP_PTM",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_PTM },
+  { "ECAP_M_PCIE",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_M_PCIE },
+  { "ECAP_FRS",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_FRS },
+  { "ECAP_RTR",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_RTR },
+  { "ECAP_DVSEC",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DVSEC },
+  { "ECAP_VF_REBAR",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_VF_REBAR },
+  { "ECAP_DLNK",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DLNK },
+  { "ECAP_16GT",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_16GT },
+  { "ECAP_LMR",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_LMR },
+  { "ECAP_HIER_ID",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_HIER_ID },
+  { "ECAP_NPEM",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_NPEM },
+  { "ECAP_32GT",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_32GT },
+  { "ECAP_DOE",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DOE },
+  { "ECAP_IDE",		PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_IDE },
+  { "ECAP_64GT",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_64GT },
+  { "ECAP_DEV3",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_DEV3 },
+  { "ECAP_MMIO_RBL",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_MMIO_RBL },
+  { "ECAP_FLIT_EI",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_FLIT_EI },
+  { "ECAP_FLIT_LOG",	PCI_CAP_EXTENDED,	PCI_EXT_CAP_ID_FLIT_LOG },
+  { NULL, 0, 0 }
+};
+
+static u32 caps_selected[256 / 32];
+static u32 ext_caps_selected[0x1000 / 32];
+
+static char *
+parse_cap_selection(char *list)
+{
+  char *c, *end;
+  const struct cap_name *n;
+  unsigned long id;
+
+  for (c = strtok(list, ","); c; c = strtok(NULL, ","))
+    {
+      for (n = cap_names; n->name; n++)
+	if (!strcasecmp(n->name, c))
+	  break;
+      if (n->name)
+	{
+	  if (n->type == PCI_CAP_NORMAL)
+	    caps_selected[n->id / 32] |= 1U << (n->id % 32);
+	  else
+	    ext_caps_selected[n->id / 32] |= 1U << (n->id % 32);
+	}
+      else if (!strncasecmp(c, "ECAP", 4))
+	{
+	  id = strtoul(c+4, &end, 16);
+	  if (end == c+4 || *end || id >= 0x1000)
+	    return c;
+	  ext_caps_selected[id / 32] |= 1U << (id % 32);
+	}
+      else if (!strncasecmp(c, "CAP", 3))
+	{
+	  id = strtoul(c+3, &end, 16);
+	  if (end == c+3 || *end || id >= 0x100)
+	    return c;
+	  caps_selected[id / 32] |= 1U << (id % 32);
+	}
+      else
+	return c;
+    }
+  return NULL;
+}
+
+int
+cap_selected(int type, int id)
+{
+  if (!opt_caps)
+    return 1;
+  if (type == PCI_CAP_NORMAL)
+    return id < 0x100 && (caps_selected[id / 32] & (1U << (id % 32)));
+  else
+    return id < 0x1000 && (ext_caps_selected[id / 32] & (1U << (id % 32)));
+}
+
+const char *
+format_cap_name(int type, int id, char *buf)
+{
+  const struct cap_name *n;
+
+  for (n = cap_names; n->name; n++)
+    if (n->type == type && n->id == id)
+      return n->name;
+  sprintf(buf, (type == PCI_CAP_NORMAL) ? "CAP%02x" : "ECAP%03x", id);
+  return buf;
+}
+
 /*** Config space accesses ***/
 
 static void
 check_conf_range(struct device *d, unsigned int pos, unsigned int len)
 {
-  while (len)
-    if (!d->present[pos])
+  unsigned int dw, last;
+
+  if (!len)
+    return;
+  if (pos + len > CONFIG_SPACE_SIZE)
+    die("Internal bug: Accessing configuration byte at position %x beyond config space", pos);
+  last = (pos + len - 1) / 4;
+  for (dw = pos / 4; dw <= last; dw++)
+    if (!config_dword_present(d, dw))
       die("Internal bug: Accessing non-read configuration byte at position %x", pos);
-    else
-      pos++, len--;
 }
 
 byte
@@ -278,7 +783,7 @@ show_slot_path(struct device *d)
   printf("%02x:%02x.%d", p->bus, p->dev, p->func);
 }
 
-static void
+void
 show_slot_name(struct device *d)
 {
   struct pci_dev *p = d->dev;
@@ -880,9 +1385,7 @@ show_verbose(struct device *d)
 
   show_terse(d);
 
-  pci_fill_info(p, PCI_FILL_IRQ | PCI_FILL_BASES | PCI_FILL_ROM_BASE | PCI_FILL_SIZES |
-    PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP |
-    PCI_FILL_BRIDGE_BASES | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS | PCI_FILL_RCD_LNK);
+  pci_fill_info(p, FILL_VERBOSE);
 
   switch (htype)
     {
@@ -1041,10 +1544,46 @@ show_verbose(struct device *d)
 
 /*** Machine-readable dumps ***/
 
+/*
+ *  Formatting of hex dumps is on the critical path when dumping many devices
+ *  with -xxxx, so we avoid calling printf() for every byte and format whole
+ *  rows of 16 bytes to a buffer, which is then written at once. The format
+ *  must stay exactly the same, since the dump back-end of libpci parses it.
+ */
+
+#define HEX_DUMP_ROW_SIZE (4 + 16*3 + 1)
+
+static unsigned int
+format_hex_dump(byte *config, unsigned int cnt, char *buf)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned int i, j;
+  char *c = buf;
+
+  for (i=0; i<cnt; i+=16)
+    {
+      if (i >= 0x100)
+	*c++ = hex[i >> 8];
+      *c++ = hex[(i >> 4) & 15];
+      *c++ = hex[i & 15];
+      *c++ = ':';
+      for (j=0; j<16; j++)
+	{
+	  byte b = config[i+j];
+	  *c++ = ' ';
+	  *c++ = hex[b >> 4];
+	  *c++ = hex[b & 15];
+	}
+      *c++ = '\n';
+    }
+  return c - buf;
+}
+
 static void
 show_hex_dump(struct device *d)
 {
-  unsigned int i, cnt;
+  static char buf[CONFIG_SPACE_SIZE / 16 * HEX_DUMP_ROW_SIZE];
+  unsigned int cnt, len;
 
   if (d->no_config_access)
     {
@@ -1052,22 +1591,10 @@ show_hex_dump(struct device *d)
       return;
     }
 
-  cnt = d->config_cached;
-  if (opt_hex >= 3 && config_fetch(d, cnt, 256-cnt))
-    {
-      cnt = 256;
-      if (opt_hex >= 4 && config_fetch(d, 256, 4096-256))
-	cnt = 4096;
-    }
-
-  for (i=0; i<cnt; i++)
-    {
-      if (! (i & 15))
-	printf("%02x:", i);
-      printf(" %02x", get_conf_byte(d, i));
-      if ((i & 15) == 15)
-	putchar('\n');
-    }
+  cnt = fetch_hex_dump(d);
+  check_conf_range(d, 0, cnt);
+  len = format_hex_dump(d->config, cnt, buf);
+  fwrite(buf, 1, len, stdout);
 }
 
 static void
@@ -1092,7 +1619,7 @@ show_machine(struct device *d)
 
   if (verbose)
     {
-      pci_fill_info(p, PCI_FILL_PHYS_SLOT | PCI_FILL_NUMA_NODE | PCI_FILL_DT_NODE | PCI_FILL_IOMMU_GROUP);
+      pci_fill_info(p, FILL_MACHINE);
       printf((opt_machine >= 2) ? "Slot:\t" : "Device:\t");
       show_slot_name(d);
       putchar('\n');
@@ -1176,7 +1703,175 @@ show(void)
 
   for (d=first_dev; d; d=d->next)
     if (pci_filter_match(&filter, d->dev))
-      show_device(d);
+      {
+	if (opt_query)
+	  show_query(d);
+	else
+	  show_device(d);
+      }
+}
+
+static void
+sleep_ms(unsigned int ms)
+{
+  struct timespec ts;
+
+  /* Unlike usleep(), nanosleep() accepts whole seconds */
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+}
+
+static void
+write_snapshot(void)
+{
+  struct pci_snapshot *s = pci_snapshot_create(pacc, opt_snapshot);
+  struct device *d;
+  int i;
+
+  /* Devices whose config space cannot be read are left out, as in hex dumps */
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&filter, d->dev) && !d->no_config_access)
+      {
+	unsigned int cnt = fetch_hex_dump(d);
+	check_conf_range(d, 0, cnt);
+	pci_snapshot_add(s, d->dev, d->config, cnt);
+	d->config_sampled = cnt;
+      }
+
+  /* Samples re-read the same part of config space, bypassing the cache */
+  for (i=0; i<opt_samples; i++)
+    {
+      struct timeval tv;
+
+      sleep_ms(opt_interval);
+      gettimeofday(&tv, NULL);
+      pci_snapshot_new_sample(s, tv.tv_sec, tv.tv_usec);
+      for (d=first_dev; d; d=d->next)
+	if (pci_filter_match(&filter, d->dev) && d->config_sampled)
+	  {
+	    pci_setup_cache(d->dev, NULL, 0);
+	    if (pci_read_block(d->dev, 0, d->config, d->config_sampled))
+	      pci_snapshot_add(s, d->dev, d->config, d->config_sampled);
+	  }
+    }
+  pci_snapshot_close(s);
+}
+
+static void
+show_changes(void)
+{
+  struct pci_series_change ch;
+  struct device *d;
+
+  if (!pci_series_samples(pacc))
+    die("--changes: No time series found (use -F with a snapshot taken by --samples)");
+  for (d=first_dev; d; d=d->next)
+    if (pci_filter_match(&filter, d->dev))
+      {
+	memset(&ch, 0, sizeof(ch));
+	while (pci_series_next_change(d->dev, -1, &ch))
+	  {
+	    show_slot_name(d);
+	    printf(" %d %u.%06u [%03x] %08x -> %08x\n", ch.sample, ch.time_sec, ch.time_usec, ch.pos, ch.old_value, ch.new_value);
+	  }
+      }
+}
+
+/*
+ *  Hex dumps written to a file, possibly compressed. Only the device address,
+ *  numeric IDs and the config space are written, which is all that -F needs.
+ */
+
+struct dump_output {
+  FILE *file;
+#ifdef PCI_COMPRESSED_IDS
+  gzFile gz;
+#endif
+};
+
+static void
+dump_output_open(struct dump_output *out, char *name)
+{
+  size_t len = strlen(name);
+
+  memset(out, 0, sizeof(*out));
+  if (len > 3 && !strcmp(name + len - 3, ".gz"))
+    {
+#ifdef PCI_COMPRESSED_IDS
+      if (!(out->gz = gzopen(name, "wb")))
+	die("Cannot create %s", name);
+#else
+      die("--dump: Compressed output is not supported by this build");
+#endif
+    }
+  else if (!strcmp(name, "-"))
+    out->file = stdout;
+  else if (!(out->file = fopen(name, "w")))
+    die("Cannot create %s: %m", name);
+}
+
+static void
+dump_output_write(struct dump_output *out, char *buf, unsigned int len)
+{
+#ifdef PCI_COMPRESSED_IDS
+  if (out->gz)
+    {
+      if (gzwrite(out->gz, buf, len) != (int) len)
+	die("Error writing %s", opt_dump);
+      return;
+    }
+#endif
+  fwrite(buf, 1, len, out->file);
+}
+
+static void
+dump_output_close(struct dump_output *out)
+{
+#ifdef PCI_COMPRESSED_IDS
+  if (out->gz)
+    {
+      if (gzclose(out->gz) != Z_OK)
+	die("Error writing %s", opt_dump);
+      return;
+    }
+#endif
+  if (fflush(out->file) || ferror(out->file) || out->file != stdout && fclose(out->file))
+    die("Error writing %s: %m", opt_dump);
+}
+
+static void
+write_dump(void)
+{
+  static char buf[64 + CONFIG_SPACE_SIZE / 16 * HEX_DUMP_ROW_SIZE];
+  struct dump_output out;
+  struct device *d;
+
+  dump_output_open(&out, opt_dump);
+  for (d=first_dev; d; d=d->next)
+    {
+      struct pci_dev *p = d->dev;
+      unsigned int len = 0, cnt;
+
+      if (!pci_filter_match(&filter, p))
+	continue;
+      if (p->domain)
+	len += sprintf(buf, "%04x:", p->domain);
+      len += sprintf(buf + len, "%02x:%02x.%d %04x: %04x:%04x", p->bus, p->dev, p->func, p->device_class, p->vendor_id, p->device_id);
+      if (p->rev_id)
+	len += sprintf(buf + len, " (rev %02x)", p->rev_id);
+      buf[len++] = '\n';
+      if (!d->no_config_access)
+	{
+	  cnt = fetch_hex_dump(d);
+	  check_conf_range(d, 0, cnt);
+	  len += format_hex_dump(d->config, cnt, buf + len);
+	}
+      buf[len++] = '\n';
+      dump_output_write(&out, buf, len);
+    }
+  dump_output_close(&out);
 }
 
 /* Main */
@@ -1197,7 +1892,7 @@ main(int argc, char **argv)
   pacc->error = die;
   pci_filter_init(pacc, &filter);
 
-  while ((i = getopt(argc, argv, options)) != -1)
+  while ((i = getopt_long(argc, argv, options, long_options, NULL)) != -1)
     switch (i)
       {
       case 'n':
@@ -1254,6 +1949,35 @@ main(int argc, char **argv)
       case 'D':
 	opt_domains = 2;
 	break;
+      case OPT_CAPS:
+	if (msg = parse_cap_selection(optarg))
+	  die("--caps: Unknown capability \"%s\"", msg);
+	opt_caps = 1;
+	break;
+      case OPT_QUERY:
+	if (msg = query_parse(optarg))
+	  die("--query: Unknown register \"%s\"", msg);
+	opt_query = 1;
+	break;
+      case OPT_SNAPSHOT:
+	opt_snapshot = optarg;
+	break;
+      case OPT_DUMP:
+	opt_dump = optarg;
+	break;
+      case OPT_SAMPLES:
+	opt_samples = strtol(optarg, &msg, 10);
+	if (*msg == ',')
+	  opt_interval = strtol(msg+1, &msg, 10);
+	if (*msg || opt_samples < 0 || opt_interval < 0)
+	  die("--samples: Invalid argument");
+	break;
+      case OPT_CHANGES:
+	opt_changes = 1;
+	break;
+      case OPT_DIFF:
+	opt_diff = optarg;
+	break;
 #ifdef PCI_USE_DNS
       case 'q':
 	opt_query_dns++;
@@ -1284,6 +2008,18 @@ main(int argc, char **argv)
     }
   if (opt_query_all)
     pacc->id_lookup_mode |= PCI_LOOKUP_NETWORK | PCI_LOOKUP_SKIP_LOCAL;
+  if (opt_query && (opt_tree || opt_machine || opt_map_mode))
+    die("--query cannot be combined with -t, -m or -M");
+  if ((opt_snapshot || opt_dump) && (opt_tree || opt_machine || opt_map_mode || opt_query))
+    die("--snapshot and --dump cannot be combined with -t, -m, -M or --query");
+  if (opt_snapshot && opt_dump)
+    die("--snapshot and --dump cannot be used together");
+  if (opt_samples && !opt_snapshot)
+    die("--samples can be used only with --snapshot");
+  if ((opt_changes || opt_diff) && (opt_tree || opt_machine || opt_map_mode || opt_query || opt_snapshot || opt_dump))
+    die("--changes and --diff cannot be combined with other display modes");
+  if (opt_changes && opt_diff)
+    die("--changes and --diff cannot be used together");
 
   pci_init(pacc);
   if (opt_map_mode)
@@ -1295,11 +2031,21 @@ main(int argc, char **argv)
   else
     {
       scan_devices();
+      if (!opt_tree && !opt_query && !opt_snapshot && !opt_dump && !opt_changes && !opt_diff)
+	prefetch_devices();
       sort_them();
       if (need_topology)
 	grow_tree();
       if (opt_tree)
 	show_forest(opt_filter ? &filter : NULL);
+      else if (opt_snapshot)
+	write_snapshot();
+      else if (opt_dump)
+	write_dump();
+      else if (opt_changes)
+	show_changes();
+      else if (opt_diff)
+	show_diff(opt_diff);
       else
 	show();
     }
@@ -33,6 +33,8 @@ extern char *opt_pcimap;
 
 /*** PCI devices and access to their config space ***/
 
+#define CONFIG_SPACE_SIZE 4096
+
 struct device {
   struct device *next;
   struct pci_dev *dev;
@@ -43,8 +45,9 @@ struct device {
   /* Cache */
   int no_config_access;
   unsigned int config_cached, config_bufsize;
+  unsigned int config_sampled;		/* Length of config space saved by --snapshot */
   byte *config;				/* Cached configuration space data */
-  byte *present;			/* Maps which configuration bytes are present */
+  u32 present[CONFIG_SPACE_SIZE / 4 / 32];	/* Bitmap of configuration dwords which are present */
 };
 
 extern struct device *first_dev;
@@ -52,12 +55,25 @@ extern struct pci_access *pacc;
 
 struct device *scan_device(struct pci_dev *p);
 void show_device(struct device *d);
+void show_slot_name(struct device *d);
 
 int config_fetch(struct device *d, unsigned int pos, unsigned int len);
+
+/* Planning of prefetches: collect the ranges we want, then fetch them in as few reads as possible */
+struct config_plan {
+  u32 wanted[CONFIG_SPACE_SIZE / 4 / 32];	/* Bitmap of configuration dwords we are going to need */
+};
+
+void config_plan_add(struct config_plan *plan, unsigned int pos, unsigned int len);
+void config_plan_fetch(struct device *d, struct config_plan *plan);
 u32 get_conf_long(struct device *d, unsigned int pos);
 word get_conf_word(struct device *d, unsigned int pos);
 byte get_conf_byte(struct device *d, unsigned int pos);
 
+int cap_selected(int type, int id);
+const char *format_cap_name(int type, int id, char *buf);
+unsigned int fetch_hex_dump(struct device *d);
+
 /* ls-vpd.c */
 
 void cap_vpd(struct device *d);
@@ -65,14 +81,34 @@ void cap_vpd(struct device *d);
 /* ls-caps.c */
 
 void show_caps(struct device *d, int where);
+void plan_caps(struct device *d, struct config_plan *plan);
 
 /* ls-ecaps.c */
 
 void show_ext_caps(struct device *d, int type);
+void plan_ext_caps(struct device *d, struct config_plan *plan, int type);
 
 /* ls-caps-vendor.c */
 
 void show_vendor_caps(struct device *d, int where, int cap);
+int plan_vendor_caps(struct device *d, int cap);
+
+/* ls-query.c */
+
+struct query_field {
+  const char *name;
+  int cap_type;				/* PCI_CAP_xxx or 0 for the standard header */
+  int cap_id;
+  unsigned int pos, width;		/* Register position relative to the capability and its width in bytes */
+  u32 mask;				/* Bit field within the register, 0 for the whole register */
+};
+
+char *query_parse(char *list);
+void show_query(struct device *d);
+
+/* ls-diff.c */
+
+void show_diff(char *name);
 
 /* ls-kernel.c */
 
@@ -0,0 +1,941 @@
+/*
+ *	The PCI Utilities -- Index of Configuration Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL v2+.
+ *
+ *	SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pciutils.h"
+
+#ifdef PCI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+const char program_name[] = "pciindex";
+
+/*
+ *  The index is a column store: each column holds one value per device,
+ *  packed to the width of the column, so a query touches only the columns
+ *  it refers to and never goes back to the dumps.
+ *
+ *  File layout (all numbers are little-endian):
+ *
+ *	header		magic "PCIINDX\x1a", u32 version, u32 rows, u32 columns,
+ *			u32 offset and u32 size of the host name table
+ *	directory	for each column: char name[16], u32 width, u32 offset
+ *	column data	aligned to 4 bytes
+ *	host names	NUL-terminated strings, the Host column holds offsets
+ *
+ *  Columns are looked up by name, so readers skip columns they do not
+ *  know and treat missing ones as zero.
+ */
+
+#define INDEX_MAGIC "PCIINDX\x1a"
+#define INDEX_VERSION 1
+#define INDEX_HDR_SIZE 28
+#define INDEX_DIR_SIZE 24
+
+enum {
+  COL_HOST, COL_DOMAIN, COL_BUS, COL_DEV, COL_FUNC, COL_FLAGS,
+  COL_VENDOR, COL_DEVICE, COL_SUBVENDOR, COL_SUBDEVICE,
+  COL_CLASS, COL_PROGIF, COL_REV,
+  COL_DEVCAP, COL_DEVCTL, COL_LNKCAP, COL_LNKSTA,
+  COL_UEMSK, COL_UESVRT, COL_CEMSK,
+  NUM_COLS
+};
+
+#define IDX_HAS_EXP 1			/* Bits of the Flags column */
+#define IDX_HAS_AER 2
+
+static const struct {
+  const char *name;
+  unsigned int width;
+} columns[NUM_COLS] = {
+  { "Host",		4 },
+  { "Domain",		4 },
+  { "Bus",		1 },
+  { "Dev",		1 },
+  { "Func",		1 },
+  { "Flags",		1 },
+  { "Vendor",		2 },
+  { "Device",		2 },
+  { "SubVendor",	2 },
+  { "SubDevice",	2 },
+  { "Class",		2 },
+  { "ProgIf",		1 },
+  { "Revision",		1 },
+  { "DevCap",		4 },
+  { "DevCtl",		2 },
+  { "LnkCap",		4 },
+  { "LnkSta",		2 },
+  { "AER.UEMsk",	4 },
+  { "AER.UESvrt",	4 },
+  { "AER.CEMsk",	4 },
+};
+
+/*
+ *  Fields which can be queried. Whole registers are printed and parsed
+ *  in hex, bit fields in decimal, the same way as by `lspci --query'.
+ */
+
+struct field {
+  const char *name;
+  int col;
+  u32 mask;				/* Bit field within the column, 0 for the whole value */
+  int digits;				/* Number of hex digits to print, 0 for decimal */
+  int need;				/* IDX_HAS_xxx flags the value depends on */
+};
+
+static const struct field fields[] = {
+  { "Host",		COL_HOST,	0,				0, 0 },
+  { "Domain",		COL_DOMAIN,	0,				4, 0 },
+  { "Bus",		COL_BUS,	0,				2, 0 },
+  { "Dev",		COL_DEV,	0,				2, 0 },
+  { "Func",		COL_FUNC,	0,				1, 0 },
+  { "Vendor",		COL_VENDOR,	0,				4, 0 },
+  { "Device",		COL_DEVICE,	0,				4, 0 },
+  { "SubVendor",	COL_SUBVENDOR,	0,				4, 0 },
+  { "SubDevice",	COL_SUBDEVICE,	0,				4, 0 },
+  { "Class",		COL_CLASS,	0,				4, 0 },
+  { "ProgIf",		COL_PROGIF,	0,				2, 0 },
+  { "Revision",		COL_REV,	0,				2, 0 },
+  { "DevCap",		COL_DEVCAP,	0,				8, IDX_HAS_EXP },
+  { "DevCap.MPS",	COL_DEVCAP,	PCI_EXP_DEVCAP_PAYLOAD,		0, IDX_HAS_EXP },
+  { "DevCtl",		COL_DEVCTL,	0,				4, IDX_HAS_EXP },
+  { "DevCtl.MPS",	COL_DEVCTL,	PCI_EXP_DEVCTL_PAYLOAD,		0, IDX_HAS_EXP },
+  { "DevCtl.MRRS",	COL_DEVCTL,	PCI_EXP_DEVCTL_READRQ,		0, IDX_HAS_EXP },
+  { "LnkCap",		COL_LNKCAP,	0,				8, IDX_HAS_EXP },
+  { "LnkCap.Speed",	COL_LNKCAP,	PCI_EXP_LNKCAP_SPEED,		0, IDX_HAS_EXP },
+  { "LnkCap.Width",	COL_LNKCAP,	PCI_EXP_LNKCAP_WIDTH,		0, IDX_HAS_EXP },
+  { "LnkSta",		COL_LNKSTA,	0,				4, IDX_HAS_EXP },
+  { "LnkSta.Speed",	COL_LNKSTA,	PCI_EXP_LNKSTA_SPEED,		0, IDX_HAS_EXP },
+  { "LnkSta.Width",	COL_LNKSTA,	PCI_EXP_LNKSTA_WIDTH,		0, IDX_HAS_EXP },
+  { "AER.UEMsk",	COL_UEMSK,	0,				8, IDX_HAS_AER },
+  { "AER.UESvrt",	COL_UESVRT,	0,				8, IDX_HAS_AER },
+  { "AER.CEMsk",	COL_CEMSK,	0,				8, IDX_HAS_AER },
+  { NULL,		0,		0,				0, 0 }
+};
+
+struct index {
+  u32 rows, max_rows;
+  u8 *data[NUM_COLS];			/* Column values, NULL if the column is missing */
+  unsigned int width[NUM_COLS];
+  char *names;				/* Host name table */
+  u32 names_size, names_max;
+  void *file;				/* Buffer holding a loaded index */
+};
+
+static inline u32
+col_get(struct index *ix, int col, u32 row)
+{
+  u8 *p = ix->data[col];
+
+  if (!p)
+    return 0;
+  switch (ix->width[col])
+    {
+    case 1:
+      return p[row];
+    case 2:
+      return le16_to_cpu(((u16 *) p)[row]);
+    default:
+      return le32_to_cpu(((u32 *) p)[row]);
+    }
+}
+
+/*** Building ***/
+
+/*
+ *  While an index is being built, all columns are kept as arrays
+ *  of 32-bit values, they are packed when the index is written.
+ */
+
+static void
+index_init(struct index *ix)
+{
+  int c;
+
+  memset(ix, 0, sizeof(*ix));
+  for (c = 0; c < NUM_COLS; c++)
+    ix->width[c] = 4;
+}
+
+static void
+index_add_row(struct index *ix, u32 *val)
+{
+  int c;
+
+  if (ix->rows >= ix->max_rows)
+    {
+      ix->max_rows = ix->max_rows ? 2 * ix->max_rows : 256;
+      for (c = 0; c < NUM_COLS; c++)
+	ix->data[c] = xrealloc(ix->data[c], ix->max_rows * 4);
+    }
+  for (c = 0; c < NUM_COLS; c++)
+    ((u32 *) ix->data[c])[ix->rows] = cpu_to_le32(val[c]);
+  ix->rows++;
+}
+
+static u32
+index_add_name(struct index *ix, const char *name, unsigned int len)
+{
+  u32 pos = ix->names_size;
+
+  if (ix->names_size + len + 1 > ix->names_max)
+    {
+      ix->names_max = 2 * (ix->names_size + len + 1) + 256;
+      ix->names = xrealloc(ix->names, ix->names_max);
+    }
+  memcpy(ix->names + pos, name, len);
+  ix->names[pos + len] = 0;
+  ix->names_size += len + 1;
+  return pos;
+}
+
+/* The host is named after the dump file, without directories and .gz */
+static u32
+index_add_host(struct index *ix, const char *file)
+{
+  const char *base = file, *c;
+  unsigned int len;
+
+  for (c = file; *c; c++)
+    if (*c == '/')
+      base = c + 1;
+  len = strlen(base);
+  if (len > 3 && !strcmp(base + len - 3, ".gz"))
+    len -= 3;
+  return index_add_name(ix, base, len);
+}
+
+static void
+index_dump(struct index *ix, char *file)
+{
+  struct pci_access *a = pci_alloc();
+  struct pci_dev *d;
+  struct pci_cap *cap;
+  u32 val[NUM_COLS], host;
+
+  a->method = PCI_ACCESS_DUMP;
+  pci_set_param(a, "dump.name", file);
+  pci_init(a);
+  pci_scan_bus(a);
+  host = index_add_host(ix, file);
+
+  for (d = a->devices; d; d = d->next)
+    {
+      memset(val, 0, sizeof(val));
+      pci_fill_info(d, PCI_FILL_IDENT | PCI_FILL_CLASS | PCI_FILL_CLASS_EXT | PCI_FILL_SUBSYS |
+		    PCI_FILL_CAPS | PCI_FILL_EXT_CAPS);
+      val[COL_HOST] = host;
+      val[COL_DOMAIN] = d->domain;
+      val[COL_BUS] = d->bus;
+      val[COL_DEV] = d->dev;
+      val[COL_FUNC] = d->func;
+      val[COL_VENDOR] = d->vendor_id;
+      val[COL_DEVICE] = d->device_id;
+      val[COL_SUBVENDOR] = d->subsys_vendor_id;
+      val[COL_SUBDEVICE] = d->subsys_id;
+      val[COL_CLASS] = d->device_class;
+      val[COL_PROGIF] = d->prog_if;
+      val[COL_REV] = d->rev_id;
+
+      if (cap = pci_find_cap(d, PCI_CAP_ID_EXP, PCI_CAP_NORMAL))
+	{
+	  val[COL_FLAGS] |= IDX_HAS_EXP;
+	  val[COL_DEVCAP] = pci_read_long(d, cap->addr + PCI_EXP_DEVCAP);
+	  val[COL_DEVCTL] = pci_read_word(d, cap->addr + PCI_EXP_DEVCTL);
+	  val[COL_LNKCAP] = pci_read_long(d, cap->addr + PCI_EXP_LNKCAP);
+	  val[COL_LNKSTA] = pci_read_word(d, cap->addr + PCI_EXP_LNKSTA);
+	}
+      if (cap = pci_find_cap(d, PCI_EXT_CAP_ID_AER, PCI_CAP_EXTENDED))
+	{
+	  val[COL_FLAGS] |= IDX_HAS_AER;
+	  val[COL_UEMSK] = pci_read_long(d, cap->addr + PCI_ERR_UNCOR_MASK);
+	  val[COL_UESVRT] = pci_read_long(d, cap->addr + PCI_ERR_UNCOR_SEVER);
+	  val[COL_CEMSK] = pci_read_long(d, cap->addr + PCI_ERR_COR_MASK);
+	}
+      index_add_row(ix, val);
+    }
+
+  pci_cleanup(a);
+}
+
+static void
+put_u32(u8 *p, u32 x)
+{
+  *(u32 *) p = cpu_to_le32(x);
+}
+
+static void
+index_write(struct index *ix, char *name)
+{
+  u8 hdr[INDEX_HDR_SIZE + NUM_COLS * INDEX_DIR_SIZE], *buf, *p;
+  u32 off, size[NUM_COLS], r;
+  FILE *f;
+  int c;
+
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, INDEX_MAGIC, 8);
+  put_u32(hdr + 8, INDEX_VERSION);
+  put_u32(hdr + 12, ix->rows);
+  put_u32(hdr + 16, NUM_COLS);
+  off = sizeof(hdr);
+  for (c = 0; c < NUM_COLS; c++)
+    {
+      p = hdr + INDEX_HDR_SIZE + c * INDEX_DIR_SIZE;
+      strcpy((char *) p, columns[c].name);
+      put_u32(p + 16, columns[c].width);
+      put_u32(p + 20, off);
+      size[c] = (ix->rows * columns[c].width + 3) & ~3U;
+      off += size[c];
+    }
+  put_u32(hdr + 20, off);
+  put_u32(hdr + 24, ix->names_size);
+
+  if (!(f = fopen(name, "wb")))
+    die("Cannot create %s: %m", name);
+  fwrite(hdr, sizeof(hdr), 1, f);
+  buf = xmalloc(ix->rows * 4 + 4);
+  for (c = 0; c < NUM_COLS; c++)
+    {
+      memset(buf, 0, size[c]);
+      for (r = 0; r < ix->rows; r++)
+	{
+	  u32 x = col_get(ix, c, r);
+	  switch (columns[c].width)
+	    {
+	    case 1:
+	      buf[r] = x;
+	      break;
+	    case 2:
+	      ((u16 *) buf)[r] = cpu_to_le16(x);
+	      break;
+	    default:
+	      ((u32 *) buf)[r] = cpu_to_le32(x);
+	    }
+	}
+      fwrite(buf, size[c], 1, f);
+    }
+  fwrite(ix->names, ix->names_size, 1, f);
+  free(buf);
+  if (ferror(f) || fclose(f))
+    die("Error writing %s", name);
+}
+
+/*** Loading ***/
+
+static u32
+get_u32(u8 *p)
+{
+  return le32_to_cpu(*(u32 *) p);
+}
+
+static void
+index_load(struct index *ix, char *name)
+{
+  FILE *f;
+  u8 *buf, *p;
+  long size;
+  u32 ncols, off, width, i;
+  int c;
+
+  memset(ix, 0, sizeof(*ix));
+  if (!(f = fopen(name, "rb")))
+    die("Cannot open %s: %m", name);
+  if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+    die("Cannot determine size of %s: %m", name);
+  buf = xmalloc(size + 1);
+  if (fread(buf, 1, size, f) != (size_t) size)
+    die("Error reading %s", name);
+  fclose(f);
+  ix->file = buf;
+
+  if (size < INDEX_HDR_SIZE || memcmp(buf, INDEX_MAGIC, 8))
+    die("%s: Not a PCI index", name);
+  if (get_u32(buf + 8) != INDEX_VERSION)
+    die("%s: Unsupported index version %u", name, get_u32(buf + 8));
+  ix->rows = ix->max_rows = get_u32(buf + 12);
+  ncols = get_u32(buf + 16);
+  off = get_u32(buf + 20);
+  ix->names_size = ix->names_max = get_u32(buf + 24);
+  if (ncols > (size - INDEX_HDR_SIZE) / INDEX_DIR_SIZE ||
+      off > size || ix->names_size > size - off ||
+      ix->names_size && buf[off + ix->names_size - 1])
+    die("%s: Index is corrupted", name);
+  ix->names = (char *) buf + off;
+
+  for (i = 0; i < ncols; i++)
+    {
+      p = buf + INDEX_HDR_SIZE + i * INDEX_DIR_SIZE;
+      width = get_u32(p + 16);
+      off = get_u32(p + 20);
+      if (width != 1 && width != 2 && width != 4 || off % 4 ||
+	  off > size || (u64) ix->rows * width > (u64) (size - off))
+	die("%s: Index is corrupted", name);
+      for (c = 0; c < NUM_COLS; c++)
+	if (!strncmp((char *) p, columns[c].name, 16))
+	  {
+	    ix->data[c] = buf + off;
+	    ix->width[c] = width;
+	  }
+    }
+
+  for (i = 0; i < ix->rows; i++)
+    if (col_get(ix, COL_HOST, i) >= ix->names_size)
+      die("%s: Index is corrupted", name);
+}
+
+static void
+index_free(struct index *ix)
+{
+  int c;
+
+  if (ix->file)
+    free(ix->file);
+  else
+    {
+      for (c = 0; c < NUM_COLS; c++)
+	free(ix->data[c]);
+      free(ix->names);
+    }
+}
+
+/*** Merging ***/
+
+/* Append all rows of another index, loaded or being built */
+static void
+index_append(struct index *ix, struct index *in)
+{
+  u32 val[NUM_COLS], base, r;
+  int c;
+
+  base = ix->names_size;
+  if (in->names_size)
+    {
+      index_add_name(ix, in->names, in->names_size - 1);
+      ix->names_size = base + in->names_size;
+    }
+  for (r = 0; r < in->rows; r++)
+    {
+      for (c = 0; c < NUM_COLS; c++)
+	val[c] = col_get(in, c, r);
+      val[COL_HOST] += base;
+      index_add_row(ix, val);
+    }
+}
+
+static void
+index_merge(struct index *ix, char *name)
+{
+  struct index in;
+
+  index_load(&in, name);
+  index_append(ix, &in);
+  index_free(&in);
+}
+
+/*** Building in parallel ***/
+
+/*
+ *  Every dump is read through its own pci_access (see pci_alloc() in pci.h),
+ *  so several threads can parse dumps at once. Each dump gets a partial index
+ *  of its own and the partial indices are appended in the order the dumps
+ *  were given, so the result does not depend on the number of threads.
+ */
+
+#define MAX_THREADS 64
+
+static int num_threads = 1;
+
+#ifdef PCI_HAVE_PTHREADS
+
+static char **build_dumps;
+static struct index *build_parts;
+static int build_n, build_next;
+static pthread_mutex_t build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+build_thread(void *arg UNUSED)
+{
+  int i;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&build_lock);
+      i = build_next++;
+      pthread_mutex_unlock(&build_lock);
+      if (i >= build_n)
+	break;
+      index_init(&build_parts[i]);
+      index_dump(&build_parts[i], build_dumps[i]);
+    }
+  return NULL;
+}
+
+static void
+index_build(struct index *ix, char **dumps, int n)
+{
+  pthread_t threads[MAX_THREADS];
+  int t, nt = (num_threads < n) ? num_threads : n, i;
+
+  if (nt < 2)
+    {
+      for (i = 0; i < n; i++)
+	index_dump(ix, dumps[i]);
+      return;
+    }
+
+  build_dumps = dumps;
+  build_parts = xmalloc(n * sizeof(struct index));
+  build_n = n;
+  build_next = 0;
+  for (t = 0; t < nt; t++)
+    if (pthread_create(&threads[t], NULL, build_thread, NULL))
+      die("Cannot create thread");
+  for (t = 0; t < nt; t++)
+    pthread_join(threads[t], NULL);
+
+  for (i = 0; i < n; i++)
+    {
+      index_append(ix, &build_parts[i]);
+      index_free(&build_parts[i]);
+    }
+  free(build_parts);
+}
+
+#else
+
+static void
+index_build(struct index *ix, char **dumps, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    index_dump(ix, dumps[i]);
+}
+
+#endif
+
+/*** Queries ***/
+
+static struct index ix;
+
+static const struct field *
+find_field(char *name)
+{
+  const struct field *f;
+
+  for (f = fields; f->name; f++)
+    if (!strcasecmp(f->name, name))
+      return f;
+  return NULL;
+}
+
+/* Returns 0 if the field is not present in the given row */
+static inline int
+field_get(const struct field *f, u32 row, u32 *val)
+{
+  if (f->need && !(col_get(&ix, COL_FLAGS, row) & f->need))
+    return 0;
+  *val = col_get(&ix, f->col, row);
+  if (f->mask)
+    *val = GET_REG_MASK(*val, f->mask);
+  return 1;
+}
+
+static void
+show_field(const struct field *f, u32 row)
+{
+  u32 val;
+
+  if (!field_get(f, row, &val))
+    fputs("-", stdout);
+  else if (f->col == COL_HOST)
+    fputs(ix.names + val, stdout);
+  else if (f->digits)
+    printf("%0*x", f->digits, val);
+  else
+    printf("%u", val);
+}
+
+enum cond_op { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE };
+
+struct cond {
+  const struct field *left, *right;	/* Right side is either a field, or... */
+  u32 value;				/* ... a constant */
+  enum cond_op op;
+};
+
+static struct cond *conds;
+static int num_conds;
+static const struct field **shown, **grouped;
+static int num_shown, num_grouped;
+
+static const struct field **
+parse_field_list(char *list, const struct field **fl, int *num)
+{
+  char *c;
+  const struct field *f;
+
+  for (c = strtok(list, ","); c; c = strtok(NULL, ","))
+    {
+      if (!(f = find_field(c)))
+	die("Unknown field %s", c);
+      fl = xrealloc(fl, (*num + 1) * sizeof(*fl));
+      fl[(*num)++] = f;
+    }
+  return fl;
+}
+
+/* Host names are resolved only after the index is loaded, so keep the text */
+static char **cond_text;
+
+static void
+parse_conds(char *list)
+{
+  char *c;
+
+  for (c = strtok(list, ","); c; c = strtok(NULL, ","))
+    {
+      cond_text = xrealloc(cond_text, (num_conds + 1) * sizeof(*cond_text));
+      cond_text[num_conds++] = c;
+    }
+}
+
+static u32
+find_host(char *name)
+{
+  u32 pos = 0;
+
+  while (pos < ix.names_size)
+    {
+      if (!strcmp(ix.names + pos, name))
+	return pos;
+      pos += strlen(ix.names + pos) + 1;
+    }
+  return ~0U;
+}
+
+static void
+compile_cond(char *text, struct cond *cd)
+{
+  static const char * const ops[] = { "=", "!=", "<", "<=", ">", ">=" };
+  char *c = text + strcspn(text, "=!<>");
+  char *rhs, *end, saved = *c;
+  int i;
+
+  *c = 0;
+  cd->left = find_field(text);
+  *c = saved;
+  if (!saved || !cd->left)
+    die("Invalid condition %s", text);
+  rhs = c + strspn(c, "=!<>");
+  saved = *rhs;
+  *rhs = 0;
+  for (i = 0; i < (int) (sizeof(ops) / sizeof(ops[0])); i++)
+    if (!strcmp(c, ops[i]))
+      break;
+  *rhs = saved;
+  if (i >= (int) (sizeof(ops) / sizeof(ops[0])))
+    die("Invalid operator in condition %s", text);
+  cd->op = i;
+
+  if (cd->left->col == COL_HOST)
+    {
+      if (cd->op != OP_EQ && cd->op != OP_NE)
+	die("Host names can be compared only for equality");
+      cd->value = find_host(rhs);
+      return;
+    }
+  if (cd->right = find_field(rhs))
+    {
+      if (cd->right->col == COL_HOST)
+	die("Host names cannot be compared with numbers");
+      return;
+    }
+  cd->value = strtoul(rhs, &end, cd->left->digits ? 16 : 10);
+  if (!*rhs || *end)
+    die("Invalid value in condition %s", text);
+}
+
+/* Filter the selected rows by a single condition, one column at a time */
+static u32
+apply_cond(struct cond *cd, u32 *sel, u32 n)
+{
+  u32 i, out = 0, x, y;
+
+  for (i = 0; i < n; i++)
+    {
+      u32 r = sel[i];
+      if (!field_get(cd->left, r, &x))
+	continue;
+      if (cd->right)
+	{
+	  if (!field_get(cd->right, r, &y))
+	    continue;
+	}
+      else
+	y = cd->value;
+      switch (cd->op)
+	{
+	case OP_EQ: if (x != y) continue; break;
+	case OP_NE: if (x == y) continue; break;
+	case OP_LT: if (x >= y) continue; break;
+	case OP_LE: if (x > y) continue; break;
+	case OP_GT: if (x <= y) continue; break;
+	case OP_GE: if (x < y) continue; break;
+	}
+      sel[out++] = r;
+    }
+  return out;
+}
+
+static int
+compare_keys(u32 a, u32 b)
+{
+  u32 x, y;
+  int i, hx, hy;
+
+  for (i = 0; i < num_grouped; i++)
+    {
+      hx = field_get(grouped[i], a, &x);
+      hy = field_get(grouped[i], b, &y);
+      if (hx != hy)
+	return hx - hy;
+      if (!hx)
+	continue;
+      if (grouped[i]->col == COL_HOST && x != y)
+	return strcmp(ix.names + x, ix.names + y);
+      if (x != y)
+	return (x < y) ? -1 : 1;
+    }
+  return 0;
+}
+
+static int
+compare_groups(const void *A, const void *B)
+{
+  u32 a = *(const u32 *) A, b = *(const u32 *) B;
+  int res = compare_keys(a, b);
+
+  if (res)
+    return res;
+  return (a < b) ? -1 : (a > b) ? 1 : 0;
+}
+
+struct group {
+  u32 row, count;
+};
+
+static int
+compare_counts(const void *A, const void *B)
+{
+  const struct group *a = A, *b = B;
+
+  if (a->count != b->count)
+    return (a->count > b->count) ? -1 : 1;
+  return (a->row < b->row) ? -1 : 1;
+}
+
+static void
+show_groups(u32 *sel, u32 n)
+{
+  struct group *g = xmalloc((n + 1) * sizeof(*g));
+  u32 i, ng = 0;
+  int j;
+
+  /* Rows are already sorted by the group key, so groups are contiguous */
+  for (i = 0; i < n; i++)
+    {
+      if (!i || compare_keys(sel[i-1], sel[i]))
+	g[ng++] = (struct group) { sel[i], 0 };
+      g[ng-1].count++;
+    }
+  qsort(g, ng, sizeof(*g), compare_counts);
+
+  for (i = 0; i < ng; i++)
+    {
+      printf("%8u", g[i].count);
+      for (j = 0; j < num_grouped; j++)
+	{
+	  printf(" %s=", grouped[j]->name);
+	  show_field(grouped[j], g[i].row);
+	}
+      putchar('\n');
+    }
+  free(g);
+}
+
+static void
+show_rows(u32 *sel, u32 n)
+{
+  u32 i, r;
+  int j;
+
+  for (i = 0; i < n; i++)
+    {
+      r = sel[i];
+      printf("%s %04x:%02x:%02x.%d", ix.names + col_get(&ix, COL_HOST, r),
+	     col_get(&ix, COL_DOMAIN, r), col_get(&ix, COL_BUS, r),
+	     col_get(&ix, COL_DEV, r), col_get(&ix, COL_FUNC, r));
+      for (j = 0; j < num_shown; j++)
+	{
+	  printf(" %s=", shown[j]->name);
+	  show_field(shown[j], r);
+	}
+      putchar('\n');
+    }
+}
+
+static void
+query(char *name)
+{
+  u32 *sel, n, i;
+  int j;
+
+  index_load(&ix, name);
+  conds = xmalloc((num_conds + 1) * sizeof(*conds));
+  memset(conds, 0, (num_conds + 1) * sizeof(*conds));
+  for (j = 0; j < num_conds; j++)
+    compile_cond(cond_text[j], &conds[j]);
+
+  sel = xmalloc((ix.rows + 1) * sizeof(*sel));
+  for (i = 0; i < ix.rows; i++)
+    sel[i] = i;
+  n = ix.rows;
+  for (j = 0; j < num_conds && n; j++)
+    n = apply_cond(&conds[j], sel, n);
+
+  if (num_grouped)
+    {
+      qsort(sel, n, sizeof(*sel), compare_groups);
+      show_groups(sel, n);
+    }
+  else
+    show_rows(sel, n);
+  free(sel);
+}
+
+/*** Main ***/
+
+static void NONRET
+usage(void)
+{
+  fprintf(stderr,
+"Usage: pciindex build [-j <threads>] <index> <dump>...\n"
+"       pciindex merge <index> <index>...\n"
+"       pciindex query [<options>] <index>\n"
+"       pciindex fields\n"
+"\n"
+"Build options:\n"
+"-j <threads>\tParse up to <threads> dumps at once (default: number of CPUs)\n"
+"\n"
+"Query options:\n"
+"-w <cond>,...\tSelect only devices satisfying all conditions (<field><op><value|field>)\n"
+"-s <field>,...\tShow the given fields of each selected device\n"
+"-g <field>,...\tCount selected devices grouped by the given fields\n"
+"-V\t\tShow program version\n");
+  exit(1);
+}
+
+static void
+default_threads(void)
+{
+#if defined(PCI_HAVE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n > 1)
+    num_threads = (n < MAX_THREADS) ? n : MAX_THREADS;
+#endif
+}
+
+static void
+list_fields(void)
+{
+  const struct field *f;
+
+  for (f = fields; f->name; f++)
+    printf("%s\n", f->name);
+}
+
+int
+main(int argc, char **argv)
+{
+  struct index out;
+  char *end;
+  int i;
+
+  if (argc == 2 && !strcmp(argv[1], "--version") || argc == 2 && !strcmp(argv[1], "-V"))
+    {
+      puts("pciindex version " PCIUTILS_VERSION);
+      return 0;
+    }
+  if (argc < 2)
+    usage();
+
+  if (!strcmp(argv[1], "build"))
+    {
+      default_threads();
+      while ((i = getopt(argc - 1, argv + 1, "j:")) != -1)
+	switch (i)
+	  {
+	  case 'j':
+	    num_threads = strtol(optarg, &end, 10);
+	    if (*end || num_threads < 1 || num_threads > MAX_THREADS)
+	      die("-j: Number of threads must be between 1 and %d", MAX_THREADS);
+	    break;
+	  default:
+	    usage();
+	  }
+      if (argc - 1 - optind < 2)
+	usage();
+      index_init(&out);
+      index_build(&out, argv + optind + 2, argc - 1 - optind - 1);
+      index_write(&out, argv[optind + 1]);
+    }
+  else if (!strcmp(argv[1], "merge"))
+    {
+      if (argc < 4)
+	usage();
+      index_init(&out);
+      for (i = 3; i < argc; i++)
+	index_merge(&out, argv[i]);
+      index_write(&out, argv[2]);
+    }
+  else if (!strcmp(argv[1], "query"))
+    {
+      while ((i = getopt(argc - 1, argv + 1, "w:s:g:")) != -1)
+	switch (i)
+	  {
+	  case 'w':
+	    parse_conds(optarg);
+	    break;
+	  case 's':
+	    shown = parse_field_list(optarg, shown, &num_shown);
+	    break;
+	  case 'g':
+	    grouped = parse_field_list(optarg, grouped, &num_grouped);
+	    break;
+	  default:
+	    usage();
+	  }
+      if (optind != argc - 2)
+	usage();
+      if (num_shown && num_grouped)
+	die("Options -s and -g are mutually exclusive");
+      query(argv[argc - 1]);
+    }
+  else if (!strcmp(argv[1], "fields") && argc == 2)
+    list_fields();
+  else
+    usage();
+
+  return 0;
+}
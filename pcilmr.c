@@ -23,31 +23,35 @@ scan_links(struct pci_access *pacc, bool only_ready)
     printf("Links ready for margining:\n");
   else
     printf("Links with Lane Margining at the Receiver capabilities:\n");
-  bool flag = true;
-  for (struct pci_dev *p = pacc->devices; p; p = p->next)
+  struct margin_pair *pairs;
+  int pairs_n = margin_find_links(pacc, &pairs);
+  for (int i = 0; i < pairs_n; i++)
     {
-      if (pci_find_cap(p, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED) && margin_port_is_down(p))
-        {
-          struct pci_dev *down = NULL;
-          struct pci_dev *up = NULL;
-          margin_find_pair(pacc, p, &down, &up);
-
-          if (down && margin_verify_link(down, up) && pci_find_cap(up, PCI_EXT_CAP_ID_LMR, PCI_CAP_EXTENDED))
-            {
-              margin_log_bdfs(down, up);
-              if (!only_ready && (margin_check_ready_bit(down) || margin_check_ready_bit(up)))
-                printf(" - Ready");
-              printf("\n");
-              flag = false;
-            }
-        }
+      margin_log_bdfs(pairs[i].down, pairs[i].up);
+      if (!only_ready && (margin_check_ready_bit(pairs[i].down) || margin_check_ready_bit(pairs[i].up)))
+        printf(" - Ready");
+      printf("\n");
     }
-  if (flag)
+  if (!pairs_n)
     printf("Links not found or you don't have enough privileges.\n");
+  free(pairs);
   pci_cleanup(pacc);
   exit(0);
 }
 
+/* Process options of libpci preceding the mode, return the first other option */
+static int
+margin_parse_generic_args(struct pci_access *pacc, int argc, char **argv, struct option *long_options)
+{
+  int c;
+
+  /* The arguments are modified by parsing, but they may still have to be saved to a checkpoint */
+  while ((c = getopt_long(argc, argv, "+" GENERIC_OPTIONS, long_options, NULL)) != -1)
+    if (c == '?' || !parse_generic_option(c, pacc, optarg ? xstrdup(optarg) : NULL))
+      break;
+  return c;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -63,7 +67,33 @@ main(int argc, char **argv)
   struct margin_results **results;
   u8 *results_n;
 
+  int regressions = 0;
+
   pacc = pci_alloc();
+  margin_global_logging = true;
+
+  struct option long_options[]
+    = { { .name = "margin", .has_arg = no_argument, .flag = NULL, .val = 0 },
+        { .name = "scan", .has_arg = no_argument, .flag = NULL, .val = 1 },
+        { .name = "full", .has_arg = no_argument, .flag = NULL, .val = 2 },
+        { .name = "resume", .has_arg = required_argument, .flag = NULL, .val = 3 },
+        { 0, 0, 0, 0 } };
+
+  opterr = 0;
+  int c = margin_parse_generic_args(pacc, argc, argv, long_options);
+
+  if (c == 3)
+    {
+      /* Continue with the command line saved in the checkpoint */
+      if (optind != argc)
+        die("Invalid arguments\n\n%s", usage);
+      margin_checkpoint_load(optarg, &argc, &argv);
+      optind = 1;
+      c = margin_parse_generic_args(pacc, argc, argv, long_options);
+      if (c == 1 || c == 3)
+        die("Invalid command line in the checkpoint\n");
+    }
+
   pci_init(pacc);
   pci_scan_bus(pacc);
 
@@ -77,18 +107,6 @@ main(int argc, char **argv)
         }
     }
 
-  margin_global_logging = true;
-
-  struct option long_options[]
-    = { { .name = "margin", .has_arg = no_argument, .flag = NULL, .val = 0 },
-        { .name = "scan", .has_arg = no_argument, .flag = NULL, .val = 1 },
-        { .name = "full", .has_arg = no_argument, .flag = NULL, .val = 2 },
-        { 0, 0, 0, 0 } };
-
-  opterr = 0;
-  int c;
-  c = getopt_long(argc, argv, "+", long_options, NULL);
-
   switch (c)
     {
       case -1: /* no options (strings like component are possible) */
@@ -121,6 +139,11 @@ main(int argc, char **argv)
   results_n = xmalloc(links_n * sizeof(*results_n));
   checks_status_ports = xmalloc(links_n * sizeof(*checks_status_ports));
 
+  margin_catch_signals();
+
+  margin_progress_start(com_args->status_file, com_args->dwell_time);
+  if (com_args->json_file)
+    margin_results_json_open(com_args->json_file);
   for (int i = 0; i < links_n; i++)
     {
       enum margin_test_status args_status;
@@ -130,45 +153,38 @@ main(int argc, char **argv)
           checks_status_ports[i] = false;
           results[i] = xmalloc(sizeof(*results[i]));
           results[i]->test_status = args_status;
+          results[i]->recvn = 0;
+          margin_results_json(&links[i], results[i]);
           continue;
         }
 
       checks_status_ports[i] = true;
-      struct margin_params params;
-      struct margin_link_args *link_args = &links[i].args;
-
-      for (int j = 0; j < link_args->recvs_n; j++)
-        {
-          if (margin_read_params(
-                pacc, link_args->recvs[j] == 6 ? links[i].up_port.dev : links[i].down_port.dev,
-                link_args->recvs[j], &params))
-            {
-              u8 steps_t = link_args->steps_t ? link_args->steps_t : params.timing_steps;
-              u8 steps_v = link_args->steps_v ? link_args->steps_v : params.volt_steps;
-              u8 parallel_recv = link_args->parallel_lanes > params.max_lanes + 1 ?
-                                   params.max_lanes + 1 :
-                                   link_args->parallel_lanes;
-
-              u8 step_multiplier
-                = link_args->lanes_n / parallel_recv + ((link_args->lanes_n % parallel_recv) > 0);
-
-              com_args->steps_utility += steps_t * step_multiplier;
-              if (params.ind_left_right_tim)
-                com_args->steps_utility += steps_t * step_multiplier;
-              if (params.volt_support)
-                {
-                  com_args->steps_utility += steps_v * step_multiplier;
-                  if (params.ind_up_down_volt)
-                    com_args->steps_utility += steps_v * step_multiplier;
-                }
-            }
-        }
+      for (int j = 0; j < links[i].args.recvs_n; j++)
+        margin_progress_plan(margin_recv_plan_provisional(&links[i].args));
     }
 
-  for (int i = 0; i < links_n; i++)
+#ifdef PCI_HAVE_PTHREADS
+  /* Each Link would get its own trace writing to the same file */
+  if (com_args->concurrent_links > 1 && pacc->method == PCI_ACCESS_TRACE)
+    {
+      fprintf(stderr, "Warning: Accesses are traced, margining Links one by one.\n");
+      com_args->concurrent_links = 1;
+    }
+  bool concurrent = com_args->concurrent_links > 1;
+  if (concurrent)
+    margin_test_links_concurrently(pacc, links, links_n, checks_status_ports, results, results_n);
+#else
+  bool concurrent = false;
+#endif
+
+  for (int i = 0; i < links_n && !margin_interrupted; i++)
     {
       if (checks_status_ports[i])
-        results[i] = margin_test_link(&links[i], &results_n[i]);
+        {
+          if (concurrent)
+            continue;
+          results[i] = margin_test_link(&links[i], &results_n[i]);
+        }
       else
         {
           results_n[i] = 1;
@@ -186,6 +202,17 @@ main(int argc, char **argv)
       printf("\n----\n\n");
     }
 
+  margin_checkpoint_close();
+  margin_results_json_close();
+  margin_progress_finish(margin_interrupted ? "interrupted" : "done");
+  if (margin_interrupted)
+    {
+      printf("\nMargining interrupted, Links were restored to their original settings.\n");
+      if (margin_checkpoint_name())
+        printf("Continue with: pcilmr --resume %s\n", margin_checkpoint_name());
+      exit(1);
+    }
+
   if (com_args->run_margin)
     {
       printf("Results:\n");
@@ -205,6 +232,10 @@ main(int argc, char **argv)
             margin_results_save_csv(results[i], results_n[i], &links[i]);
           printf("\n");
         }
+
+      if (com_args->baseline)
+        regressions = margin_baseline_check(com_args->baseline, com_args->baseline_threshold,
+                                            links, results, results_n, links_n);
     }
 
   for (int i = 0; i < links_n; i++)
@@ -216,5 +247,5 @@ main(int argc, char **argv)
   free(checks_status_ports);
 
   pci_cleanup(pacc);
-  return 0;
+  return regressions ? 2 : 0;
 }